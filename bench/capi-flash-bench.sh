@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# Copyright 2016, 2017 International Business Machines
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Usage: capi-flash-bench.sh [-s <image size KB>] [-o <sim options>]
+#                            [-x <extra capi-flash args>]
+#
+# Runs capi-flash against the simulated card (--sim) for BPIx16, SPIx4 and
+# SPIx8 and prints words/s, syscalls per word and wall time per phase.
+
+size_kb=8192
+sim_opts=""
+extra_args=""
+bench_root=$(dirname "$0")
+capi_flash=$bench_root/../capi-flash
+
+while getopts ":s:o:b:x:h" opt; do
+  case ${opt} in
+    s) size_kb=$OPTARG ;;
+    o) sim_opts=$OPTARG ;;
+    b) capi_flash=$OPTARG ;;
+    x) extra_args=$OPTARG ;;
+    h) echo "Usage: $0 [-s <image size KB>] [-o <sim options>] [-b <capi-flash>] [-x <args>]"
+       exit 0 ;;
+    *) echo "Invalid option: -$OPTARG" >&2; exit 1 ;;
+  esac
+done
+
+if [ ! -x "$capi_flash" ]; then
+  echo "capi-flash not found at $capi_flash" >&2
+  exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Random payload, so verify really compares data
+head -c $((size_kb * 1024)) /dev/urandom > $tmp/primary.bin
+head -c $((size_kb * 1024)) /dev/urandom > $tmp/secondary.bin
+
+# run <type> <block size KB> <capi-flash address options...>
+function run() {
+  local type=$1 bs=$2
+  shift 2
+  printf "== %-6s %d KB image, %d KB blocks\n" $type $size_kb $bs
+  rm -f $tmp/flash.sim
+  $capi_flash -v --sim $tmp/flash.sim ${sim_opts:+--sim-opts $sim_opts} \
+    --type $type --blocksize $bs $extra_args "$@" > $tmp/out 2>&1
+  local rc=$?
+  grep "words/s" $tmp/out
+  grep "^Error" $tmp/out
+  if [ $rc -ne 0 ] || grep -q "Miscompare" $tmp/out; then
+    echo "   FAILED (rc $rc)"
+    failed=1
+  fi
+  echo
+}
+
+failed=0
+run BPIx16 256 --address 0x02000000 --file $tmp/primary.bin
+run SPIx4  64  --address 0x01000000 --file $tmp/primary.bin
+run SPIx8  64  --address 0x01000000 --file $tmp/primary.bin \
+               --address2 0x03000000 --file2 $tmp/secondary.bin
+exit $failed
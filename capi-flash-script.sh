@@ -44,6 +44,10 @@ flash_block_size=""
 flash_type=""
 
 reset_factory=0
+resume=""
+skip_same=""
+background=""
+split=""
 # Print usage message helper function
 function usage() {
   echo "Usage:  sudo ${program} [OPTIONS]"
@@ -51,10 +55,17 @@ function usage() {
   echo "    [-f] force execution without asking."
   echo "         warning: use with care e.g. for automation."
   echo "    [-r] Reset adapter to factory before writing to flash."
+  echo "    [-R] Resume an interrupted flash of the same image where it stopped."
+  echo "    [-k] Skip flashing if the card holds the image already."
+  echo "    [-b] Background: stage the image while the card keeps running,"
+  echo "         paced and at idle priority. The card is not reset, load"
+  echo "         the new image later with capi-reset <card> user."
+  echo "    [-s] SPIx8: split one combined image over both flashes instead"
+  echo "         of taking a primary and a secondary file."
   echo "    [-V] Print program version (${version})"
   echo "    [-h] Print this help message."
-  echo "    <path-to-bin-file>"
-  echo "    <path-to-secondary-bin-file> (Only for SPIx8 device)"
+  echo "    <path-to-bin-file> (.bin, .bit, .mcs or .rbf, may be compressed)"
+  echo "    <path-to-secondary-bin-file> (Only for SPIx8 device, not with -s)"
   echo
   echo "Utility to flash/write bitstreams to CAPI FPGA cards."
   echo "Please ensure that you are using the right bitstream data."
@@ -65,7 +76,7 @@ function usage() {
 }
 
 # Parse any options given on the command line
-while getopts ":C:fVhr" opt; do
+while getopts ":C:fVhrRkbs" opt; do
   case ${opt} in
       C)
       card=$OPTARG
@@ -76,6 +87,18 @@ while getopts ":C:fVhr" opt; do
       r)
       reset_factory=1
       ;;
+      R)
+      resume="--resume"
+      ;;
+      k)
+      skip_same="--skip-same"
+      ;;
+      b)
+      background="--background"
+      ;;
+      s)
+      split="--split"
+      ;;
       V)
       echo "${version}" >&2
       exit 0
@@ -96,6 +119,11 @@ while getopts ":C:fVhr" opt; do
 done
 
 shift $((OPTIND-1))
+
+if [ -n "$background" ] && [ "$reset_factory" -eq 1 ]; then
+  printf "${bold}ERROR:${normal} -r resets the card, it does not go with -b\n"
+  exit 1
+fi
 # now do something with $@
 
 ulimit -c unlimited
@@ -121,42 +149,8 @@ if [ $capi_check -eq 0 ]; then
   exit 1
 fi
 
-LockDir=/var/cxl/capi-flash-script.lock
-
 # make cxl dir if not present
-mkdir -p `dirname $LockDir`
-
-# mutual exclusion
-if ! mkdir $LockDir 2>/dev/null; then
-  echo
-  printf "${bold}ERROR:${normal} Existing LOCK => Another instance of this script is maybe running\n"
-
-  DateLastBoot=`who -b | awk '{print $3 " " $4}'`
-  EpochLastBoot=`date -d "$DateLastBoot" +%s`
-
-  EpochLockDir=`stat --format=%Y $LockDir`
-  DateLockDir=`date --date @$EpochLockDir`
-
-  echo
-  echo "Last BOOT:              `date --date @$EpochLastBoot` ($EpochLastBoot)"
-  echo "Last LOCK modification: $DateLockDir ($EpochLockDir)"
-
-  echo;echo "======================================================="
-  if [ $EpochLockDir -lt $EpochLastBoot ]; then
-     echo "$LockDir modified BEFORE last boot"
-     echo "LOCK is not supposed to still be here"
-     echo "  ==> Deleting and recreating $LockDir"
-     rmdir $LockDir
-     mkdir $LockDir
-  else
-     echo "$LockDir modified AFTER last boot"
-     printf "${bold}ERROR:${normal} Another instance of this script is running\n"
-     echo "Exiting..."
-     exit 1
-  fi
-
-fi
-trap 'rm -rf "$LockDir"' EXIT
+mkdir -p /var/cxl
 
 # get number of cards in system
 n=`ls -d /sys/class/cxl/card* | awk -F"/sys/class/cxl/card" '{ print $2 }' | wc -w`
@@ -175,27 +169,22 @@ printf "\n${bold}Current date:${normal}\n$(date)\n\n"
 # print table header
 printf "${bold}%-7s %-30s %-29s %-20s %s${normal}\n" "#" "Card" "Flashed" "by" "Last Image"
 
-# print card information and flash history
-for i in `seq 0 $((n - 1))`; do
-  p[$i]=$(cat /sys/class/cxl/card$i/device/subsystem_device)
-  # check for legacy device
-  if [[ ${p[$i]:0:6} == "0x04af" ]]; then
-    p[$i]=$(cat /sys/class/cxl/card$i/psl_revision | xargs printf "0x%.4X")
-  fi
+# print card information and flash history, capi-flash inventory finds
+# the cards and their psl-devices entry in one go
+while read -r i id board fpga address block interface secondary; do
+  [[ $board == "-" ]] && continue
+  [[ $address == "-" ]] && address=""
+  [[ $block == "-" ]] && block=""
+  [[ $secondary == "-" ]] && secondary=""
+  board_vendor[$i]=$board
+  fpga_type[$i]=$fpga
+  flash_partition[$i]=$address
+  flash_block[$i]=$block
+  flash_interface[$i]=$interface
+  flash_secondary[$i]=$secondary
   f=$(cat /var/cxl/card$i)
-  while IFS='' read -r line || [[ -n $line ]]; do
-    if [[ ${line:0:6} == ${p[$i]:0:6} ]]; then
-      parse_info=($line)
-      board_vendor[$i]=${parse_info[1]}
-      fpga_type[$i]=${parse_info[2]}
-      flash_partition[$i]=${parse_info[3]}
-      flash_block[$i]=${parse_info[4]}
-      flash_interface[$i]=${parse_info[5]}
-      flash_secondary[$i]=${parse_info[6]}
-      printf "%-7s %-30s %-29s %-20s %s\n" "card$i" "${line:6:25}" "${f:0:29}" "${f:30:20}" "${f:51}"
-    fi
-  done < "$package_root/psl-devices"
-done
+  printf "%-7s %-30s %-29s %-20s %s\n" "card$i" "$board $fpga" "${f:0:29}" "${f:30:20}" "${f:51}"
+done < <($package_root/capi-flash inventory --output shell --psl-devices "$package_root/psl-devices")
 
 printf "\n"
 
@@ -226,16 +215,23 @@ fi
 
 printf "\n"
 
-# check file type
-FILE_EXT=${1##*.}
+# only one flash or reset per card at a time
+lock_card $c
+
+# check file type, compressed, .bit and .mcs images are decoded by capi-flash
+FILE_NAME=$1
+case $FILE_NAME in
+  *.gz|*.xz|*.zst) FILE_NAME=${FILE_NAME%.*} ;;
+esac
+FILE_EXT=${FILE_NAME##*.}
 if [[ ${fpga_type[$c]} == "Altera" ]]; then
   if [[ $FILE_EXT != "rbf" ]]; then
     printf "${bold}ERROR: ${normal}Wrong file extension: .rbf must be used for boards with Altera FPGA\n"
     exit 0
   fi
 elif [[ ${fpga_type[$c]} == "Xilinx" ]]; then
-  if [[ $FILE_EXT != "bin" ]]; then
-    printf "${bold}ERROR: ${normal}Wrong file extension: .bin must be used for boards with Xilinx FPGA\n"
+  if [[ $FILE_EXT != "bin" && $FILE_EXT != "bit" && $FILE_EXT != "mcs" ]]; then
+    printf "${bold}ERROR: ${normal}Wrong file extension: .bin, .bit or .mcs must be used for boards with Xilinx FPGA\n"
     exit 0
   fi
 else
@@ -299,13 +295,18 @@ fi
 
 # Deal with the second argument
 if [ $flash_type == "SPIx8" ]; then
-    if [ $# -eq 1 ]; then
-      printf "${bold}ERROR:${normal} Input argument missing. The selected device is SPIx8 and needs both primary and secondary bin files\n"
+    if [ $# -eq 1 ] && [ -z "$split" ]; then
+      printf "${bold}ERROR:${normal} Input argument missing. The selected device is SPIx8 and needs both primary and secondary bin files (or -s to split one)\n"
+      usage
+      exit 1
+    fi
+    if [ $# -gt 1 ] && [ -n "$split" ]; then
+      printf "${bold}ERROR:${normal} -s splits one file, give only the primary\n"
       usage
       exit 1
     fi
     #Check the second file
-    if [[ ! -e $2 ]]; then
+    if [ $# -gt 1 ] && [[ ! -e $2 ]]; then
       printf "${bold}ERROR:${normal} $2 not found\n"
       usage
       exit 1
@@ -316,6 +317,9 @@ if [ $flash_type == "SPIx8" ]; then
         printf "${bold}ERROR:${normal} The second address must be assigned in file psl-device\n"
         exit 1
     fi
+elif [ -n "$split" ]; then
+    printf "${bold}ERROR:${normal} -s is for SPIx8 cards, card$c is $flash_type\n"
+    exit 1
 fi
 
 
@@ -324,7 +328,7 @@ if (($force != 1)); then
   # prompt to confirm
   while true; do
     printf "Will flash ${bold}card$c${normal} with: \n\t${bold}$1${normal}"
-    if [ $flash_type == "SPIx8" ]; then
+    if [ $flash_type == "SPIx8" ] && [ $# -gt 1 ]; then
         printf "\nand \t${bold}$2${normal}\n"
     fi
     read -p "Do you want to continue? [y/n] " yn
@@ -336,7 +340,7 @@ if (($force != 1)); then
   done
 else
   printf "Continue to flash ${bold}$1${normal} ";
-  if [ $flash_type == "SPIx8" ]; then
+  if [ $flash_type == "SPIx8" ] && [ $# -gt 1 ]; then
     printf "and ${bold}$2${normal} "
   fi
   printf "to ${bold}card$c${normal}\n"
@@ -345,7 +349,7 @@ fi
 printf "\n"
 
 # update flash history file
-if [ $flash_type == "SPIx8" ]; then
+if [ $flash_type == "SPIx8" ] && [ $# -gt 1 ]; then
   printf "%-29s %-20s %s %s\n" "$(date)" "$(logname)" $1 $2 > /var/cxl/card$c
 else
   printf "%-29s %-20s %s\n" "$(date)" "$(logname)" $1 > /var/cxl/card$c
@@ -361,13 +365,21 @@ if [ "$reset_factory" -eq 1 ]; then
   reset_card $c factory "Preparing card for flashing"
 fi
 
-trap 'kill -TERM $PID; perst_factory $c' TERM INT
+if [ -n "$background" ]; then
+  # the card keeps running its image, only stop the flash
+  trap 'kill -TERM $PID' TERM INT
+else
+  trap 'kill -TERM $PID; perst_factory $c' TERM INT
+fi
 # flash card with corresponding binary
-if [ $flash_type == "SPIx8" ]; then
-  # SPIx8 needs two file inputs (primary/secondary)
-  $package_root/capi-flash --type $flash_type --file $1 --file2 $2   --card $c --address $flash_address --address2 $flash_address2 --blocksize $flash_block_size &
+if [ $flash_type == "SPIx8" ] && [ $# -gt 1 ]; then
+  # SPIx8 with two file inputs (primary/secondary)
+  $package_root/capi-flash --type $flash_type --file $1 --file2 $2   --card $c --address $flash_address --address2 $flash_address2 --blocksize $flash_block_size --locked --repair $resume $skip_same $background &
+elif [ $flash_type == "SPIx8" ]; then
+  # SPIx8 with one combined image, capi-flash splits it over both flashes
+  $package_root/capi-flash --type $flash_type --file $1              --card $c --address $flash_address --address2 $flash_address2 --blocksize $flash_block_size --locked --repair $resume $skip_same $background $split &
 else
-  $package_root/capi-flash --type $flash_type --file $1              --card $c --address $flash_address --blocksize $flash_block_size &
+  $package_root/capi-flash --type $flash_type --file $1              --card $c --address $flash_address --blocksize $flash_block_size --locked --repair $resume $skip_same $background &
 fi
 
 PID=$!
@@ -375,7 +387,14 @@ wait $PID
 trap - TERM INT
 wait $PID
 RC=$?
-if [ $RC -eq 0 ]; then
+if [ $RC -eq 0 ] && [ -n "$background" ]; then
+  # staged next to the running image, the reset is a step of its own
+  if [[ $1 =~ "oc_" ]]; then
+    echo "Staged, reset the card to load it: capi-reset $c factory"
+  else
+    echo "Staged, reset the card to load it: capi-reset $c user"
+  fi
+elif [ $RC -eq 0 ]; then
   # reset card only if Flashing was good
   if [[ $1 =~ "oc_" ]]
   then
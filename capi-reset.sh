@@ -50,8 +50,10 @@ if [ -n "$1" ]; then
                     printf "${bold}ERROR:${normal} Only supports \"factory\" or \"user\".\n"
                     exit 1
                 fi
+            lock_card $card
             reset_card $card $region "Resetting CAPI Adapter $card"
         else
+            lock_card $card
             reset_card $card factory "Resetting CAPI Adapter $card"
             #printf "Bad argument\n"
            # exit 1
@@ -61,6 +63,7 @@ else
         #Find all the CAPI cards in the system
         cardnums=`ls -d /sys/class/cxl/card* | awk -F"/sys/class/cxl/card" '{ print $2 }'`
         for i in $cardnums; do
-                reset_card $i factory "Resetting CAPI Adapter $i"
+                lock_card $i
         done
+        reset_cards factory $cardnums
 fi
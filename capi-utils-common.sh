@@ -34,85 +34,45 @@ function perst_factory() {
   fi
   date +"%T %a %b %d %Y" >> $log_file 
   echo "Flash failure. Resetting to factory" >> $log_file 
-  rm -rf "/var/cxl/capi-flash-script.lock"
 }
 
-# Test if a card reset is done
-function testcard
-{
-  cardId=$1
-  cxlDir="/sys/class/cxl/card$cardId"
-  cxlafuFile="/dev/cxl/afu$cardId.0m"
-  cxlDirStatus=0  # 0->still here, 1->disapeared so reset is on going, 2-> first dir reappeared 3->back here so reset is done
-  
-  maxCount=50000
-  count=0
-  while true
-    do
-      case $cxlDirStatus in
-        0)
-          [ $count -eq 0 ] && printf "." && count=$maxCount
-          [ ! -d $cxlDir ] && cxlDirStatus=1 && printf "\n$cxlDir deleted\n"
-        ;;
-        1)
-          [ $count -eq 0 ] && printf "." && count=$maxCount
-          [ -d $cxlDir ] && cxlDirStatus=2 && printf "\n$cxlDir recreated\n"
-        ;;
-      	2)
-      	  [ $count -eq 0 ] && printf "." && count=$maxCount
-      	  [ -e $cxlafuFile ] && cxlDirStatus=3 && printf "$cxlafuFile recreated\n"
-        ;;
-        3)
-          break
-        ;;
-      esac
-      count=$((count-1))
-  done
+# Lock a card for this script and its children, until it exits. Same
+# lock as capi-flash and capi-flashd take: flock on /var/cxl/card<N>.lock,
+# which says who holds it. Pass --locked to capi-flash.
+function lock_card() {
+  lock_file=/var/cxl/card$1.lock
+  mkdir -p /var/cxl
+  exec {lock_fd}<>$lock_file
+  if ! flock -n $lock_fd; then
+    printf "${bold}ERROR:${normal} card$1 is locked by $(head -n 1 $lock_file)\n"
+    exit 1
+  fi
+  echo "pid=$$ start=$(date +%s) cmd=$(basename $0)" > $lock_file
 }
 
-export -f testcard  # function exportation in order to allow using it with timeout command below
-
-# Reset a card and control what image gets loaded
+# Reset a card and control what image gets loaded. capi-flash --reset
+# waits for the card on kernel uevents and saves/restores
+# eeh_max_freezes: default number of resets allowed per PCI device per
+# hour, if the card is reset too often it would be fenced away.
 function reset_card() {
   # Timeout for reset
   reset_timeout=60
 
-  # eeh_max_freezes: default number of resets allowed per PCI device per
-  # hour. Backup/restore this counter, since if card is rest too often,
-  # it would be fenced away.
-  if [ -f /sys/kernel/debug/powerpc/eeh_max_freezes ]; then
-    eeh_max_freezes=`cat /sys/kernel/debug/powerpc/eeh_max_freezes`
-    echo 100000 > /sys/kernel/debug/powerpc/eeh_max_freezes
-  fi
-
   [ -n "$3" ] && printf "$3\n" || printf "Preparing to reset card\n"
   [ -n "$4" ] && reset_timeout=$4
-  # sleep 5  ## Why ?
-  printf "Resetting card $1: "
-  c=$1
-  printf $2 > /sys/class/cxl/card$c/load_image_on_perst
-  ic=`cat /sys/class/cxl/card$c/load_image_on_perst`
-  printf "load_image_on_perst is set to \"$ic\". Reset!\n"
-  
-  cxlDir="/sys/class/cxl/card$c"
-
-  printf 1 > $cxlDir/reset  # reset requested
+  printf "Resetting card $1: load_image_on_perst is set to \"$2\". Reset!\n"
 
-  if timeout $reset_timeout bash -c "testcard $c"
+  if $package_root/capi-flash --reset $2 --card $1 --reset-timeout $reset_timeout --locked
   then
     ret_status=0
   else
     ret_status=1
   fi
-  
-  printf "\n"
 
-  if [ -f /sys/kernel/debug/powerpc/eeh_max_freezes ]; then
-    echo $eeh_max_freezes > /sys/kernel/debug/powerpc/eeh_max_freezes
-  fi
+  printf "\n"
 
   if [ $ret_status -ne 0 ]; then
-    printf "${bold}ERROR:${normal} Reset timeout has occurred\n\n"
+    printf "${bold}ERROR:${normal} Reset of card $1 failed\n\n"
     exit 1
   else
 # Uncomment the 2 following lines should you want to give access to all users
@@ -125,6 +85,27 @@ function reset_card() {
   fi
 }
 
+# Reset several cards at once, the caller has locked them: reset_cards
+# region card... They come back in about the time one card takes, the
+# EEH budget is raised once for all of them.
+function reset_cards() {
+  region=$1
+  shift
+  cards=""
+  for c in "$@"; do
+    cards="$cards --card $c"
+  done
+  printf "Resetting cards $*: load_image_on_perst is set to \"$region\". Reset!\n"
+
+  if ! $package_root/capi-flash --reset $region $cards --locked
+  then
+    printf "\n${bold}ERROR:${normal} Reset of cards $* failed\n\n"
+    exit 1
+  fi
+  printf "\nNew /dev/cxl/* device will need sudo authorization\n"
+  printf "Reset complete\n\n"
+}
+
 # stop on non-zero response
 set -e
 
@@ -34,15 +34,22 @@
 #include <endian.h>
 #include <time.h>
 #include <assert.h>
+#include "libcapiflash.h"
 
 #define MAX_STRING_SIZE 1024
 #define CXL_SYSFS_PATH "/sys/class/cxl/card"
 #define CXL_CONFIG "/device/config"
+#define CXL_LOCK_DIR "/var/cxl"
+#define RESET_TIMEOUT 60		/* Seconds for a card to come back */
+#define BACKGROUND_CPU_PCT 10		/* --background without a limit */
+#define REPAIR_PASSES 3			/* --repair gives up after that */
+#define PSL_DEVICES "/usr/local/lib/capi-utils/psl-devices"
 
 #define IBM_PCIID           0x1014
 #define CAPI_PCIID          0x0477
 #define CAPI_LEGACY0        0x04cf
 #define CAPI_LEGACY1        0x0601
+#define PSL_LEGACY_SUBSYS   0x04af    /* psl-devices lists psl_revision */
 
 #define PCI_ID              0x0       /* Offset for */
 #define SUB_DEV_ID          0x2c      /* Address for Subsystem Device */
@@ -70,15 +77,10 @@
 #define FLASH_RDATA_VALID   (1 << 11)
 #define FLASH_DATA_OFFSET   0x5C
 #define FLASH_CHECK_BIT(X,Y,Z)  (((X) & (Y)) == (Z)) 
-// Flash error codes
-#define FLASH_READY_TIMEOUT 1
-#define FLASH_ERASE_TIMEOUT 2
-#define FLASH_PROG_TIMEOUT  4
-#define FLASH_PORT_TIMEOUT  99
-#define FLASH_ERR_CFG_WRITE 100
-#define FLASH_ERR_CFG_READ  200
 
 #define FLASH_READ_SIZE                   0x200           /* 512 Words */
+#define FLASH_READ_MAX                    0x400           /* 10 bit remain counter */
+#define FLASH_REMAIN_MASK                 0x3ff
 #define DEFAULT_USER_FLASH_ADDRESS        0x02000000
 
 #define DEFAULT_FACTORY_FLASH_ADDRESS_PRI       0x0
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPI_FLASH_CFG_H_
+#define _CAPI_FLASH_CFG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Config space access through positional I/O. Every access is a single
+ * pread()/pwrite(), contiguous registers (e.g. ADDR, SIZE and CNTL) can
+ * be written or read with one syscall. The accessors count syscalls and,
+ * with cfg_timing set, the time spent per register. The counters are per
+ * thread, i.e. per card when flashing cards in parallel.
+ */
+
+#define CFG_SPACE_SIZE          4096
+
+struct cfg_reg_stat {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long syscalls;
+	uint64_t ns;
+};
+
+struct cfg_stats {
+	unsigned long syscalls;
+	struct cfg_reg_stat reg[CFG_SPACE_SIZE / 4];
+};
+
+extern bool cfg_timing;
+
+int read_config_word(int cfg, int offset, int *retVal);
+int write_config_word(int cfg, int offset, int data);
+int read_config_words(int cfg, int offset, int *vals, int n);
+int write_config_words(int cfg, int offset, const int *vals, int n);
+
+struct cfg_stats *cfg_stats(void);
+void cfg_stats_reset(void);
+
+#endif
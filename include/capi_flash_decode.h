@@ -0,0 +1,97 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _CAPI_FLASH_DECODE_H_
+#define _CAPI_FLASH_DECODE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Image file formats, decoded while the image is read so no converted
+ * copy is ever written:
+ *
+ *   bin  raw, also Altera .rbf: passed through
+ *   bit  Xilinx bitstream: the header (design, part, date) is skipped,
+ *        the bitstream behind it is the .bin write_bitstream makes
+ *   mcs  Intel hex, e.g. write_cfgmem output: records are parsed as
+ *        they come, addresses are taken relative to the first data
+ *        record and gaps read as erased flash
+ *
+ * The format is told by the file's first bytes, not its name.
+ *
+ * A decoded stream can be split for SPIx8, whose two quad SPI flashes
+ * each hold one nibble of every bitstream byte: the primary the low
+ * nibbles (D[3:0]), the secondary the high ones (D[7:4]), two bytes of
+ * the combined image to one byte of each flash, first byte in the high
+ * nibble as the flash shifts it out first.
+ *
+ * The decoder only goes forward. It reads its input through fn, which
+ * must start from the beginning of the file again when the decoder is
+ * restarted.
+ */
+
+enum { DECODE_BIN, DECODE_BIT, DECODE_MCS };
+enum { DECODE_WHOLE, DECODE_PRIMARY, DECODE_SECONDARY };
+
+#define DECODE_IN	(64 * 1024)
+
+typedef ssize_t (*decode_read_fn)(void *arg, void *buf, size_t len);
+
+struct decoder {
+	int format;
+	int half;
+	decode_read_fn read;
+	void *arg;
+	uint64_t out;			/* Bytes decoded (after the split) */
+	bool eof;
+	/* Input, for the .bit header and .mcs records */
+	unsigned char in[DECODE_IN];
+	size_t in_len;
+	size_t in_pos;
+	bool in_eof;
+	/* .bit */
+	uint64_t bit_len;		/* Bitstream bytes behind the header */
+	uint64_t bit_left;
+	char design[64];
+	char part[32];
+	/* .mcs */
+	bool mcs_started;
+	uint32_t mcs_first;		/* Address of the first data record */
+	uint32_t mcs_base;		/* Extended address */
+	uint64_t mcs_pos;		/* Next byte, from mcs_first */
+	unsigned char rec[255];
+	unsigned rec_len;
+	unsigned rec_pos;
+	uint64_t rec_at;
+	unsigned long line;
+	/* Split: combined bytes waiting for their pair */
+	unsigned char pair[DECODE_IN];
+	char err[128];
+};
+
+int decode_format(const unsigned char *head, size_t len);
+const char *decode_name(int format);
+/* Reads the .bit header, 0 or EINVAL with err set */
+int decode_start(struct decoder *d, int format, int half, decode_read_fn fn,
+			void *arg);
+/* Up to len decoded bytes, less only at the end; -1 on error */
+ssize_t decode_read(struct decoder *d, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPI_FLASH_DIGEST_H_
+#define _CAPI_FLASH_DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Digests of flash contents for --audit.
+ *
+ * crc32c() is the Castagnoli CRC as computed by e.g. "crc32c" or
+ * iSCSI, start with crc = 0 and feed the data in any chunking. It uses
+ * the CPU's CRC32C instructions where present (SSE4.2, ARMv8 CRC) and
+ * a slice-by-8 table otherwise.
+ *
+ * The SHA-256 is the same as sha256sum of the image file.
+ */
+
+#define SHA256_LEN      32
+
+struct sha256 {
+	uint32_t h[8];
+	uint64_t len;		/* Bytes hashed so far */
+	uint8_t buf[64];
+	unsigned n;		/* Bytes in buf */
+};
+
+struct flash_digest {
+	uint32_t crc;
+	struct sha256 sha;
+	uint64_t len;
+};
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_impl(void);
+
+void sha256_init(struct sha256 *c);
+void sha256_update(struct sha256 *c, const void *buf, size_t len);
+void sha256_final(struct sha256 *c, uint8_t out[SHA256_LEN]);
+
+void digest_init(struct flash_digest *d);
+void digest_update(struct flash_digest *d, const void *buf, size_t len);
+/* hex must hold 2 * SHA256_LEN + 1 chars */
+void digest_final(struct flash_digest *d, char *hex);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPI_FLASH_FINGERPRINT_H_
+#define _CAPI_FLASH_FINGERPRINT_H_
+
+#include <stdint.h>
+
+/*
+ * Fingerprints of the images on a card, --skip-same.
+ *
+ * One line per partition address, recorded when an image verified
+ * without a miscompare and dropped before that partition is erased, so
+ * a write that does not finish leaves no fingerprint behind:
+ *   address 0x02000000 type BPIx16 blocksize 256 subsys 0x0605
+ *     size 3000003 blocks 12 crc32c 3e552e82 sha256 ... time 1792301098
+ * (on one line). The store is /var/cxl/card<N>.fingerprint and is only
+ * changed with the card locked.
+ */
+
+#define FINGERPRINT_MAX         16      /* Partitions per card */
+#define FINGERPRINT_SAMPLE      8       /* Blocks read back, --sample */
+
+struct fingerprint {
+	uint32_t address;
+	char type[8];
+	int block_size;
+	unsigned subsys;
+	uint64_t size;
+	int blocks;
+	uint32_t crc32c;
+	char sha256[65];
+	long time;
+};
+
+/* ENOENT if there is none for address */
+int fingerprint_find(const char *path, uint32_t address,
+			struct fingerprint *fp);
+/* Replaces the one for the same address */
+int fingerprint_store(const char *path, const struct fingerprint *fp);
+int fingerprint_drop(const char *path, uint32_t address);
+/* Same image in the same geometry: everything but the time matches */
+int fingerprint_match(const struct fingerprint *a,
+			const struct fingerprint *b);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPI_FLASH_JOURNAL_H_
+#define _CAPI_FLASH_JOURNAL_H_
+
+#include <stdint.h>
+
+/*
+ * Flash journal, --journal and --resume.
+ *
+ * The image is written JOURNAL_SEGMENT_BLOCKS at a time, each segment
+ * erased, programmed and verified before the next one. The journal
+ * records which image goes where (card, type, block size, address,
+ * size, SHA-256) and how many blocks of it are confirmed, saved after
+ * every segment. --resume starts at the first unconfirmed block if the
+ * journal is for the same image at the same place, from the start if
+ * not. A run that completes removes its journal.
+ *
+ * The file is text, replaced by rename() so it is never half written:
+ *   capi-flash-journal 1
+ *   card 0 type SPIx8 blocksize 256
+ *   round 0 address 0x00000000 size 3000003 blocks 12 confirmed 4 sha256 ...
+ */
+
+#define JOURNAL_SEGMENT_BLOCKS  16
+
+struct journal_round {
+	uint32_t address;
+	uint64_t size;
+	char sha256[65];		/* Hex, "" if the round is not used */
+	int blocks;
+	int confirmed;			/* Blocks programmed and verified */
+};
+
+struct flash_journal {
+	const char *path;
+	int card;
+	char type[8];
+	int block_size;
+	struct journal_round round[2];	/* Primary and Secondary */
+};
+
+/* ENOENT if there is no journal, EINVAL if it can not be parsed */
+int journal_load(struct flash_journal *j, const char *path);
+int journal_save(const struct flash_journal *j);
+int journal_remove(const struct flash_journal *j);
+/* Blocks of round in j which prev has confirmed already, 0 if none */
+int journal_confirmed(const struct flash_journal *prev,
+			const struct flash_journal *j, int round);
+
+#endif
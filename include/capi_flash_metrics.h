@@ -0,0 +1,87 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPI_FLASH_METRICS_H_
+#define _CAPI_FLASH_METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Machine readable metrics, --metrics json|jsonl.
+ *
+ * json writes one document with an object per card when all cards are
+ * done. jsonl streams an event per line while flashing: phase begin and
+ * end, every block with its words/s, and the card summary at the end.
+ * All times are CLOCK_MONOTONIC nanoseconds.
+ *
+ * One struct flash_metrics per card; it is only used by the thread that
+ * flashes that card.
+ */
+
+#define METRICS_MAX_PHASES      16
+#define METRICS_SLOWEST         8       /* Slowest blocks per phase */
+
+struct metrics_poll {
+	const char *name;
+	unsigned long waits;
+	unsigned long polls;
+	unsigned long sleeps;
+	uint64_t ns;
+	uint64_t max_ns;
+};
+
+struct metrics_phase {
+	const char *name;
+	int round;			/* 1 for the SPIx8 secondary */
+	uint64_t ns;
+	unsigned long words;
+	unsigned long syscalls;
+	unsigned long block_words;
+	int nblocks;
+	int max_blocks;
+	int *block;			/* Block numbers and their time */
+	uint64_t *block_ns;
+};
+
+struct flash_metrics {
+	int card;
+	const char *type;
+	int rc;
+	uint64_t ns;
+	int nphases;
+	struct metrics_phase phase[METRICS_MAX_PHASES];
+	uint64_t t_block;		/* End of the previous block */
+	char *json;			/* Card summary for the json document */
+	struct flash_metrics *next;
+};
+
+int metrics_open(const char *format, const char *path);
+/* s as a quoted and escaped JSON string, "" for NULL */
+void metrics_json_str(FILE *f, const char *s);
+void metrics_close(void);
+
+struct flash_metrics *metrics_card_start(int card, const char *type);
+void metrics_phase_start(struct flash_metrics *m, const char *name, int round,
+			unsigned long block_words);
+void metrics_block(struct flash_metrics *m, int block);
+void metrics_phase_end(struct flash_metrics *m, uint64_t ns,
+			unsigned long words, unsigned long syscalls);
+void metrics_card_end(struct flash_metrics *m, int rc, uint64_t ns,
+			const struct metrics_poll *polls, int npolls,
+			unsigned long cfg_syscalls, unsigned long img_syscalls);
+
+#endif
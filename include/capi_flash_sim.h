@@ -0,0 +1,61 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPI_FLASH_SIM_H_
+#define _CAPI_FLASH_SIM_H_
+
+#include <stdbool.h>
+
+/*
+ * Simulated CAPI config space.
+ *
+ * Stands in for /sys/class/cxl/card%d/device/config so that capi-flash
+ * can be exercised and benchmarked without a card. The flash contents
+ * live in a sparse backing file, so a later run against the same file
+ * sees what an earlier run programmed.
+ *
+ * cfg_sim_open() returns the fd of the backing file. It is used like the
+ * config fd: read_config_word()/write_config_word() check cfg_sim_active()
+ * and route the register access to the simulator.
+ */
+
+#define CFG_SIM_MAX_FD          1024
+
+/* Default latencies, override with --sim-opts */
+#define CFG_SIM_ERASE_US        200     /* per block */
+#define CFG_SIM_PROG_NS         0       /* per word */
+#define CFG_SIM_READ_NS         0       /* per word */
+#define CFG_SIM_RESET_US        10
+#define CFG_SIM_FIFO_DEPTH      16      /* words the write port can buffer */
+
+int cfg_sim_open(const char *path, const char *opts, bool is_spi,
+		int block_size_kb);
+void cfg_sim_close(int fd);
+/* Why cfg_sim_open() failed on this thread, errno is set as well */
+const char *cfg_sim_error(void);
+/* Words written to DATA the flash did not take, lost like on the card */
+unsigned long cfg_sim_errors(int fd);
+int cfg_sim_read(int fd, int offset, int *val);
+int cfg_sim_write(int fd, int offset, int val);
+
+extern void *cfg_sim_tab[CFG_SIM_MAX_FD];
+
+static inline bool cfg_sim_active(int fd)
+{
+	return fd >= 0 && fd < CFG_SIM_MAX_FD && cfg_sim_tab[fd] != NULL;
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPI_FLASH_TRACE_H_
+#define _CAPI_FLASH_TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Config space trace, capi-flash --trace.
+ *
+ * Every register access of read_config_words()/write_config_words() is
+ * recorded with its offset, value, result, start time and duration.
+ * Each thread (a card, when flashing in parallel) is a stream and fills
+ * its own buffer without a lock; full buffers are handed to a writer
+ * thread which appends them to the file. Little endian, as written by
+ * the host:
+ *
+ *   header  "CAPIFLTR" u32 version u32 0
+ *   chunk   u32 bytes  u16 stream  u16 0  u64 t_base (ns since start)
+ *           records, bytes of them
+ *
+ * A record starts with a tag byte:
+ *   TRACE_WRITE   write, else read
+ *   TRACE_ERROR   the pread()/pwrite() failed, value is 0
+ *   TRACE_SAME    value left out, the same as the register's last one
+ *                 in this chunk
+ *   TRACE_CONT    next register of the same syscall: no times
+ *   TRACE_NOTE    text from the library, e.g. the card opened
+ * then varint dt_ns (start since the previous record of the chunk, the
+ * first one since t_base) and varint dur_ns unless TRACE_CONT, varint
+ * register (offset / 4) and u32 value unless TRACE_SAME. A note has
+ * varint dt_ns, varint length and the text instead.
+ */
+
+#define TRACE_MAGIC		"CAPIFLTR"
+#define TRACE_VERSION		1
+
+#define TRACE_WRITE		0x01
+#define TRACE_ERROR		0x02
+#define TRACE_SAME		0x04
+#define TRACE_CONT		0x08
+#define TRACE_NOTE		0x80
+
+#define TRACE_BUF_SIZE		(256 * 1024)	/* Per chunk */
+#define TRACE_MAX_BUFS		64		/* Queued before a stream waits */
+#define TRACE_MAX_STREAMS	64
+#define TRACE_REGS		1024		/* 4 KB config space */
+
+extern bool trace_active;
+
+int trace_open(const char *path);
+/* Write out what the streams hold and stop the writer. Call it once
+   the threads which access the config space are done. */
+int trace_close(void);
+void trace_access(int offset, const int *vals, int n, bool write, bool ok,
+			uint64_t t0, uint64_t t1);
+void trace_note(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+/* Time base for trace_access(), CLOCK_MONOTONIC ns */
+uint64_t trace_now(void);
+
+/* Reading a trace back, capi-flash-trace */
+struct trace_rec {
+	int stream;
+	uint8_t tag;
+	uint64_t t_ns;			/* Start, since the trace started */
+	uint64_t dur_ns;
+	int offset;
+	uint32_t value;
+	char note[256];
+};
+
+struct trace_reader {
+	FILE *f;
+	uint8_t *chunk;
+	uint32_t len;
+	uint32_t pos;
+	int stream;
+	uint64_t t;
+	uint64_t dur;
+	uint32_t val[TRACE_REGS];
+	uint32_t gen[TRACE_REGS];	/* val[] is of chunk gen */
+	uint32_t chunk_gen;
+	unsigned long chunks;
+};
+
+/* 0, ENOENT or EINVAL if it is no trace */
+int trace_reader_open(struct trace_reader *r, const char *path);
+/* 1: rec is the next record, 0: end of trace, -EINVAL: trace damaged */
+int trace_reader_next(struct trace_reader *r, struct trace_rec *rec);
+void trace_reader_close(struct trace_reader *r);
+
+#endif
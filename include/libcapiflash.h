@@ -0,0 +1,375 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LIBCAPIFLASH_H_
+#define _LIBCAPIFLASH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libcapiflash: erase, program, verify and read back the flash of a CAPI
+ * card from within a process. capi-flash is a command line front end to
+ * it.
+ *
+ * A struct capi_flash is an open card. It may be used by one thread at a
+ * time, except for capi_flash_cancel() which may be called from any
+ * thread. Different cards can be driven from different threads at the
+ * same time.
+ *
+ * Flash addresses are the ones used on the capi-flash command line: byte
+ * addresses, the library converts them to 4B word addresses for BPIx16.
+ *
+ * All functions return 0 on success, an errno value or one of the
+ * FLASH_* codes below. capi_flash_error() has the message for the last
+ * error on a card. Nothing is printed, progress and anything worth
+ * telling the user is passed to the event callback.
+ */
+
+// Flash error codes
+#define FLASH_READY_TIMEOUT 1
+#define FLASH_ERASE_TIMEOUT 2
+#define FLASH_PROG_TIMEOUT  4
+#define FLASH_VERIFY_MISMATCH 8
+#define FLASH_PORT_TIMEOUT  99
+#define FLASH_ERR_CFG_WRITE 100
+#define FLASH_ERR_CFG_READ  200
+#define FLASH_CANCELED      125		/* capi_flash_cancel() */
+
+struct capi_flash;
+struct capi_flash_image;
+
+struct capi_flash_params {
+	const char *type;		/* BPIx16 (NULL), SPIx4, SPIx8 */
+	int block_size_kb;		/* 0: 256 KB */
+	int credits;			/* Words per port poll, -1 type default */
+	int read_window;		/* BPIx16 words per read, 0: 512 */
+	const char *sim_file;		/* Simulated card backed by this file */
+	const char *sim_opts;
+	bool locked;			/* Caller holds the card lock */
+	bool probe;			/* Only look at the config space: read
+					   only, not locked, no flash ops */
+	bool no_trim;			/* Program and verify an image's erased
+					   (0xFF) tail too, not only erase it */
+};
+
+/* What capi_flash_open() found on the card */
+struct capi_flash_info {
+	const char *cfg_path;
+	int vendor;
+	int device;
+	int subsys;
+	int psl_id;			/* psl-devices key: subsys, the PSL
+					   revision of legacy cards */
+	int vsec_offset;
+	int vsec_rev;
+	int vsec_size;
+	bool legacy;			/* Version 0.10 register layout */
+	int addr_reg;
+	int size_reg;
+	int cntl_reg;
+	int data_reg;
+	bool is_spi;
+	int block_words;
+	int credits;
+	int read_window;
+};
+
+enum capi_flash_op {
+	CAPI_FLASH_OP_ERASE,
+	CAPI_FLASH_OP_PROGRAM,
+	CAPI_FLASH_OP_VERIFY,
+	CAPI_FLASH_OP_COMPARE,		/* Delta: read back and compare */
+	CAPI_FLASH_OP_READ,		/* capi_flash_read/audit/dump() */
+};
+
+enum capi_flash_event_type {
+	CAPI_FLASH_EV_START,		/* op starts */
+	CAPI_FLASH_EV_BLOCK,		/* block of op done */
+	CAPI_FLASH_EV_MISCOMPARE,	/* address, data, expected */
+	CAPI_FLASH_EV_WAIT,		/* Still waiting, every 5 s */
+	CAPI_FLASH_EV_NOTE,		/* msg for the verbose user */
+	CAPI_FLASH_EV_DONE,		/* op done with rc */
+	CAPI_FLASH_EV_COMMIT,		/* Blocks before block are verified */
+};
+
+struct capi_flash_event {
+	enum capi_flash_event_type type;
+	enum capi_flash_op op;
+	int block;			/* Block number from the op's address,
+					   COMPARE DONE: blocks which differ */
+	uint32_t address;		/* Flash address of a miscompare */
+	uint32_t data;
+	uint32_t expected;
+	int rc;
+	uint64_t ns;			/* DONE: time the op took */
+	unsigned long words;		/* DONE: words written or read */
+	unsigned long syscalls;		/* DONE: config space and image */
+	const char *msg;
+};
+
+typedef void (*capi_flash_event_fn)(struct capi_flash *h,
+			const struct capi_flash_event *ev, void *arg);
+
+/* Wait statistics per kind of wait, see capi_flash_poll_stats() */
+#define CAPI_FLASH_POLL_BUCKETS 32
+
+struct capi_flash_poll_stat {
+	const char *name;
+	unsigned long waits;
+	unsigned long polls;
+	unsigned long sleeps;
+	uint64_t ns;
+	uint64_t max_ns;
+	unsigned long bucket[CAPI_FLASH_POLL_BUCKETS];	/* < 2^n us */
+};
+
+struct capi_flash_digest {
+	uint32_t crc32c;
+	char sha256[65];		/* Hex */
+	uint64_t len;
+};
+
+/*
+ * Open card (/sys/class/cxl/card<card>/device/config, or the simulator)
+ * and locate the flash registers. On error *h is still set if it could
+ * be allocated, so capi_flash_error() can tell why; close it as usual.
+ *
+ * The card is locked until capi_flash_close(): flock() on
+ * /var/cxl/card<card>.lock (<sim_file>.lock), which holds the owner's
+ * pid, start time and command. EBUSY if another process has it.
+ *
+ * With params.probe only capi_flash_info() is of use. The card is not
+ * locked and its flash is not touched, not even on close, so a card
+ * another process is flashing can be looked at.
+ */
+int capi_flash_open(struct capi_flash **h, int card,
+			const struct capi_flash_params *p);
+void capi_flash_close(struct capi_flash *h);
+/*
+ * Take that lock for a caller which keeps the card locked across opens
+ * with params.locked set. Close *fd to unlock. On error owner has who
+ * holds the lock (EBUSY) or why it could not be taken.
+ */
+int capi_flash_lock(int card, const char *sim_file, int *fd, char *owner,
+			size_t len);
+const struct capi_flash_info *capi_flash_info(struct capi_flash *h);
+const char *capi_flash_error(struct capi_flash *h);
+void capi_flash_set_event_cb(struct capi_flash *h, capi_flash_event_fn fn,
+			void *arg);
+/*
+ * Stop the op running on h at the next block or slow poll. It and every
+ * later op on h return FLASH_CANCELED, the card is left reset.
+ */
+void capi_flash_cancel(struct capi_flash *h);
+/*
+ * Background flashing next to a live AFU: hold the ops on h to rate
+ * config space accesses per second and cpu_pct percent of a CPU, each
+ * 0 for no limit. The calling thread sleeps off the excess before it
+ * waits for the card, and slow waits sleep instead of spinning. The
+ * time slept shows as the "pace" poll stat. Applies to later ops.
+ */
+int capi_flash_set_pace(struct capi_flash *h, unsigned long rate,
+			int cpu_pct);
+/*
+ * Words per write port poll for later programs, as params.credits: -1
+ * the flash type's default, 0 or 1 the per word handshake.
+ */
+void capi_flash_set_credits(struct capi_flash *h, int credits);
+const struct capi_flash_poll_stat *capi_flash_poll_stats(struct capi_flash *h,
+			int *n);
+/*
+ * Record every config space access of the process, on all cards, into
+ * a binary trace for capi-flash-trace to analyse or replay. Records are
+ * buffered per thread and written by a thread of their own. Close it
+ * when the ops are done; it returns a write error, if any. Threads may
+ * go on and trace again after another open. Only the first 64 threads
+ * are traced, the trace has a note of those left out.
+ */
+int capi_flash_trace_open(const char *path);
+int capi_flash_trace_close(void);
+
+/*
+ * Images: a file (mapped), a pipe or device (read), a gzip/xz/zstd
+ * compressed file (decoded on the fly) or a buffer owned by the caller.
+ *
+ * Files may be raw (.bin, .rbf), a Xilinx .bit, whose header is
+ * skipped, or Intel hex (.mcs), decoded as it is read; the format is
+ * told by the content. capi_flash_image_open_half() takes the primary
+ * or secondary flash's nibbles of a combined SPIx8 image (primary
+ * D[3:0], secondary D[7:4]) instead of two files.
+ */
+enum capi_flash_image_half {
+	CAPI_FLASH_IMAGE_WHOLE,
+	CAPI_FLASH_IMAGE_PRIMARY,
+	CAPI_FLASH_IMAGE_SECONDARY,
+};
+
+/* On error *img is set like *h by capi_flash_open() */
+int capi_flash_image_open(struct capi_flash_image **img, const char *path);
+int capi_flash_image_open_half(struct capi_flash_image **img,
+			const char *path, enum capi_flash_image_half half);
+int capi_flash_image_buffer(struct capi_flash_image **img, const void *buf,
+			size_t len);
+/*
+ * A compressed image is read through once to learn its size, unless a
+ * pass (digest, op) did already. 0 if that fails, see the image error.
+ */
+uint64_t capi_flash_image_size(struct capi_flash_image *img);
+const char *capi_flash_image_codec(struct capi_flash_image *img);
+/* "bin", "bit" or "mcs" */
+const char *capi_flash_image_format(struct capi_flash_image *img);
+const char *capi_flash_image_error(struct capi_flash_image *img);
+/* CRC32C and SHA-256 of the image, as of the (decompressed) file */
+int capi_flash_image_digest(struct capi_flash_image *img,
+			struct capi_flash_digest *d);
+/* Syscalls issued reading the image so far */
+unsigned long capi_flash_image_syscalls(struct capi_flash_image *img);
+void capi_flash_image_close(struct capi_flash_image *img);
+
+/* Blocks an image of this size takes, as erased */
+int capi_flash_blocks(struct capi_flash *h, uint64_t size);
+
+/*
+ * Write, verify and delta program and verify an image only up to its
+ * last block which is not all 0xFF. The blocks after it are erased and
+ * left so, unless params.no_trim. A delta still compares all blocks.
+ *
+ * Write, segments, delta and repair drop the partition's fingerprint
+ * (/var/cxl/card<card>.fingerprint, <sim_file>.fingerprint) before they
+ * erase, so a write that does not finish leaves no stale one behind.
+ */
+
+/* Erase the image's blocks at address and program it */
+int capi_flash_write(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img);
+/*
+ * Erase, program and verify segment blocks at a time, starting at block
+ * *next. Each verified segment moves *next on and is passed to the event
+ * callback as COMMIT, a write that was interrupted can be resumed from
+ * there. FLASH_VERIFY_MISMATCH if a segment does not verify.
+ */
+int capi_flash_write_segments(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, int segment, int *next);
+/* Compare the flash at address with the image, ndiff: words differing */
+int capi_flash_verify(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, unsigned long *ndiff);
+/*
+ * Block map of a verify: bit b % 8 of map[b / 8] is set if block b from
+ * address differs. CAPI_FLASH_MAP_BYTES(capi_flash_blocks()) bytes.
+ */
+#define CAPI_FLASH_MAP_BYTES(nblocks)	(((nblocks) + 7) / 8)
+#define CAPI_FLASH_MAP_TEST(map, b)	((map)[(b) / 8] & (1 << ((b) % 8)))
+int capi_flash_verify_map(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, uint8_t *map,
+			unsigned long *ndiff);
+/*
+ * Erase and program again only the blocks set in map and verify them.
+ * The ones which still differ stay set, ndiff: their words differing.
+ */
+int capi_flash_repair(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, uint8_t *map,
+			unsigned long *ndiff);
+/* Compare only n blocks of the image, block numbers ascending */
+int capi_flash_verify_blocks(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, const int *blocks, int n,
+			unsigned long *ndiff);
+/*
+ * Erase and program only blocks which differ, then verify those.
+ * FLASH_VERIFY_MISMATCH if some still differ: nmis words, in the blocks
+ * left set in map (see CAPI_FLASH_MAP_BYTES), for capi_flash_repair().
+ */
+int capi_flash_delta(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, int *ndiff_blocks);
+int capi_flash_delta_map(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, uint8_t *map,
+			int *ndiff_blocks, unsigned long *nmis);
+int capi_flash_read(struct capi_flash *h, uint32_t address, void *buf,
+			size_t len);
+/*
+ * Digest len bytes of flash at address. With an image the flash is also
+ * compared with it and the image digested, FLASH_VERIFY_MISMATCH is
+ * returned if they differ.
+ */
+int capi_flash_audit(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, uint64_t len,
+			struct capi_flash_digest *flash,
+			struct capi_flash_digest *image, unsigned long *ndiff);
+/* Read len bytes at address and write them to fd from a writer thread */
+int capi_flash_dump(struct capi_flash *h, uint32_t address, uint64_t len,
+			int fd, uint64_t *stall_ns);
+
+/*
+ * A card's line of the psl-devices board table:
+ *   <psl_id> <board> <fpga> [<address> <blocksize> [<type> [<address2>]]]
+ */
+struct capi_flash_board {
+	int psl_id;
+	char board[64];
+	char fpga[32];
+	char type[8];			/* Flash interface, BPIx16 if not listed */
+	int block_size_kb;		/* 0: no address and block size listed */
+	uint32_t address;
+	uint32_t address2;		/* SPIx8 secondary, if has_address2 */
+	bool has_address2;
+	const char *table;		/* path, or "built-in" */
+};
+
+/*
+ * Look psl_id up in the psl-devices file at path, or in the copy built
+ * into the library if path is NULL or does not exist. ENOENT if the
+ * card is not listed.
+ */
+int capi_flash_board(const char *path, int psl_id,
+			struct capi_flash_board *b);
+
+/* When the steps of a card reset were seen, ns after the reset write */
+struct capi_flash_reset_times {
+	uint64_t gone_ns;		/* Card's sysfs directory removed */
+	uint64_t back_ns;		/* and back */
+	uint64_t done_ns;		/* AFU device back: reset done */
+	unsigned long uevents;		/* Kernel uevents about the card */
+	bool polled;			/* No uevents, paths checked every 10 ms */
+};
+
+/*
+ * Reset card to load the region's image, "user" or "factory", like
+ * capi-reset, and wait for it to come back. Sleeps on kernel uevents
+ * until then, ETIMEDOUT after timeout_s. The card must not be open, the
+ * caller should hold its lock (capi_flash_lock()).
+ */
+int capi_flash_reset(int card, const char *region, int timeout_s,
+			struct capi_flash_reset_times *t);
+/*
+ * Reset n cards at once and wait for all of them, each with timeout_s
+ * from its own reset. t[i] and rc[i] are card i's; returns the first
+ * card's error, if any. eeh_max_freezes is raised once for the lot and
+ * restored after the last card, and not while another reset, in this
+ * process or another, still needs it.
+ */
+int capi_flash_reset_cards(const int *cards, int n, const char *region,
+			int timeout_s, struct capi_flash_reset_times *t, int *rc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,11 +19,24 @@
 #include <getopt.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <dirent.h>
 #include "capi_flash.h"
+#include "capi_flash_cfg.h"
+#include "capi_flash_digest.h"
+#include "capi_flash_metrics.h"
+#include "capi_flash_journal.h"
+#include "capi_flash_fingerprint.h"
 
 static const char *version = GIT_VERSION;
 static bool quiet = false;
 static int verbose = 0;
+static __thread char err_tag[16];	/* "cardN: " on job threads */
+
+static __thread struct flash_metrics *metrics;	/* --metrics, per card */
 
 #define dprintf(fmt, ...) do { \
 	if (!quiet) \
@@ -31,7 +44,7 @@ static int verbose = 0;
 	} while (0)
 
 #define eprintf(fmt, ...) do { \
-		fprintf(stderr, "Error: "fmt, ## __VA_ARGS__); \
+		fprintf(stderr, "Error: %s"fmt, err_tag, ## __VA_ARGS__); \
 	} while (0)
 
 #define vprintf(fmt, ...) do { \
@@ -44,249 +57,1599 @@ static int verbose = 0;
 		printf( fmt, ## __VA_ARGS__); \
 	} while (0)
 
-static int read_config_word(int cfg, int offset, int *retVal)
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Per operation wait latencies, -v */
+static void print_poll_stats(struct capi_flash *h)
+{
+	static const char *units[] = { "us", "ms", "s" };
+	const struct capi_flash_poll_stat *ps;
+	int op, b, n;
+
+	ps = capi_flash_poll_stats(h, &n);
+	vprintf("Poll latency:\n");
+	for (op = 0; op < n; op++) {
+		const struct capi_flash_poll_stat *p = &ps[op];
+
+		if (0 == p->waits)
+			continue;
+		vprintf("  %-6s %10lu waits %12lu polls %8lu sleeps  avg %.1f us  max %.1f us\n",
+			p->name, p->waits, p->polls, p->sleeps,
+			p->ns / 1e3 / p->waits, p->max_ns / 1e3);
+		for (b = 0; b < CAPI_FLASH_POLL_BUCKETS; b++) {
+			unsigned long lim = 1UL << b;
+			int u = 0;
+
+			if (0 == p->bucket[b])
+				continue;
+			while (lim >= 1000 && u < 2) {
+				lim /= 1000;
+				u++;
+			}
+			vprintf("    < %4lu %-2s %10lu\n", lim, units[u],
+				p->bucket[b]);
+		}
+	}
+}
+
+static void print_phase(const char *name, uint64_t ns, unsigned long words,
+			unsigned long calls)
+{
+	double secs = ns / 1e9;
+
+	vprintf("%-8s: %9.3f s %10lu words %12.0f words/s %6.2f syscalls/word\n",
+		name, secs, words, secs > 0 ? words / secs : 0.0,
+		words ? (double)calls / words : 0.0);
+	metrics_phase_end(metrics, ns, words, calls);
+}
+
+/* Config space accesses per flash register, -vv */
+static void print_cfg_stats(const struct capi_flash_info *info)
+{
+	static const char *names[] = { "ADDR", "SIZE", "CNTL", "DATA" };
+	int regs[] = { info->addr_reg, info->size_reg, info->cntl_reg,
+		       info->data_reg };
+	struct cfg_stats *st = cfg_stats();
+	unsigned i;
+
+	vprintf1("Config space: %lu syscalls\n", st->syscalls);
+	vprintf1("  Reg   Offset %10s %10s %10s %10s %8s\n", "reads", "writes",
+		"syscalls", "ms", "ns/acc");
+	for (i = 0; i < 4; i++) {
+		struct cfg_reg_stat *r = &st->reg[regs[i] / 4];
+		unsigned long acc = r->reads + r->writes;
+
+		vprintf1("  %-5s 0x%03x  %10lu %10lu %10lu %10.1f %8.0f\n",
+			names[i], regs[i], r->reads, r->writes, r->syscalls,
+			r->ns / 1e6, acc ? (double)r->ns / acc : 0.0);
+	}
+}
+
+/* Message for rc from the last call on h */
+static const char *card_error(struct capi_flash *h, int rc)
 {
-	lseek(cfg, offset, SEEK_SET);
-	int ret = read(cfg, retVal, 4);
-	if (4 == ret)
+	const char *msg = capi_flash_error(h);
+
+	return *msg ? msg : strerror(rc);
+}
+
+/*
+ * Progress output of one card, driven by the library's events. Phase
+ * timing goes to -v and --metrics, miscompares to stderr.
+ */
+struct card_progress {
+	int round;
+	int block_words;
+	const char *read_name;		/* "Audit" or "Dump" */
+	const char *read_metric;	/* "audit" or "dump" */
+	int print_cnt;
+	uint64_t ns[CAPI_FLASH_OP_READ + 1];
+	int ndiff_blocks;		/* Delta */
+	enum capi_flash_op op;		/* Last started */
+	struct flash_journal *journal;	/* --journal */
+	unsigned long miscompares;	/* All, not only the ones printed */
+};
+
+static const char *op_names[] = {
+	[CAPI_FLASH_OP_ERASE]   = "Erase",
+	[CAPI_FLASH_OP_PROGRAM] = "Program",
+	[CAPI_FLASH_OP_VERIFY]  = "Verify",
+	[CAPI_FLASH_OP_COMPARE] = "Compare",
+	[CAPI_FLASH_OP_READ]    = "Read",
+};
+
+static const char *op_metrics_names[] = {
+	[CAPI_FLASH_OP_ERASE]   = "erase",
+	[CAPI_FLASH_OP_PROGRAM] = "program",
+	[CAPI_FLASH_OP_VERIFY]  = "verify",
+	[CAPI_FLASH_OP_COMPARE] = "compare",
+	[CAPI_FLASH_OP_READ]    = "read",
+};
+
+/* A segment verified, the blocks before block need not be written again */
+static void card_journal_commit(struct card_progress *cp, int block)
+{
+	int rc;
+
+	cp->journal->round[cp->round].confirmed = block;
+	rc = journal_save(cp->journal);
+	if (0 != rc)
+		eprintf("\nCan not update journal %s: %s\n", cp->journal->path,
+			strerror(rc));
+}
+
+/* Which blocks a verify found different, runs of blocks as first-last */
+static void print_miscompare_map(const uint8_t *map, int nblocks,
+			unsigned long ndiff)
+{
+	char list[MAX_STRING_SIZE] = "";
+	size_t len = 0;
+	int b, n, nbad = 0;
+
+	for (b = 0; b < nblocks; b += n ? n : 1) {
+		for (n = 0; b + n < nblocks && CAPI_FLASH_MAP_TEST(map, b + n);
+		     n++)
+			;
+		if (0 == n)
+			continue;
+		nbad += n;
+		if (len >= sizeof(list) - 32) {
+			if (!strstr(list, "..."))
+				len += snprintf(list + len, sizeof(list) - len,
+						",...");
+			continue;
+		}
+		len += snprintf(list + len, sizeof(list) - len, "%s%d",
+				len ? "," : "", b);
+		if (n > 1)
+			len += snprintf(list + len, sizeof(list) - len, "-%d",
+					b + n - 1);
+	}
+	eprintf("%lu words differ in %d of %d blocks: %s\n", ndiff, nbad,
+		nblocks, list);
+}
+
+/*
+ * After a verify or delta left ndiff words differing in the blocks set
+ * in map: tell which, and with --repair program them again, up to
+ * REPAIR_PASSES times. *pass: the repairs run.
+ */
+static int flash_card_repair(struct capi_flash *h, bool repair,
+			struct card_progress *cp, int address,
+			struct capi_flash_image *img, uint8_t *map, int nblocks,
+			unsigned long *ndiff, int *pass)
+{
+	int rc = 0;
+
+	for (*pass = 0; 0 == rc && *ndiff; (*pass)++) {
+		print_miscompare_map(map, nblocks, *ndiff);
+		if (!repair || REPAIR_PASSES == *pass)
+			break;
+		dprintf("Repairing Flash, pass %d\n", *pass + 1);
+		rc = capi_flash_repair(h, address, img, map, ndiff);
+	}
+	if (0 != rc) {
+		eprintf("%s\n", card_error(h, rc));
+		return rc;
+	}
+	if (*ndiff) {
+		eprintf("Verify failed%s\n", repair ?
+			", the blocks do not take the image" :
+			", --repair programs only those blocks again");
+		return FLASH_VERIFY_MISMATCH;
+	}
+	/* All blocks good now, the fingerprint may be kept */
+	if (*pass)
+		cp->miscompares = 0;
+	return 0;
+}
+
+static void card_event(struct capi_flash *h, const struct capi_flash_event *ev,
+			void *arg)
+{
+	struct card_progress *cp = arg;
+	const char *name = op_names[ev->op];
+	const char *mname = op_metrics_names[ev->op];
+
+	(void)h;
+	if (CAPI_FLASH_OP_READ == ev->op && cp->read_name) {
+		name = cp->read_name;
+		mname = cp->read_metric;
+	}
+	switch (ev->type) {
+	case CAPI_FLASH_EV_START:
+		if (CAPI_FLASH_OP_ERASE == ev->op)
+			dprintf("Erasing Flash\n");
+		else if (CAPI_FLASH_OP_PROGRAM == ev->op)
+			dprintf("\n\nProgramming Flash\nWriting Block:\n");
+		else if (CAPI_FLASH_OP_VERIFY == ev->op)
+			dprintf("Verifying Flash\nReading Block:\n");
+		else
+			dprintf("Reading Block:\n");
+		cp->op = ev->op;
+		metrics_phase_start(metrics, mname, cp->round, cp->block_words);
+		break;
+	case CAPI_FLASH_EV_BLOCK:
+		dprintf("\r %d", ev->block);
+		/* Segmented writes verify within the program phase */
+		if (ev->op == cp->op)
+			metrics_block(metrics, ev->block);
+		break;
+	case CAPI_FLASH_EV_MISCOMPARE:
+		cp->miscompares++;
+		/* Per word with -v, a verify sums up the blocks when done */
+		if (verbose && cp->print_cnt < 1024) {
+			eprintf("Data Miscompare @: %08x --> %08x expected %08x\n",
+				ev->address, ev->data, ev->expected);
+			cp->print_cnt++;
+		}
+		break;
+	case CAPI_FLASH_EV_WAIT:
+		printf(".");
+		break;
+	case CAPI_FLASH_EV_NOTE:
+		vprintf("\n%s\n", ev->msg);
+		break;
+	case CAPI_FLASH_EV_DONE:
+		if (CAPI_FLASH_OP_ERASE != ev->op)
+			dprintf("\n");
+		if (CAPI_FLASH_OP_PROGRAM == ev->op && 0 == cp->ndiff_blocks)
+			dprintf("\n");
+		if (CAPI_FLASH_OP_COMPARE == ev->op && 0 == ev->rc) {
+			cp->ndiff_blocks = ev->block;
+			dprintf("%d of %lu blocks differ\n", ev->block,
+				ev->words / cp->block_words);
+		}
+		cp->ns[ev->op] = ev->ns;
+		if (0 == ev->rc)
+			print_phase(name, ev->ns, ev->words, ev->syscalls);
+		break;
+	case CAPI_FLASH_EV_COMMIT:
+		if (cp->journal)
+			card_journal_commit(cp, ev->block);
+		break;
+	}
+}
+
+static void help(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+		"	  -h, --help       This help\n"
+		"	  -v, --verbose    More Verbose\n"
+		"	  -V, --version    Print version\n"
+		"	  -q, --quiet      No messages\n"
+		"	  -t, --type       BPIx16, SPIx4, SPIx8 (default: BPIx16)\n"
+		"	  -p, --factory    Program Factory Side (NEW)\n"
+		"	  -a, --address    Flash Address (default: 0x%8.8x)\n"
+		"	  -A, --address2   Flash Address Secondary (optional, only for SPIx8)\n"
+		"	  -b, --blocksize  Flash Block Size (default: %d KB)\n"
+		"	  -C, --card       Capi Card number (default: %d)\n"
+		"	  -f, --file       File to flash: .bin, .rbf, .bit or .mcs\n"
+		"	  -F, --file2      File to flash Secondary (only for SPIx8)\n"
+		"	  -Z, --split      SPIx8 without --file2: split --file, a combined\n"
+		"	                   image, by nibbles between both flashes\n"
+		"	  -d, --delta      Erase and program only blocks which differ\n"
+		"	  -x, --no-trim    Program and verify the image's trailing 0xFF\n"
+		"	                   blocks too instead of only erasing them\n"
+		"	  -y, --repair     Erase and program again only the blocks which\n"
+		"	                   failed the verify, up to %d times\n"
+		"	  -u, --audit      Only read back the flash, print its CRC32C and\n"
+		"	                   SHA-256 and compare it with --file if given\n"
+		"	  -l, --size       Bytes to audit without --file, or to dump\n"
+		"	  -D, --dump       Read --size bytes at --address into this file,\n"
+		"	                   - is stdout. No erase or program\n"
+		"	  -E, --dump2      Dump the Secondary address too (SPIx8)\n"
+		"	  -s, --stream     Poll the write port once per burst of words\n"
+		"	  -c, --credits    Words per burst for --stream (default per type)\n"
+		"	  -w, --read-window BPIx16 words per read request, up to %d\n"
+		"	                   (default: %d)\n"
+		"	  -j, --job        Flash one more card in parallel, repeat per card:\n"
+		"	                   card=N,type=T,address=A,file=F[,address2=A,file2=F]\n"
+		"	                   [,blocksize=B][,factory][,delta][,audit][,size=N]\n"
+		"	                   [,dump=F][,dump2=F][,stream][,journal=F][,resume]\n"
+		"	                   [,skip][,sample=N][,rate=N][,cpu=P][,notrim]\n"
+		"	                   [,credits=N][,readwin=N][,sim=F][,repair][,split]\n"
+		"	  -J, --journal    Write segment by segment and record the verified\n"
+		"	                   blocks in this file\n"
+		"	  -R, --resume     Continue an interrupted write from the journal\n"
+		"	                   (default: /var/cxl/card<N>.journal)\n"
+		"	  -k, --skip-same  Do not write a partition which holds the image\n"
+		"	                   already, by its fingerprint and a readback\n"
+		"	  -n, --sample     Blocks to read back for --skip-same (default: %d)\n"
+		"	  -N, --numa       Run on the CPUs of the card's NUMA node\n"
+		"	  -B, --background Stage an image next to a live AFU: SCHED_IDLE,\n"
+		"	                   paced (default: %d%% CPU per card), no reset\n"
+		"	  -X, --max-rate   Config space accesses per second per card\n"
+		"	  -U, --cpu-budget Percent of a CPU per card\n"
+		"	  -I, --cpus       Run on these CPUs only, e.g. 0-3,8\n"
+		"	  -L, --locked     The caller holds the card lock, do not take it\n"
+		"	                   (capi-flash-script)\n"
+		"	  -r, --reset      Reset the card to load the user or factory image\n"
+		"	                   and wait until it is back. No erase or program.\n"
+		"	                   With several -C the cards are reset together\n"
+		"	  -T, --reset-timeout  Seconds to wait for the reset (default: %d)\n"
+		"	  -m, --metrics    json: write timing metrics when done,\n"
+		"	                   jsonl: stream them while flashing\n"
+		"	  -M, --metrics-file  Write the metrics here (default: stdout)\n"
+		"	  -e, --trace      Record every config space access to this file,\n"
+		"	                   see capi-flash-trace\n"
+		"	  -S, --sim        Use simulated card backed by this file\n"
+		"	  -O, --sim-opts   Simulator options: erase_us=N,prog_ns=N,read_ns=N,\n"
+		"	                   reset_us=N,fifo=N,layout=legacy,subsys=ID,\n"
+		"	                   weak=BLOCK,bad=BLOCK\n\n", prog,
+		DEFAULT_USER_FLASH_ADDRESS, DEFAULT_BLOCK_SIZE, DEFAULT_CAPI_CARD,
+		REPAIR_PASSES, FLASH_READ_MAX, FLASH_READ_SIZE, FINGERPRINT_SAMPLE,
+		BACKGROUND_CPU_PCT, RESET_TIMEOUT);
+	printf("Note: Address(es) should be set explicitly. \n\n");
+	printf("Usage: %s inventory [options]\n"
+		"	  List the cards with their flash registers and psl-devices entry\n"
+		"	  -C, --card       Only this card, may be given several times\n"
+		"	  -P, --psl-devices  Board table (default: %s if it\n"
+		"	                   exists, else the one built in)\n"
+		"	  -o, --output     json or shell (default: json)\n"
+		"	  -S, --sim        Look at the simulated card instead\n\n",
+		prog, PSL_DEVICES);
+}
+
+#define MAX_FLASH_JOBS  16
+
+/* One card to flash, from the command line or from --job */
+struct flash_job {
+	int card_no;
+	const char *flash_type;
+	int flash_block_size;
+	int flash_address[2];		/* Primary and Secondary */
+	const char *fpga_file[2];
+	bool factory;
+	bool delta;
+	bool audit;
+	uint64_t read_size;		/* Bytes to audit or dump without an image */
+	const char *dump[2];		/* Dump Primary and Secondary to files */
+	int credits;			/* -1: default for flash_type */
+	int read_window;
+	bool numa;
+	bool locked;			/* --locked */
+	const char *journal;
+	bool resume;
+	bool skip_same;
+	int sample;			/* Blocks read back for skip_same */
+	unsigned long max_rate;		/* Config accesses per second, 0: any */
+	int cpu_pct;			/* CPU budget, 0: any */
+	bool background;		/* No reset follows, say so */
+	bool no_trim;			/* Program the erased tail of the image */
+	bool repair;			/* Reprogram the blocks which miscompare */
+	bool split;			/* SPIx8 from one combined file */
+	const char *sim_file;
+	const char *sim_opts;
+	char *sim_alloc;
+
+	struct capi_flash *volatile h;	/* Open card, for SIGINT */
+	pthread_t thread;
+	bool started;			/* thread is running, join it */
+	uint64_t t0, t1;		/* now_ns() */
+	int rc;
+};
+
+/* SIGINT cancels the cards being flashed, they are left reset */
+static struct flash_job *sig_jobs;
+static int sig_njobs;
+
+static void flash_sigint(int sig)
+{
+	int i;
+
+	(void)sig;
+	for (i = 0; i < sig_njobs; i++)
+		if (sig_jobs[i].h)
+			capi_flash_cancel(sig_jobs[i].h);
+}
+
+static void flash_sigint_setup(struct flash_job *jobs, int njobs)
+{
+	struct sigaction sa;
+
+	sig_jobs = jobs;
+	sig_njobs = njobs;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = flash_sigint;
+	sa.sa_flags = SA_RESETHAND;	/* A second ^C kills */
+	sigaction(SIGINT, &sa, NULL);
+}
+
+/*
+ * Dump round: read back to path, "-" is stdout. The summary goes to
+ * stderr, like dd, so it does not mix with dumped data.
+ */
+static int flash_card_dump(struct capi_flash *h, const char *path,
+			int flash_address, uint64_t nbytes)
+{
+	uint64_t ns, stall_ns = 0;
+	int fd, rc;
+
+	if (0 == strcmp(path, "-"))
+		fd = STDOUT_FILENO;
+	else
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Error");
+		eprintf("Can not open %s\n", path);
+		return EACCES;
+	}
+	ns = now_ns();
+	rc = capi_flash_dump(h, flash_address, nbytes, fd, &stall_ns);
+	ns = now_ns() - ns;
+	if (0 != rc)
+		eprintf("%s\n", card_error(h, rc));
+	if (STDOUT_FILENO != fd && 0 != close(fd) && 0 == rc) {
+		perror("Error");
+		eprintf("Can not write %s\n", path);
+		rc = EIO;
+	}
+	if (0 == rc)
+		fprintf(stderr, "%sDumped %lu bytes @0x%08x to %s in %.3f s, %.2f MB/s"
+			" (%.3f s waiting for writes)\n", err_tag,
+			(unsigned long)nbytes, flash_address, path, ns / 1e9,
+			ns ? nbytes * 1e3 / ns : 0.0, stall_ns / 1e9);
+	return rc;
+}
+
+/*
+ * Audit round: digest the flash, compare it with img if given. Returns
+ * FLASH_VERIFY_MISMATCH when they differ.
+ */
+static int flash_card_audit(struct capi_flash *h, struct capi_flash_image *img,
+			const char *path, int flash_address, uint64_t nbytes)
+{
+	struct capi_flash_digest fd, id;
+	unsigned long ndiff = 0;
+	int rc;
+
+	vprintf("CRC32C: %s\n", crc32c_impl());
+	rc = capi_flash_audit(h, flash_address, img, nbytes, &fd, &id, &ndiff);
+	if (0 != rc && FLASH_VERIFY_MISMATCH != rc) {
+		eprintf("%s\n", card_error(h, rc));
+		return rc;
+	}
+	printf("%sFlash @0x%08x %10lu bytes  crc32c %08x  sha256 %s\n",
+		err_tag, flash_address, (unsigned long)nbytes, fd.crc32c,
+		fd.sha256);
+	if (NULL == img)
 		return 0;
-	eprintf("read_config_word: 0x%x\n", offset);
-	return FLASH_ERR_CFG_READ;   /* Error */
+	printf("%sImage             %10lu bytes  crc32c %08x  sha256 %s\n",
+		err_tag, (unsigned long)nbytes, id.crc32c, id.sha256);
+	if (0 == rc)
+		printf("%sAudit OK: %s\n", err_tag, path);
+	else
+		printf("%sAudit FAILED: %lu words differ from %s\n", err_tag,
+			ndiff, path);
+	return rc;
+}
+
+/*
+ * Journaled round: record the image in the journal, then write it
+ * segment by segment from the first block the previous journal did not
+ * confirm for the same image.
+ */
+static int flash_card_journal(struct capi_flash *h, struct card_progress *cp,
+			const struct flash_journal *prev,
+			const struct fingerprint *fp, struct capi_flash_image *img)
+{
+	struct flash_journal *j = cp->journal;
+	struct journal_round *jr = &j->round[cp->round];
+	int next, rc;
+
+	jr->address = fp->address;
+	jr->size = fp->size;
+	jr->blocks = fp->blocks;
+	snprintf(jr->sha256, sizeof(jr->sha256), "%s", fp->sha256);
+	next = journal_confirmed(prev, j, cp->round);
+	if (next == jr->blocks)
+		dprintf("All %d blocks confirmed by %s\n", next, j->path);
+	else if (next)
+		dprintf("Resuming at block %d of %d from %s\n", next,
+			jr->blocks, j->path);
+	else if (prev->path)
+		dprintf("Journal %s is for another image, writing all blocks\n",
+			j->path);
+	jr->confirmed = next;
+	rc = journal_save(j);
+	if (0 != rc) {
+		eprintf("Can not write journal %s: %s\n", j->path, strerror(rc));
+		return rc;
+	}
+	rc = capi_flash_write_segments(h, fp->address, img,
+			JOURNAL_SEGMENT_BLOCKS, &next);
+	if (0 != rc)
+		eprintf("%s\n", card_error(h, rc));
+	return rc;
+}
+
+/* The image as it goes into the fingerprint store */
+static int flash_card_fingerprint(struct capi_flash *h,
+			struct capi_flash_image *img, const struct flash_job *job,
+			int round, struct fingerprint *fp)
+{
+	struct capi_flash_digest d;
+	int rc;
+
+	rc = capi_flash_image_digest(img, &d);
+	if (0 != rc) {
+		eprintf("%s\n", capi_flash_image_error(img));
+		return rc;
+	}
+	memset(fp, 0, sizeof(*fp));
+	fp->address = job->flash_address[round];
+	snprintf(fp->type, sizeof(fp->type), "%s", job->flash_type);
+	fp->block_size = job->flash_block_size;
+	fp->subsys = capi_flash_info(h)->subsys;
+	fp->size = d.len;
+	fp->blocks = capi_flash_blocks(h, d.len);
+	fp->crc32c = d.crc32c;
+	snprintf(fp->sha256, sizeof(fp->sha256), "%s", d.sha256);
+	return 0;
 }
 
-static int write_config_word(int cfg, int offset, int data)
+/*
+ * --skip-same: nsample blocks to read back, the first, the last and
+ * random ones in between, so repeated runs look at different blocks.
+ * Ascending, returns how many.
+ */
+static int sample_blocks(int *blocks, int nblocks, int nsample)
 {
-	int wdata = data;
+	unsigned seed = (unsigned)now_ns() ^ (unsigned)getpid();
+	char pick[nblocks];
+	int b, n = 0;
+
+	if (nsample >= nblocks) {
+		for (b = 0; b < nblocks; b++)
+			blocks[b] = b;
+		return nblocks;
+	}
+	memset(pick, 0, nblocks);
+	if (nsample > 0)
+		pick[0] = 1;
+	if (nsample > 1)
+		pick[nblocks - 1] = 1;
+	for (n = nsample > 2 ? 2 : nsample; n < nsample; ) {
+		b = rand_r(&seed) % nblocks;
+		if (!pick[b]) {
+			pick[b] = 1;
+			n++;
+		}
+	}
+	for (b = n = 0; b < nblocks; b++)
+		if (pick[b])
+			blocks[n++] = b;
+	return n;
+}
 
-	lseek(cfg, offset, SEEK_SET);
-	int ret = write(cfg, &wdata, 4);
-	if (4 == ret)
+/*
+ * Returns 1 if the fingerprint store says the partition holds the image
+ * and the sampled blocks agree, 0 if it has to be written, or -rc.
+ */
+static int flash_card_same(struct capi_flash *h, struct capi_flash_image *img,
+			const char *store, const struct fingerprint *fp,
+			int nsample, const char *file)
+{
+	struct fingerprint old;
+	unsigned long ndiff;
+	int blocks[fp->blocks];
+	int n, rc;
+
+	if (0 != fingerprint_find(store, fp->address, &old) ||
+	    !fingerprint_match(&old, fp)) {
+		dprintf("No fingerprint of %s @0x%08x, writing it\n", file,
+			fp->address);
 		return 0;
-	eprintf("write_config_word: 0x%x to Adddress: 0x%x\n", data, offset);
-	return FLASH_ERR_CFG_WRITE;   /* Error */
+	}
+	n = sample_blocks(blocks, fp->blocks, nsample);
+	dprintf("Fingerprint of %s @0x%08x found, checking %d of %d blocks\n",
+		file, fp->address, n, fp->blocks);
+	rc = capi_flash_verify_blocks(h, fp->address, img, blocks, n, &ndiff);
+	if (0 != rc) {
+		eprintf("%s\n", card_error(h, rc));
+		return -rc;
+	}
+	if (ndiff) {
+		dprintf("%lu words differ, writing %s\n", ndiff, file);
+		return 0;
+	}
+	dprintf("Flash @0x%08x already holds %s, skipping\n", fp->address,
+		file);
+	return 1;
 }
 
-static int flash_reset(int cfg, int cntl_reg)
+/* Clean verify: remember what the partition holds now */
+static void flash_card_record(const char *store, struct fingerprint *fp,
+			const struct card_progress *cp)
 {
 	int rc;
-	rc = write_config_word(cfg, cntl_reg, 0);
-	return rc;
+
+	if (cp->miscompares)
+		return;
+	fp->time = time(NULL);
+	rc = fingerprint_store(store, fp);
+	if (0 != rc)
+		eprintf("Can not update %s: %s\n", store, strerror(rc));
 }
 
-static int flash_wait_op(int cfg, int cntl_reg, int mask, int wait_cond,
-	unsigned timeout)
+/*
+ * --reset: reset the cards, all at once, and tell how long each step
+ * took. The cards are locked like for flashing, unless the caller has
+ * done so; one which is locked by someone else is left alone.
+ */
+static int reset_cards(const int *cards, int n, const char *region,
+			int timeout_s, bool locked)
 {
-	int rc = 0;
-	int config_word = 0x0;
-	time_t st, lt, ct;
+	struct capi_flash_reset_times t[MAX_FLASH_JOBS];
+	int card[MAX_FLASH_JOBS], fd[MAX_FLASH_JOBS], rc[MAX_FLASH_JOBS];
+	int nreset = 0, ret = 0, i;
+	char owner[128];
+
+	for (i = 0; i < n; i++) {
+		fd[nreset] = -1;
+		if (!locked) {
+			ret = capi_flash_lock(cards[i], NULL, &fd[nreset],
+				owner, sizeof(owner));
+			if (0 != ret) {
+				eprintf("card%d %s%s\n", cards[i], EBUSY == ret ?
+					"is locked by " : "can not be locked: ",
+					owner);
+				continue;
+			}
+		}
+		dprintf("Resetting card%d to load the %s image\n", cards[i],
+			region);
+		card[nreset++] = cards[i];
+	}
+	if (0 == nreset)
+		return ret;
+	capi_flash_reset_cards(card, nreset, region, timeout_s, t, rc);
+	for (i = 0; i < nreset; i++) {
+		if (-1 != fd[i])
+			close(fd[i]);
+		if (ETIMEDOUT == rc[i])
+			eprintf("card%d not back after %d s\n", card[i],
+				timeout_s);
+		else if (EINVAL == rc[i])
+			eprintf("Reset to user or factory, not '%s'\n", region);
+		else if (0 != rc[i])
+			eprintf("Can not reset card%d: %s\n", card[i],
+				strerror(rc[i]));
+		if (t[i].gone_ns)
+			dprintf("card%d gone after %.3f s\n", card[i],
+				t[i].gone_ns / 1e9);
+		if (t[i].back_ns)
+			dprintf("card%d back after %.3f s\n", card[i],
+				t[i].back_ns / 1e9);
+		if (0 == rc[i])
+			dprintf("card%d reset done in %.3f s (%s, %lu uevents)\n",
+				card[i], t[i].done_ns / 1e9,
+				t[i].polled ? "polled" : "uevents", t[i].uevents);
+		if (0 != rc[i] && 0 == ret)
+			ret = rc[i];
+	}
+	return ret;
+}
 
-	st = time(NULL);
-	lt = st;
+/* Card numbers under /sys/class/cxl, ascending */
+static int inventory_cards(int *cards, int max)
+{
+	struct dirent *d;
+	DIR *dir;
+	int n = 0, card, i;
 
-	while (1) {
-		rc = read_config_word(cfg, cntl_reg, &config_word);
+	dir = opendir("/sys/class/cxl");
+	if (NULL == dir)
+		return 0;
+	while ((d = readdir(dir)) && n < max) {
+		if (1 != sscanf(d->d_name, "card%d", &card))
+			continue;
+		for (i = n; i > 0 && cards[i - 1] > card; i--)
+			cards[i] = cards[i - 1];
+		cards[i] = card;
+		n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+/* First line of the card's flash history, CXL_LOCK_DIR/card<N> */
+static void inventory_history(int card, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	buf[0] = '\0';
+	snprintf(path, sizeof(path), CXL_LOCK_DIR"/card%d", card);
+	f = fopen(path, "r");
+	if (NULL == f)
+		return;
+	if (fgets(buf, len, f))
+		buf[strcspn(buf, "\n")] = '\0';
+	fclose(f);
+}
+
+static void inventory_json(int card, struct capi_flash *h, int rc,
+			const struct capi_flash_board *b, bool listed, bool sim)
+{
+	const struct capi_flash_info *info = capi_flash_info(h);
+	char history[256];
+
+	printf("{\"card\":%d", card);
+	if (0 != rc) {
+		printf(",\"error\":");
+		metrics_json_str(stdout, capi_flash_error(h));
+		printf("}");
+		return;
+	}
+	printf(",\"config\":");
+	metrics_json_str(stdout, info->cfg_path);
+	printf(",\"vendor\":\"0x%04x\",\"device\":\"0x%04x\","
+		"\"subsys\":\"0x%04x\",\"psl_id\":\"0x%04x\","
+		"\"vsec\":{\"offset\":\"0x%x\",\"rev\":%d,\"size\":\"0x%x\","
+		"\"layout\":\"%s\"},\"registers\":{\"addr\":\"0x%x\","
+		"\"size\":\"0x%x\",\"cntl\":\"0x%x\",\"data\":\"0x%x\"}",
+		info->vendor, info->device, info->subsys, info->psl_id,
+		info->vsec_offset, info->vsec_rev, info->vsec_size,
+		info->legacy ? "legacy" : "vsec", info->addr_reg,
+		info->size_reg, info->cntl_reg, info->data_reg);
+	if (listed) {
+		printf(",\"board\":");
+		metrics_json_str(stdout, b->board);
+		printf(",\"fpga\":");
+		metrics_json_str(stdout, b->fpga);
+		printf(",\"flash\":{\"interface\":");
+		metrics_json_str(stdout, b->type);
+		if (b->block_size_kb)
+			printf(",\"block_size_kb\":%d,\"address\":\"0x%08x\"",
+				b->block_size_kb, b->address);
+		if (b->has_address2)
+			printf(",\"address2\":\"0x%08x\"", b->address2);
+		printf("},\"table\":");
+		metrics_json_str(stdout, b->table);
+	} else
+		printf(",\"board\":null");
+	if (!sim) {
+		inventory_history(card, history, sizeof(history));
+		printf(",\"history\":");
+		metrics_json_str(stdout, history);
+	}
+	printf("}");
+}
+
+/*
+ * capi-flash inventory: find the cards, their flash registers and their
+ * psl-devices entry in one pass. The cards are only probed, one which
+ * is being flashed is not disturbed. json is one document, shell a line
+ * per card for capi-flash-script:
+ *   <card> <psl_id> <board> <fpga> <address> <blocksize> <type> <address2>
+ * with - for what psl-devices does not list.
+ */
+static int inventory(const int *cards, int n, const char *sim_file,
+			const char *sim_opts, const char *psl, bool shell)
+{
+	struct capi_flash_params params = {
+		.probe = true,
+		.sim_file = sim_file,
+		.sim_opts = sim_opts,
+	};
+	struct capi_flash *h;
+	struct capi_flash_board b;
+	char addr[16], bs[16], addr2[16];
+	bool listed;
+	int i, rc, ret = 0;
+
+	if (!shell)
+		printf("{\"cards\":[");
+	for (i = 0; i < n; i++) {
+		rc = capi_flash_open(&h, cards[i], &params);
+		if (NULL == h) {
+			ret = rc;
+			continue;
+		}
+		listed = 0 == rc &&
+			0 == capi_flash_board(psl, capi_flash_info(h)->psl_id, &b);
+		if (!shell) {
+			printf("%s", i ? "," : "");
+			inventory_json(cards[i], h, rc, &b, listed, sim_file);
+		} else if (0 == rc) {
+			snprintf(addr, sizeof(addr), "-");
+			snprintf(bs, sizeof(bs), "-");
+			snprintf(addr2, sizeof(addr2), "-");
+			if (listed && b.block_size_kb) {
+				snprintf(addr, sizeof(addr), "0x%08x", b.address);
+				snprintf(bs, sizeof(bs), "%d", b.block_size_kb);
+			}
+			if (listed && b.has_address2)
+				snprintf(addr2, sizeof(addr2), "0x%08x",
+					b.address2);
+			printf("%d 0x%04x %s %s %s %s %s %s\n", cards[i],
+				capi_flash_info(h)->psl_id, listed ? b.board : "-",
+				listed ? b.fpga : "-", addr, bs,
+				listed ? b.type : "-", addr2);
+		} else
+			eprintf("card%d: %s\n", cards[i], capi_flash_error(h));
 		if (0 != rc)
-			return rc;
-		if (FLASH_CHECK_BIT(config_word, mask, wait_cond))
+			ret = rc;
+		capi_flash_close(h);
+	}
+	if (!shell)
+		printf("]}\n");
+	return ret;
+}
+
+/*
+ * Erase, program and verify the image(s) of one job on its card. Runs on
+ * the main thread for a single card, or on a thread per card with --job.
+ */
+static int flash_card(struct flash_job *job)
+{
+	struct capi_flash *h = NULL;
+	struct capi_flash_image *img = NULL;
+	struct capi_flash_params params;
+	const struct capi_flash_info *info = NULL;
+	struct card_progress cp;
+	struct flash_journal journal, prev;
+	char journal_path[PATH_MAX];
+	struct fingerprint fp;
+	char store[PATH_MAX];
+	unsigned long img_syscalls = 0, ndiff;
+	uint8_t *map = NULL;		/* Blocks which miscompare */
+	uint64_t t0, prog_ns, verify_ns, t_repair;
+	int pass;
+	int address;
+	int rc = -1;
+
+	int card_no = job->card_no;
+	bool factory = job->factory;
+	bool delta = job->delta;
+	bool audit = job->audit;
+	int audit_rc = 0;
+	const char *flash_type = job->flash_type;
+	int flash_block_size = job->flash_block_size;
+	int *flash_address = job->flash_address;
+	const char **fpga_file = job->fpga_file;
+
+	bool is_SPIx8 = false;
+	bool is_SPI   = false;
+	int i;
+
+	t0 = now_ns();  /* Start Time */
+	metrics = metrics_card_start(card_no, flash_type);
+
+	if (strcmp(flash_type, "SPIx8") == 0)
+		is_SPIx8 = true;
+	if (strcmp(flash_type, "BPIx16") != 0)
+		is_SPI   = true;
+
+	memset(&params, 0, sizeof(params));
+	params.type = flash_type;
+	params.block_size_kb = flash_block_size;
+	params.credits = job->credits;
+	params.read_window = job->read_window;
+	params.sim_file = job->sim_file;
+	params.sim_opts = job->sim_opts;
+	params.locked = job->locked;
+	params.no_trim = job->no_trim;
+	rc = capi_flash_open(&h, card_no, &params);
+	job->h = h;
+	if (NULL == h) {
+		eprintf("%s\n", strerror(rc));
+		goto __exit0;
+	}
+	info = capi_flash_info(h);
+	if (0 != rc) {
+		eprintf("%s\n", card_error(h, rc));
+		goto __exit0;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	cp.block_words = info->block_words;
+	capi_flash_set_event_cb(h, card_event, &cp);
+	rc = capi_flash_set_pace(h, job->max_rate, job->cpu_pct);
+	if (0 != rc) {
+		eprintf("%s\n", capi_flash_error(h));
+		goto __exit0;
+	}
+	if (job->max_rate || job->cpu_pct)
+		vprintf("Paced to %lu config accesses/s, %d%% CPU (0: any)\n",
+			job->max_rate, job->cpu_pct);
+
+	if (job->sim_file)
+		snprintf(store, sizeof(store), "%s.fingerprint", job->sim_file);
+	else
+		snprintf(store, sizeof(store), CXL_LOCK_DIR"/card%d.fingerprint",
+			card_no);
+
+	/* --resume without --journal: the card's default journal */
+	memset(&prev, 0, sizeof(prev));
+	if (job->journal || job->resume) {
+		if (delta || audit || job->dump[0]) {
+			eprintf("A journal only goes with erase and program\n");
+			rc = EINVAL;
+			goto __exit0;
+		}
+		if (job->journal)
+			snprintf(journal_path, sizeof(journal_path), "%s",
+				job->journal);
+		else if (job->sim_file)
+			snprintf(journal_path, sizeof(journal_path),
+				"%s.journal", job->sim_file);
+		else
+			snprintf(journal_path, sizeof(journal_path),
+				CXL_LOCK_DIR"/card%d.journal", card_no);
+		memset(&journal, 0, sizeof(journal));
+		journal.path = journal_path;
+		journal.card = card_no;
+		snprintf(journal.type, sizeof(journal.type), "%s", flash_type);
+		journal.block_size = flash_block_size;
+		if (job->resume) {
+			rc = journal_load(&prev, journal_path);
+			if (ENOENT == rc) {
+				dprintf("No journal %s, writing all blocks\n",
+					journal_path);
+				memset(&prev, 0, sizeof(prev));
+			} else if (0 != rc) {
+				eprintf("Can not read journal %s: %s\n",
+					journal_path, strerror(rc));
+				goto __exit0;
+			}
+		}
+		cp.journal = &journal;
+	}
+
+	/* Set Address to 0 in case factory flag is set */
+	if (factory) {
+		flash_address[0] = 0;
+		flash_address[1] = DEFAULT_FACTORY_FLASH_ADDRESS_SEC;
+	}
+
+	/* Print collected arguments */
+	vprintf1("CAPI CFG Dir   : %s\n", info->cfg_path);
+	vprintf1("Flash Type     : %s\n", flash_type);
+	if (is_SPIx8 ) {
+		vprintf1("File to Flash (primary)   : %s\n",   fpga_file[0]);
+		vprintf1("       Write to  adddress : 0x%x\n", flash_address[0]);
+		vprintf1("File to Flash (secondary) : %s\n", fpga_file[1] ?
+			fpga_file[1] : "split from the primary");
+		vprintf1("       Write to  adddress : 0x%x\n", flash_address[1]);
+	} else {
+		vprintf1("File to Flash : %s\n",   fpga_file[0]);
+		vprintf1("Flash Address : 0x%x\n", flash_address[0]);
+	}
+
+	vprintf1("Flash Block Size : %d (*1024 Bytes)\n", flash_block_size);
+	vprintf1("Quiet Flag     : %d\n", quiet);
+	vprintf1("Verbose Flag   : %d\n", verbose);
+	vprintf1("Factory Flag   : %d\n", factory);
+	vprintf1("Delta Flag     : %d\n", delta);
+	vprintf1("Audit Flag     : %d\n", audit);
+	vprintf1("Credits        : %d\n", info->credits);
+	vprintf1("Read Window    : %d\n", info->read_window);
+
+	vprintf("Vendor ID: %04X\n", info->vendor);
+	vprintf("  Device / Sub Device ID: %04X / %04X\n",
+			info->device, info->subsys);
+	vprintf1("VSEC Offset: 0x%03X\n", info->vsec_offset);
+	vprintf1("VSEC Length: 0x%03X\nVSEC ID: 0x%1X\n", info->vsec_size,
+		info->vsec_rev);
+	if (info->legacy)
+		vprintf("	Version 0.10\n");
+	else
+		vprintf("	Version 0.12\n");
+	vprintf1("Addr reg: 0x%03X\nSize reg: 0x%03X\nCntl reg: 0x%03X\n"
+		"Data reg: 0x%03X\n", info->addr_reg, info->size_reg,
+		info->cntl_reg, info->data_reg);
+
+	//# -------------------------------------------------------------------------------
+	//# Main Process: Erase, Program, Verify
+	//# -------------------------------------------------------------------------------
+	
+
+	const char *file = NULL;
+	enum capi_flash_image_half half;
+	int round = 0; 
+	for (round = 0; round < (is_SPIx8 ? 2 : 1); round ++) {
+		cp.round = round;
+		if (round == 1)
+			dprintf("------------------------------------------\nProcess secondary file.\n");
+		else
+			dprintf("------------------------------------------\n");
+
+
+		// Flash address is byte for SPI
+		// Flash address is 4B words for BPIx16
+		if ( is_SPI )
+			address = flash_address[round];
+		else
+			address = flash_address[round] >> 2;
+
+		if (job->dump[0]) {
+			//# -------------------------------------------------------------------------------
+			//# Dump: Read back to a File, no Erase or Program
+			//# -------------------------------------------------------------------------------
+			if (NULL == job->dump[round])
+				continue;
+			dprintf("Dumping Flash (@ 0x%08X) %lu Bytes to %s\n",
+				address, (unsigned long)job->read_size,
+				job->dump[round]);
+			cp.read_name = "Dump";
+			cp.read_metric = "dump";
+			rc = flash_card_dump(h, job->dump[round],
+					flash_address[round], job->read_size);
+			if (0 != rc)
+				goto __exit;
+			continue;
+		}
+
+		/* SPIx8 from one file: a combined image, split by nibbles */
+		file = fpga_file[round];
+		half = CAPI_FLASH_IMAGE_WHOLE;
+		if (is_SPIx8 && job->split) {
+			file = fpga_file[0];
+			half = round ? CAPI_FLASH_IMAGE_SECONDARY :
+				CAPI_FLASH_IMAGE_PRIMARY;
+		}
+
+		/* Check for files, an audit can do without */
+		if (NULL == file && !(audit && job->read_size)) {
+			eprintf("Missing Option -f -a -b and -C must be set\n");
+			rc = EINVAL;
+			goto __exit0;
+		}
+
+		if (img)
+			img_syscalls += capi_flash_image_syscalls(img);
+		capi_flash_image_close(img);
+		img = NULL;
+		if (file) {
+			rc = capi_flash_image_open_half(&img, file, half);
+			if (0 != rc) {
+				eprintf("%s\n", img ? capi_flash_image_error(img) :
+					strerror(rc));
+				if (ENOENT == rc)
+					goto __exit0;
+				goto __exit;
+			}
+			if (strcmp(capi_flash_image_format(img), "bin") || half)
+				dprintf("Decoding %s image%s\n",
+					capi_flash_image_format(img),
+					CAPI_FLASH_IMAGE_WHOLE == half ? "" :
+					round ? ", secondary flash nibbles" :
+					", primary flash nibbles");
+		}
+
+		off_t fsize;
+		int num_blocks;
+
+		if (audit) {
+			//# -------------------------------------------------------------------------------
+			//# Audit: Read back and digest, no Erase or Program
+			//# -------------------------------------------------------------------------------
+			uint64_t nbytes = img ? capi_flash_image_size(img) :
+						job->read_size;
+
+			if (img && 0 == nbytes && capi_flash_image_error(img)[0]) {
+				eprintf("%s\n", capi_flash_image_error(img));
+				rc = EIO;
+				goto __exit;
+			}
+			dprintf("Auditing Flash (@ 0x%08X) %lu Bytes%s%s\n",
+				address, (unsigned long)nbytes,
+				file ? " against File: " : "",
+				file ? file : "");
+			cp.read_name = "Audit";
+			cp.read_metric = "audit";
+			rc = flash_card_audit(h, img, file,
+					flash_address[round], nbytes);
+			if (FLASH_VERIFY_MISMATCH == rc) {
+				audit_rc = rc;
+				rc = 0;
+			}
+			if (0 != rc)
+				goto __exit;
+			continue;
+		}
+
+		//# -------------------------------------------------------------------------------
+		//# Fingerprint: Skip a Partition which holds the Image already
+		//# -------------------------------------------------------------------------------
+		rc = flash_card_fingerprint(h, img, job, round, &fp);
+		if (0 != rc)
+			goto __exit;
+
+		// Size of FPGA binary, known from the digest's pass
+		fsize = capi_flash_image_size(img);
+		if (job->skip_same) {
+			rc = flash_card_same(h, img, store, &fp, job->sample,
+					file);
+			if (rc < 0) {
+				rc = -rc;
+				goto __exit;
+			}
+			if (rc) {
+				rc = 0;
+				continue;
+			}
+		}
+		/* The library drops it before the erase, back after a
+		   clean verify */
+		cp.miscompares = 0;
+
+		num_blocks = capi_flash_blocks(h, fsize) - 1;
+                if (factory == true)
+		        dprintf("Programming Factory Partition");
+                else
+                        dprintf("Programming User Partition");
+                dprintf("(@ 0x%08X) with %ld Bytes from File: %s\n",
+				address, fsize, file);
+		dprintf("  Program -> for Size: %d in blocks (%dK Words or %dK Bytes)\n\n",num_blocks,
+			flash_block_size/4 , flash_block_size);
+
+		dprintf("Reset Flash\n");
+
+		/* Blocks which miscompare after delta or verify */
+		free(map);
+		map = calloc(CAPI_FLASH_MAP_BYTES(num_blocks + 1), 1);
+		if (NULL == map) {
+			eprintf("Out of memory\n");
+			rc = ENOMEM;
+			goto __exit;
+		}
+
+		if (delta) {
+			//# -------------------------------------------------------------------------------
+			//# Delta: Program only Blocks which differ from the File
+			//# -------------------------------------------------------------------------------
+			int ndiff_blocks;
+			uint64_t delta_ns;
+
+			dprintf("Comparing Flash\n");
+			rc = capi_flash_delta_map(h, flash_address[round], img,
+					map, &ndiff_blocks, &ndiff);
+			delta_ns = cp.ns[CAPI_FLASH_OP_COMPARE] +
+				(ndiff_blocks ? cp.ns[CAPI_FLASH_OP_PROGRAM] +
+				 cp.ns[CAPI_FLASH_OP_VERIFY] : 0);
+			if (FLASH_VERIFY_MISMATCH == rc)
+				rc = 0;
+			else if (0 != rc) {
+				eprintf("%s\n", card_error(h, rc));
+				goto __exit;
+			}
+			t_repair = now_ns();
+			rc = flash_card_repair(h, job->repair, &cp, flash_address[round],
+					img, map, num_blocks + 1, &ndiff, &pass);
+			if (0 != rc)
+				goto __exit;
+			dprintf("Delta Time:   %.3f seconds\n", delta_ns / 1e9);
+			if (pass)
+				dprintf("Repair Time:  %.3f seconds (%d pass%s)\n",
+					(now_ns() - t_repair) / 1e9, pass,
+					pass > 1 ? "es" : "");
+			flash_card_record(store, &fp, &cp);
+			continue;
+		}
+
+		if (cp.journal) {
+			//# -------------------------------------------------------------------------------
+			//# Journal: Erase, Program and Verify Segment by Segment
+			//# -------------------------------------------------------------------------------
+			rc = flash_card_journal(h, &cp, &prev, &fp, img);
+			if (0 != rc)
+				goto __exit;
+			dprintf("Write Time:   %.3f seconds\n",
+				cp.ns[CAPI_FLASH_OP_PROGRAM] / 1e9);
+			flash_card_record(store, &fp, &cp);
+			continue;
+		}
+
+		//# -------------------------------------------------------------------------------
+		//# Erase and Program Flash
+		//# -------------------------------------------------------------------------------
+		rc = capi_flash_write(h, flash_address[round], img);
+		if (0 != rc) {
+			eprintf("%s\n", card_error(h, rc));
+			goto __exit;
+		}
+
+		//# -------------------------------------------------------------------------------
+		//# Verify Flash Programmming, repair the Blocks which differ
+		//# -------------------------------------------------------------------------------
+		rc = capi_flash_verify_map(h, flash_address[round], img, map,
+				&ndiff);
+		if (0 != rc) {
+			eprintf("%s\n", card_error(h, rc));
+			goto __exit;
+		}
+		prog_ns = cp.ns[CAPI_FLASH_OP_PROGRAM];
+		verify_ns = cp.ns[CAPI_FLASH_OP_VERIFY];
+		t_repair = now_ns();
+		rc = flash_card_repair(h, job->repair, &cp, flash_address[round], img,
+				map, num_blocks + 1, &ndiff, &pass);
+		if (0 != rc)
+			goto __exit;
+		if (pass)
+			dprintf("Repair Time:  %.3f seconds (%d pass%s)\n",
+				(now_ns() - t_repair) / 1e9, pass,
+				pass > 1 ? "es" : "");
+
+		rc = 0;		   /* Good */
+		flash_card_record(store, &fp, &cp);
+		//# -------------------------------------------------------------------------------
+		//# Calculate and Print Elapsed Times
+		//# -------------------------------------------------------------------------------
+		dprintf("Erase Time:   %.3f seconds\n",
+			cp.ns[CAPI_FLASH_OP_ERASE] / 1e9);
+		dprintf("Program Time: %.3f seconds\n", prog_ns / 1e9);
+		dprintf("Verify Time:  %.3f seconds\n", verify_ns / 1e9);
+	} // End Loop
+
+	dprintf("------------------------------------------\n");
+	dprintf("Total Time:   %.3f seconds\n", (now_ns() - t0) / 1e9);
+	if (job->background && !audit && !job->dump[0])
+		dprintf("Staged, the card runs the old image until it is reset (--reset user)\n");
+	rc = audit_rc;
+	/* Done, nothing left to resume */
+	if (cp.journal && 0 != journal_remove(cp.journal))
+		eprintf("Can not remove journal %s\n", journal_path);
+
+
+__exit:
+	print_cfg_stats(info);
+	print_poll_stats(h);
+	dprintf("Flash RC: %d\n", rc);
+	dprintf("------------------------------------------\n");
+
+__exit0:
+	if (img)
+		img_syscalls += capi_flash_image_syscalls(img);
+	if (metrics) {
+		const struct capi_flash_poll_stat *ps = NULL;
+		int n = 0;
+
+		if (h)
+			ps = capi_flash_poll_stats(h, &n);
+		struct metrics_poll polls[n + 1];
+
+		for (i = 0; i < n; i++) {
+			polls[i].name = ps[i].name;
+			polls[i].waits = ps[i].waits;
+			polls[i].polls = ps[i].polls;
+			polls[i].sleeps = ps[i].sleeps;
+			polls[i].ns = ps[i].ns;
+			polls[i].max_ns = ps[i].max_ns;
+		}
+		metrics_card_end(metrics, rc, now_ns() - t0, polls, n,
+				cfg_stats()->syscalls, img_syscalls);
+		metrics = NULL;
+	}
+	capi_flash_image_close(img);
+	free(map);
+	job->h = NULL;
+	capi_flash_close(h);
+	return rc;
+}
+
+
+/*
+ * --job card=N,type=T,address=A,file=F[,address2=A,file2=F][,blocksize=B]
+ *       [,factory][,delta][,audit][,size=N][,dump=F][,dump2=F][,stream]
+ *       [,credits=N][,readwin=N][,sim=F][,journal=F][,resume][,skip]
+ *       [,sample=N]
+ */
+static int flash_job_parse(struct flash_job *job, char *arg)
+{
+	enum { J_CARD, J_TYPE, J_ADDR, J_ADDR2, J_FILE, J_FILE2, J_BS,
+	       J_FACTORY, J_DELTA, J_AUDIT, J_SIZE, J_DUMP, J_DUMP2,
+	       J_STREAM, J_CREDITS, J_READWIN, J_SIM, J_JOURNAL, J_RESUME,
+	       J_SKIP, J_SAMPLE, J_RATE, J_CPU, J_NOTRIM, J_REPAIR, J_SPLIT };
+	char *const tokens[] = {
+		[J_CARD]    = "card",
+		[J_TYPE]    = "type",
+		[J_ADDR]    = "address",
+		[J_ADDR2]   = "address2",
+		[J_FILE]    = "file",
+		[J_FILE2]   = "file2",
+		[J_BS]      = "blocksize",
+		[J_FACTORY] = "factory",
+		[J_DELTA]   = "delta",
+		[J_AUDIT]   = "audit",
+		[J_SIZE]    = "size",
+		[J_DUMP]    = "dump",
+		[J_DUMP2]   = "dump2",
+		[J_STREAM]  = "stream",
+		[J_CREDITS] = "credits",
+		[J_READWIN] = "readwin",
+		[J_SIM]     = "sim",
+		[J_JOURNAL] = "journal",
+		[J_RESUME]  = "resume",
+		[J_SKIP]    = "skip",
+		[J_SAMPLE]  = "sample",
+		[J_RATE]    = "rate",
+		[J_CPU]     = "cpu",
+		[J_NOTRIM]  = "notrim",
+		[J_REPAIR]  = "repair",
+		[J_SPLIT]   = "split",
+		NULL
+	};
+	char *val;
+	int o;
+
+	while (*arg != '\0') {
+		o = getsubopt(&arg, tokens, &val);
+		if (o < 0 || (NULL == val && o != J_FACTORY && o != J_DELTA &&
+			      o != J_AUDIT && o != J_STREAM && o != J_RESUME &&
+			      o != J_SKIP && o != J_NOTRIM && o != J_REPAIR &&
+			      o != J_SPLIT)) {
+			eprintf("Invalid job option '%s'\n", val ? val : "");
+			return EINVAL;
+		}
+		switch (o) {
+		case J_CARD:
+			job->card_no = strtol(val, (char **)NULL, 0);
+			break;
+		case J_TYPE:
+			job->flash_type = val;
+			break;
+		case J_ADDR:
+			job->flash_address[0] = strtol(val, (char **)NULL, 0);
+			break;
+		case J_ADDR2:
+			job->flash_address[1] = strtol(val, (char **)NULL, 0);
+			break;
+		case J_FILE:
+			job->fpga_file[0] = val;
+			break;
+		case J_FILE2:
+			job->fpga_file[1] = val;
+			break;
+		case J_BS:
+			job->flash_block_size = strtol(val, (char **)NULL, 0);
+			break;
+		case J_FACTORY:
+			job->factory = true;
+			break;
+		case J_DELTA:
+			job->delta = true;
+			break;
+		case J_AUDIT:
+			job->audit = true;
+			break;
+		case J_SIZE:
+			job->read_size = strtoull(val, (char **)NULL, 0);
+			break;
+		case J_DUMP:
+			job->dump[0] = val;
+			break;
+		case J_DUMP2:
+			job->dump[1] = val;
+			break;
+		case J_STREAM:
+			if (0 == job->credits)
+				job->credits = -1;
+			break;
+		case J_CREDITS:
+			job->credits = strtol(val, (char **)NULL, 0);
+			break;
+		case J_READWIN:
+			job->read_window = strtol(val, (char **)NULL, 0);
+			break;
+		case J_SIM:
+			job->sim_file = val;
+			break;
+		case J_JOURNAL:
+			job->journal = val;
+			break;
+		case J_RESUME:
+			job->resume = true;
+			break;
+		case J_SKIP:
+			job->skip_same = true;
+			break;
+		case J_SAMPLE:
+			job->sample = strtol(val, (char **)NULL, 0);
+			break;
+		case J_RATE:
+			job->max_rate = strtoul(val, (char **)NULL, 0);
+			break;
+		case J_CPU:
+			job->cpu_pct = strtol(val, (char **)NULL, 0);
+			break;
+		case J_NOTRIM:
+			job->no_trim = true;
+			break;
+		case J_REPAIR:
+			job->repair = true;
+			break;
+		case J_SPLIT:
+			job->split = true;
 			break;
-		ct = time(NULL);
-		if ((ct - lt) > 5) {
-			printf(".");
-			lt = ct;
-		}
-		if ((ct - st) > timeout) {
-			eprintf ("\nFlash not ready after %d min (mask: 0x%x cond: 0x%x)\n",
-					timeout/60, mask, wait_cond);
-			return FLASH_READY_TIMEOUT;
 		}
 	}
+	if (job->card_no < 0 ||
+	    (!((job->audit || job->dump[0]) && job->read_size) &&
+	     (NULL == job->fpga_file[0] ||
+	     (strcmp(job->flash_type, "SPIx8") == 0 && NULL == job->fpga_file[1] &&
+	      !job->split)))) {
+		eprintf("Job needs card= and file= (and file2= or split for SPIx8)\n");
+		return EINVAL;
+	}
+	if (job->split && (strcmp(job->flash_type, "SPIx8") ||
+			   job->fpga_file[1])) {
+		eprintf("split is for SPIx8 from file= alone\n");
+		return EINVAL;
+	}
 	return 0;
 }
 
-static int flash_reset_wait(int cfg, int cntl_reg)
+/* A cpulist like "0-7,16-23", as in sysfs and taskset -c. CPUs set */
+static int parse_cpulist(const char *list, cpu_set_t *cpus)
 {
-	int rc;
-	// -------------------------------------------------------------------------------
-	// Reset Any Previously Aborted Sequences
-	// -------------------------------------------------------------------------------
-	rc = flash_reset(cfg, cntl_reg);
-	if (0 != rc) {
-		eprintf("Flash Reset\n");
-		return rc;
+	char *p = (char *)list;
+	long a, b;
+
+	CPU_ZERO(cpus);
+	while (isdigit(*p)) {
+		a = b = strtol(p, &p, 10);
+		if ('-' == *p)
+			b = strtol(p + 1, &p, 10);
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, cpus);
+		if (',' == *p)
+			p++;
 	}
-	// -------------------------------------------------------------------------------
-	// Wait for Flash to be Ready
-	// -------------------------------------------------------------------------------
-	rc = flash_wait_op(cfg, cntl_reg, FLASH_READY, FLASH_READY, 120);
-	return rc;
+	if ('\0' != *p && '\n' != *p)
+		return 0;
+	return CPU_COUNT(cpus);
 }
 
-static int flash_write(int cfg, int cntl_reg, int data_reg, int data)
+/*
+ * Pin the calling thread to the CPUs of the card's NUMA node, so the
+ * config space accesses do not cross the node interconnect.
+ */
+static void flash_job_pin(int card_no)
 {
-	int rc;
-	// ccw added
-	// -------------------------------------------------------------------------------
-	// Poll for flash port to be ready - offset 0x58 bit 12(LE) = 1 means busy
-	// -------------------------------------------------------------------------------
-	rc = flash_wait_op(cfg, cntl_reg, FLASH_PORT_READY, 0x0, 30);
-	if (0 != rc)
-		return rc;
-	rc = write_config_word(cfg, data_reg, data);
-	return rc;
+	char path[MAX_STRING_SIZE];
+	char line[MAX_STRING_SIZE];
+	cpu_set_t cpus;
+	FILE *f;
+	int node = -1;
+
+	snprintf(path, sizeof(path), CXL_SYSFS_PATH"%d/device/numa_node",
+		card_no);
+	f = fopen(path, "r");
+	if (f) {
+		if (1 != fscanf(f, "%d", &node))
+			node = -1;
+		fclose(f);
+	}
+	if (node < 0) {
+		vprintf("card%d: No NUMA node, not pinned\n", card_no);
+		return;
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		node);
+	f = fopen(path, "r");
+	if (NULL == f)
+		return;
+	if (NULL == fgets(line, sizeof(line), f))
+		line[0] = '\0';
+	fclose(f);
+
+	if (0 == parse_cpulist(line, &cpus))
+		return;
+	if (0 == pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+		vprintf("card%d: Pinned to NUMA node %d (%s)", card_no, node,
+			line);
 }
 
-//# -------------------------------------------------------------------------------
-//# Setup for Program From Flash
-//# -------------------------------------------------------------------------------
-static int flash_erase(int cfg, int addr_reg, int size_reg, int cntl_reg,
-			int address, int num_blocks)
+/*
+ * --background and --cpus, for staging an image next to a live AFU:
+ * the process runs SCHED_IDLE and only on the given CPUs. Set before
+ * the job threads start, they inherit both.
+ */
+static int flash_background(bool idle, const char *cpus)
 {
+	struct sched_param sp = { .sched_priority = 0 };
+	cpu_set_t set;
 	int rc;
 
-	/* Set Address Reg */
-	rc = write_config_word(cfg, addr_reg, address);
-	if (0 != rc)
-		return rc;
-	/* Set size of transfer to flash in blocks */
-	rc = write_config_word(cfg, size_reg, num_blocks);
-	if (0 != rc)
-		return rc;
-	/* Send program request to flash */
-	rc = write_config_word(cfg, cntl_reg, FLASH_PROG_REQ);
-	if (0 != rc)
-		return rc;
-	//# -------------------------------------------------------------------------------
-	//# Wait for Flash Erase to complete.
-	//# -------------------------------------------------------------------------------
-	rc = flash_wait_op(cfg, cntl_reg, FLASH_ERASE_STATUS | FLASH_PROG_STATUS,
-		FLASH_PROG_STATUS, 240);
-	return rc;
-}
-
-/* Search vsec_offset and config_word in PCI Extended Capabilities */
-static int search_capi_vsec(int cfg, int *rc_vsec_offset, int *rc_config_word)
-{
-	int rc = 0;
-	// Search PCI Extended Capabilities list for CAPI VSEC offset
-	int next_ecap = PCI_ECAP, ecap_offset = PCI_ECAP;
-	int config_word = 0x0;
-	*rc_vsec_offset = 0;   /* Set to some invalid address */
-	*rc_config_word = 0;
-
-	while (next_ecap != 0x0) {
-		rc = read_config_word(cfg, ecap_offset, &config_word);
-		if (0 != rc) {
-			eprintf("Can not Read ecap_offset1 @0x%x\n", ecap_offset);
+	if (cpus) {
+		if (0 == parse_cpulist(cpus, &set)) {
+			eprintf("Bad CPU list '%s'\n", cpus);
+			return EINVAL;
+		}
+		if (0 != sched_setaffinity(0, sizeof(set), &set)) {
+			rc = errno;
+			eprintf("Can not run on CPUs %s: %s\n", cpus,
+				strerror(rc));
 			return rc;
 		}
-		next_ecap = ECAP_NEXT(config_word);
-		if ( ECAP_ID(config_word) == ECAP_VSEC ) {
-				// Read vsec length/revision/ID
-				rc = read_config_word(cfg, ecap_offset + 0x4, &config_word);
-				if (0 != rc) {
-					eprintf("Can not Read ecap_offset2 @0x%x\n", ecap_offset+4);
-					return rc;
-				}
-				if (VSEC_ID(config_word) == CAPI_VSECID) {
-					*rc_vsec_offset = ecap_offset;
-					*rc_config_word = config_word;
-					return 0;   /* Found */
-				}
+		vprintf("Running on CPUs %s\n", cpus);
+	}
+	if (idle) {
+		if (0 != sched_setscheduler(0, SCHED_IDLE, &sp)) {
+			rc = errno;
+			eprintf("Can not set SCHED_IDLE: %s\n", strerror(rc));
+			return rc;
 		}
-		ecap_offset = next_ecap;
+		vprintf("Running as SCHED_IDLE\n");
 	}
-	eprintf("Unable to find CAPI VSEC\n");
-	return -1;
+	return 0;
 }
 
-/* Set Read Address */
-static int flash_set_read_addr(int cfg, int addr_reg, int size_reg, int cntl_reg,
-					int raddress, int r_size)
+/* Flush the --trace file, a write error fails an otherwise good flash */
+static int flash_trace_close(const char *trace, int rc)
 {
-	int rc;
+	int err;
 
-	rc = flash_reset_wait(cfg, cntl_reg);
-	if (0 != rc)
-		return rc;
-	//# -------------------------------------------------------------------------------
-	//# Setup for Reading From Flash
-	//# -------------------------------------------------------------------------------
-	rc = write_config_word(cfg, addr_reg, raddress);
-	if (0 != rc)
-		return rc;
-	// Set read size to 512 words
-	rc = write_config_word(cfg, size_reg, r_size -1);
-	if (0 != rc)
+	if (NULL == trace)
 		return rc;
-	rc = write_config_word(cfg, cntl_reg, FLASH_READ_REQ);
-	return rc;
-}
-
-/*
- * poll control register until data count matches expected value
- * if data register is read too soon, previous data value will be
- * captured and remaining data is then shifted
- */
-static int flash_wait_ready(int cfg, int cntl_reg, int cntl_remain)
-{
-	int rc = 0;
-	int data;
-	int cntl_retry = 100;
-
-	while (cntl_retry > 0) {
-		rc = read_config_word(cfg, cntl_reg, &data);
-		if (0 != rc)
-			return rc;
-		if (cntl_remain == (data & 0x3ff))
-			break;
-		cntl_retry--;
-	}
-	if (0 == cntl_retry) {
-		eprintf("CNTL Retry timeout after 100 reties (0x%x)\n", data);
-		return FLASH_READY_TIMEOUT;
-	}
-	return 0;
+	err = capi_flash_trace_close();
+	if (0 != err)
+		eprintf("Can not write %s: %s\n", trace, strerror(err));
+	vprintf("Config space trace in %s\n", trace);
+	return 0 == rc ? err : rc;
 }
 
-static void help(const char *prog)
+static void *flash_job_thread(void *arg)
 {
-	printf("Usage: %s [options]\n"
-		"	  -h, --help       This help\n"
-		"	  -v, --verbose    More Verbose\n"
-		"	  -V, --version    Print version\n"
-		"	  -q, --quiet      No messages\n"
-		"	  -t, --type       BPIx16, SPIx4, SPIx8 (default: BPIx16)\n"
-		"	  -p, --factory    Program Factory Side (NEW)\n"
-		"	  -a, --address    Flash Address (default: 0x%8.8x)\n"
-		"	  -A, --address2   Flash Address Secondary (optional, only for SPIx8)\n"
-		"	  -b, --blocksize  Flash Block Size (default: %d KB)\n"
-		"	  -C, --card       Capi Card number (default: %d)\n"
-		"	  -f, --file       File to flash\n"
-		"	  -F, --file2      File to flash Secondary (optional, only for SPIx8)\n\n", prog,
-		DEFAULT_USER_FLASH_ADDRESS, DEFAULT_BLOCK_SIZE, DEFAULT_CAPI_CARD);
-	printf("Note: Address(es) should be set explicitly. \n\n");
+	struct flash_job *job = arg;
+
+	snprintf(err_tag, sizeof(err_tag), "card%d: ", job->card_no);
+	if (job->numa)
+		flash_job_pin(job->card_no);
+	job->rc = flash_card(job);
+	job->t1 = now_ns();
+	return NULL;
 }
 
 int main (int argc, char *argv[])
 {
-	int dat, dif, edat;
-	int CFG = -1;
-	int FPGA_BIN = -1;
-	time_t t0, eet, set, ept, spt, svt, evt;
-	int address, raddress, ma;
-	int cntl_remain = 0;
-	int rc = -1;
-	int flash_words;
-
-	int addr_reg, size_reg, cntl_reg, data_reg;
-	cntl_reg = 0;
-	char *cfg_file = NULL;
-	int  print_cnt = 0;
-	t0 = time(NULL);  /* Start Time */
-	eet = ept = spt = svt = evt = set = t0;
+	int rc = 0;
+	const char *sim_file = NULL;
+	const char *sim_opts = NULL;
+	char *job_args[MAX_FLASH_JOBS];
+	struct flash_job jobs[MAX_FLASH_JOBS];
+	int i, j, njobs = 0;
+	bool numa = false;
+	bool locked = false;
+	const char *journal = NULL;
+	bool resume = false;
+	bool skip_same = false;
+	int sample = FINGERPRINT_SAMPLE;
+	const char *reset_region = NULL;
+	int reset_timeout = RESET_TIMEOUT;
+	int card_list[MAX_FLASH_JOBS], ncards = 0;
+	bool inventory_cmd = false;
+	const char *psl = PSL_DEVICES;
+	const char *output = "json";
+	const char *metrics_fmt = NULL;
+	const char *metrics_file = NULL;
+	bool background = false;
+	unsigned long max_rate = 0;
+	int cpu_pct = 0;
+	const char *cpus = NULL;
+	bool no_trim = false;
+	bool repair = false;
+	bool split = false;
+	const char *trace = NULL;
 
 	int card_no = DEFAULT_CAPI_CARD;
 	bool factory = false;
+	bool delta = false;
+	bool audit = false;
+	uint64_t read_size = 0;
+	const char *dump[2] = { NULL, NULL };
+	int credits = 0;
+	int read_window = FLASH_READ_SIZE;
 	const char *flash_type = "BPIx16";			//default
 	int flash_block_size = DEFAULT_BLOCK_SIZE;		// 256 KB;
 
@@ -298,9 +1661,14 @@ int main (int argc, char *argv[])
 	fpga_file[0] = NULL;
 	fpga_file[1] = NULL;  //For SPIx8 (dual SPIx4) devices
 
-	bool is_SPIx8 = false;
-	bool is_SPI   = false;
-	
+	/* Subcommand */
+	if (argc > 1 && 0 == strcmp(argv[1], "inventory")) {
+		inventory_cmd = true;
+		argv[1] = argv[0];
+		argc--;
+		argv++;
+	}
+
 	int cmd;
 	while (1) {
 		int option_index = 0;
@@ -317,13 +1685,44 @@ int main (int argc, char *argv[])
 			{ "file2",     required_argument, NULL, 'F' },
 			{ "factory",   required_argument, NULL, 'p' },
 			{ "type",      required_argument, NULL, 't' },
+			{ "delta",     no_argument,       NULL, 'd' },
+			{ "audit",     no_argument,       NULL, 'u' },
+			{ "size",      required_argument, NULL, 'l' },
+			{ "dump",      required_argument, NULL, 'D' },
+			{ "dump2",     required_argument, NULL, 'E' },
+			{ "stream",    no_argument,       NULL, 's' },
+			{ "credits",   required_argument, NULL, 'c' },
+			{ "read-window", required_argument, NULL, 'w' },
+			{ "sim",       required_argument, NULL, 'S' },
+			{ "sim-opts",  required_argument, NULL, 'O' },
+			{ "job",       required_argument, NULL, 'j' },
+			{ "numa",      no_argument,       NULL, 'N' },
+			{ "locked",    no_argument,       NULL, 'L' },
+			{ "journal",   required_argument, NULL, 'J' },
+			{ "resume",    no_argument,       NULL, 'R' },
+			{ "skip-same", no_argument,       NULL, 'k' },
+			{ "sample",    required_argument, NULL, 'n' },
+			{ "reset",     required_argument, NULL, 'r' },
+			{ "reset-timeout", required_argument, NULL, 'T' },
+			{ "metrics",   required_argument, NULL, 'm' },
+			{ "metrics-file", required_argument, NULL, 'M' },
+			{ "psl-devices", required_argument, NULL, 'P' },
+			{ "output",    required_argument, NULL, 'o' },
+			{ "background", no_argument,      NULL, 'B' },
+			{ "max-rate",  required_argument, NULL, 'X' },
+			{ "cpu-budget", required_argument, NULL, 'U' },
+			{ "cpus",      required_argument, NULL, 'I' },
+			{ "no-trim",   no_argument,       NULL, 'x' },
+			{ "repair",    no_argument,       NULL, 'y' },
+			{ "split",     no_argument,       NULL, 'Z' },
+			{ "trace",     required_argument, NULL, 'e' },
 			{ 0,           no_argument,       NULL, 0   },
 		};
-		cmd = getopt_long(argc, argv, ":vhVqpC:a:A:b:f:F:t:",
+		cmd = getopt_long(argc, argv, ":vhVqpdusNLRkBxyZJ:n:r:T:C:a:A:b:f:F:t:S:O:j:c:w:l:D:E:m:M:P:o:X:U:I:e:",
 				long_options, &option_index);
 		if (-1 == cmd) break;	/* all params processed ? */ 
 		/* if next option is taken as argument when the required argument is missing */
-		if (optarg && (optarg[0] == '-') ) {
+		if (optarg && (optarg[0] == '-') && (optarg[1] != '\0')) {
 			eprintf("%s Invalid or missing argument for option '-%c': %s\n", argv[0], cmd, optarg);
 			exit(0);
 		}
@@ -344,6 +1743,9 @@ int main (int argc, char *argv[])
 			break;
 		case 'C':
 			card_no = strtol(optarg, (char **)NULL, 0);
+			/* --reset and inventory take several */
+			if (ncards < MAX_FLASH_JOBS)
+				card_list[ncards++] = card_no;
 			break;
 		case 'a':
 			flash_address[0] = strtol(optarg, (char **)NULL, 0);
@@ -366,6 +1768,104 @@ int main (int argc, char *argv[])
 		case 'p':  /* factory */
 			factory = true;
 			break;
+		case 'd':
+			delta = true;
+			break;
+		case 'u':
+			audit = true;
+			break;
+		case 'l':
+			read_size = strtoull(optarg, (char **)NULL, 0);
+			break;
+		case 'D':
+			dump[0] = optarg;
+			break;
+		case 'E':
+			dump[1] = optarg;
+			break;
+		case 's':
+			if (0 == credits)
+				credits = -1;
+			break;
+		case 'c':
+			credits = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'w':
+			read_window = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'S':
+			sim_file = optarg;
+			break;
+		case 'O':
+			sim_opts = optarg;
+			break;
+		case 'j':
+			if (njobs == MAX_FLASH_JOBS) {
+				eprintf("%s More than %d jobs\n", argv[0], MAX_FLASH_JOBS);
+				exit(EINVAL);
+			}
+			job_args[njobs++] = optarg;
+			break;
+		case 'N':
+			numa = true;
+			break;
+		case 'L':
+			locked = true;
+			break;
+		case 'J':
+			journal = optarg;
+			break;
+		case 'R':
+			resume = true;
+			break;
+		case 'k':
+			skip_same = true;
+			break;
+		case 'n':
+			sample = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'r':
+			reset_region = optarg;
+			break;
+		case 'T':
+			reset_timeout = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'm':
+			metrics_fmt = optarg;
+			break;
+		case 'M':
+			metrics_file = optarg;
+			break;
+		case 'P':
+			psl = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'B':
+			background = true;
+			break;
+		case 'X':
+			max_rate = strtoul(optarg, (char **)NULL, 0);
+			break;
+		case 'U':
+			cpu_pct = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'I':
+			cpus = optarg;
+			break;
+		case 'x':
+			no_trim = true;
+			break;
+		case 'y':
+			repair = true;
+			break;
+		case 'Z':
+			split = true;
+			break;
+		case 'e':
+			trace = optarg;
+			break;
 		case ':': /* missing argument (: must be first in getopt_long) */
 			eprintf("%s Missing argument for option '-%c'\n", argv[0], optopt);
 			help(argv[0]);
@@ -378,327 +1878,221 @@ int main (int argc, char *argv[])
 		}
 	}
 
-	if (strcmp(flash_type, "SPIx8") == 0)
-		is_SPIx8 = true;
-	if (strcmp(flash_type, "BPIx16") != 0)
-		is_SPI   = true;
-
-	/* Check card_no and cfg_file */
-	if (asprintf(&cfg_file, CXL_SYSFS_PATH"%d"CXL_CONFIG, card_no) == -1) {
-		perror("Error");
-		eprintf("Can not Create: "CXL_SYSFS_PATH);
-		rc = ENOMEM;
-		goto __exit0;
-	}
-	if ((CFG = open(cfg_file, O_RDWR)) < 0) {
-		perror("Error");
-		eprintf("Can not open %s\n", cfg_file);
-		rc = EACCES;
-		goto __exit0;
-	}
-
-	/* Set Address to 0 in case factory flag is set */
-	if (factory) {
-		flash_address[0] = 0;
-		flash_address[1] = DEFAULT_FACTORY_FLASH_ADDRESS_SEC;
-	}
-
-	/* Print collected arguments */
-	vprintf1("CAPI CFG Dir   : %s\n", cfg_file);
-	vprintf1("Flash Type     : %s\n", flash_type);
-	if (is_SPIx8 ) {
-		vprintf1("File to Flash (primary)   : %s\n",   fpga_file[0]);
-		vprintf1("       Write to  adddress : 0x%x\n", flash_address[0]);
-		vprintf1("File to Flash (secondary) : %s\n", fpga_file[1]);
-		vprintf1("       Write to  adddress : 0x%x\n", flash_address[1]);
-	} else {
-		vprintf1("File to Flash : %s\n",   fpga_file[0]);
-		vprintf1("Flash Address : 0x%x\n", flash_address[0]);
-	}
-
-	vprintf1("Flash Block Size : %d (*1024 Bytes)\n", flash_block_size);
-	vprintf1("Quiet Flag     : %d\n", quiet);
-	vprintf1("Verbose Flag   : %d\n", verbose);
-	vprintf1("Factory Flag   : %d\n", factory);
-
-	/* Look for VSEC Offset and locate Flash Registers */
-	int config_word = 0;
-	int sub_dev = 0;
-	int vsec_offset = 0;
-	if (read_config_word(CFG, PCI_ID, &config_word))
-		goto __exit;
-	if (read_config_word(CFG, 0x2C, &sub_dev))
-		goto __exit;
-
-	int vendor = PCI_VENDORID(config_word);
-	int device = PCI_DEVICEID(config_word);
+	/* Dumped data goes to stdout, keep messages off it */
+	for (i = 0; i < 2; i++)
+		if (dump[i] && 0 == strcmp(dump[i], "-")) {
+			quiet = true;
+			verbose = 0;
+		}
 
-	vprintf("Vendor ID: %04X\n", vendor);
-	vprintf("  Device / Sub Device ID: %04X / %04X\n",
-			device, PCI_DEVICEID(sub_dev));
-	// Check for known CAPI device
-	if ( (vendor != IBM_PCIID) || (( device != CAPI_PCIID) && (device != CAPI_LEGACY0) && (device != CAPI_LEGACY1))) {
-		eprintf("Unknown Vendor (0x%x) or Device ID (0x%x)\n", vendor, device);
-		goto __exit;
-	}
-
-	if (0 != search_capi_vsec(CFG, &vsec_offset, &config_word))
-		goto __exit;
-	vprintf1("VSEC Offset: 0x%03X\n", vsec_offset);
-	// Get VSEC size and revision
-	int vsec_rev = VSEC_REV(config_word);
-	int vsec_size = VSEC_LENGTH(config_word);
-
-	vprintf1("VSEC Length: 0x%03X\nVSEC ID: 0x%1X\n", vsec_size, vsec_rev);
-	// Set address for flash registers
-	if (vsec_size == 0x80) {
-		vprintf("	Version 0.12\n");
-		addr_reg = vsec_offset + FLASH_ADDR_OFFSET;
-		size_reg = vsec_offset + FLASH_SIZE_OFFSET;
-		cntl_reg = vsec_offset + FLASH_CNTL_OFFSET;
-		data_reg = vsec_offset + FLASH_DATA_OFFSET;
-	} else {
-		// Hard code register values for legacy devices
-		vprintf("	Version 0.10\n");
-		addr_reg = 0x920;
-		size_reg = 0x924;
-		cntl_reg = 0x928;
-		data_reg = 0x92c;
+	if (metrics_fmt) {
+		rc = metrics_open(metrics_fmt, metrics_file);
+		if (EINVAL == rc) {
+			eprintf("%s Unknown metrics format '%s'\n", argv[0],
+				metrics_fmt);
+			exit(EINVAL);
+		} else if (0 != rc) {
+			errno = rc;
+			perror("Error");
+			eprintf("Can not open %s\n", metrics_file);
+			exit(rc);
+		}
 	}
-	vprintf1("Addr reg: 0x%03X\nSize reg: 0x%03X\nCntl reg: 0x%03X\n"
-		"Data reg: 0x%03X\n", addr_reg, size_reg, cntl_reg, data_reg); 
 
 	// Set stdout to autoflush
 	setvbuf(stdout, NULL, _IONBF, 0);
+	cfg_timing = (verbose > 1);
 
+	if (inventory_cmd) {
+		if (strcmp(output, "json") && strcmp(output, "shell")) {
+			eprintf("%s Unknown output '%s'\n", argv[0], output);
+			exit(EINVAL);
+		}
+		if (sim_file) {
+			card_list[0] = card_no;
+			ncards = 1;
+		} else if (0 == ncards)
+			ncards = inventory_cards(card_list, MAX_FLASH_JOBS);
+		return inventory(card_list, ncards, sim_file, sim_opts, psl,
+			0 == strcmp(output, "shell"));
+	}
 
-	//# -------------------------------------------------------------------------------
-	//# Main Process: Erase, Program, Verify
-	//# -------------------------------------------------------------------------------
-	
-
-	int round = 0; 
-	for (round = 0; round < (is_SPIx8 ? 2 : 1); round ++) {
-		set = time(NULL);  /* Start Erase Time */
-		if (round == 1)
-			dprintf("------------------------------------------\nProcess secondary file.\n");
-		else
-			dprintf("------------------------------------------\n");
+	if (reset_region) {
+		if (njobs || sim_file) {
+			eprintf("%s --reset takes real cards\n", argv[0]);
+			exit(EINVAL);
+		}
+		if (0 == ncards)
+			card_list[ncards++] = card_no;
+		return reset_cards(card_list, ncards, reset_region,
+			reset_timeout, locked);
+	}
 
+	if (numa && cpus) {
+		eprintf("%s --numa and --cpus both set the CPUs\n", argv[0]);
+		exit(EINVAL);
+	}
+	if (background && 0 == max_rate && 0 == cpu_pct)
+		cpu_pct = BACKGROUND_CPU_PCT;
+	rc = flash_background(background, cpus);
+	if (0 != rc)
+		exit(rc);
+	if (trace) {
+		rc = capi_flash_trace_open(trace);
+		if (0 != rc) {
+			eprintf("Can not open %s: %s\n", trace, strerror(rc));
+			exit(rc);
+		}
+	}
 
+	/* Single card from the command line options */
+	if (0 == njobs) {
 		/* Check for files */
-		if (NULL == fpga_file[round]) {
+		if (!((audit || dump[0]) && read_size) && (NULL == fpga_file[0] ||
+		    (strcmp(flash_type, "SPIx8") == 0 && NULL == fpga_file[1] &&
+		     !split))) {
 			eprintf("%s Missing Option -f -a -b and -C must be set\n", argv[0]);
 			help(argv[0]);
-			rc = EINVAL;
-			goto __exit0;
-		}
-
-		if (-1 != FPGA_BIN)
-			close(FPGA_BIN);
-		if ((FPGA_BIN = open(fpga_file[round], O_RDONLY)) < 0) {
-			perror("Error");
-			eprintf("Can not open %s\n", fpga_file[round]);
-			rc = ENOENT;
-			goto __exit0;
+			exit(EINVAL);
 		}
-		
-		off_t fsize;
-		struct stat tempstat;
-		int num_blocks, flash_block_size_words;
-
-		// Flash address is byte for SPI
-		// Flash address is 4B words for BPIx16
-		if ( is_SPI )
-			address = flash_address[round];
-		else
-			address = flash_address[round] >> 2;
-		
-		// Find size of FPGA binary
-		if (stat(fpga_file[round], &tempstat) != 0) {
-			perror("Error");
-			eprintf("Cannot determine size of %s\n", fpga_file[round]);
-			goto __exit;
+		if (split && (strcmp(flash_type, "SPIx8") || fpga_file[1])) {
+			eprintf("%s --split is for SPIx8 from --file alone\n",
+				argv[0]);
+			exit(EINVAL);
 		}
-		fsize = tempstat.st_size;
-
-		num_blocks = fsize / (flash_block_size * 1024);
-		// Size of flash block in words. Flash word = 4B
-		flash_block_size_words = flash_block_size * 1024 / 4;
-                if (factory == true)
-		        dprintf("Programming Factory Partition");
-                else
-                        dprintf("Programming User Partition");
-                dprintf("(@ 0x%08X) with %ld Bytes from File: %s\n",
-				address, fsize, fpga_file[round]);
-		dprintf("  Program -> for Size: %d in blocks (%dK Words or %dK Bytes)\n\n",num_blocks,
-			flash_block_size/4 , flash_block_size);
-
-		dprintf("Reset Flash\n");
-		if (0 != flash_reset_wait(CFG, cntl_reg))
-			goto __exit;
-
-		//# -------------------------------------------------------------------------------
-		//# Erase Flash
-		//# -------------------------------------------------------------------------------
-		dprintf("Erasing Flash\n");
-		rc = flash_erase(CFG, addr_reg, size_reg, cntl_reg,
-				address, num_blocks);
-		eet = time(NULL);  /* End Erase Time */
-		spt = ept = svt = evt = eet;
-		if (0 != rc)
-			goto __exit;
-		/* Number of Write Words (each does have 4 Bytes)  */
-		flash_words = flash_block_size_words * (num_blocks + 1);
+		memset(&jobs[0], 0, sizeof(jobs[0]));
+		jobs[0].card_no = card_no;
+		jobs[0].flash_type = flash_type;
+		jobs[0].flash_block_size = flash_block_size;
+		jobs[0].flash_address[0] = flash_address[0];
+		jobs[0].flash_address[1] = flash_address[1];
+		jobs[0].fpga_file[0] = fpga_file[0];
+		jobs[0].fpga_file[1] = fpga_file[1];
+		jobs[0].factory = factory;
+		jobs[0].delta = delta;
+		jobs[0].audit = audit;
+		jobs[0].read_size = read_size;
+		jobs[0].dump[0] = dump[0];
+		jobs[0].dump[1] = dump[1];
+		jobs[0].credits = credits;
+		jobs[0].read_window = read_window;
+		jobs[0].sim_file = sim_file;
+		jobs[0].sim_opts = sim_opts;
+		jobs[0].locked = locked;
+		jobs[0].journal = journal;
+		jobs[0].resume = resume;
+		jobs[0].skip_same = skip_same;
+		jobs[0].sample = sample;
+		jobs[0].max_rate = max_rate;
+		jobs[0].cpu_pct = cpu_pct;
+		jobs[0].background = background;
+		jobs[0].no_trim = no_trim;
+		jobs[0].repair = repair;
+		jobs[0].split = split;
+		if (numa)
+			flash_job_pin(card_no);
+		flash_sigint_setup(jobs, 1);
+		rc = flash_card(&jobs[0]);
+		rc = flash_trace_close(trace, rc);
+		metrics_close();
+		return rc;
+	}
 
-		//# -------------------------------------------------------------------------------
-		//# Program Flash
-		//# -------------------------------------------------------------------------------
-		dprintf("\n\nProgramming Flash\n");
-
-		int bc = 0;
-		int i;
-		dprintf("Writing Block:\n");
-
-		//Need to add 64 for SPI device
-		//Otherwise stuck at waiting for FLASH_OP_DONE
-		for (i = 0; i < flash_words + (is_SPI ? 64: 0); i++) {
-			dif = read(FPGA_BIN, &dat, 4);
-			if (!(dif))
-				dat = 0xFFFFFFFF;	 /* Provide data for EOF */
-			rc = flash_write(CFG, cntl_reg, data_reg, dat);
-			ept = time(NULL);
-			svt = evt = ept;
-			if (0 != rc)
-				goto __exit;
-			if (((i+1) % (flash_block_size_words)) == 0) {
-				dprintf("\r %d",bc);
-				bc++;
-			}
+	/* --job card=N,... takes the other options as defaults */
+	if (journal) {
+		eprintf("%s Use journal=F per --job\n", argv[0]);
+		exit(EINVAL);
+	}
+	for (i = 0; i < njobs; i++) {
+		struct flash_job *job = &jobs[i];
+
+		memset(job, 0, sizeof(*job));
+		job->card_no = -1;
+		job->flash_type = flash_type;
+		job->flash_block_size = flash_block_size;
+		job->flash_address[0] = DEFAULT_USER_FLASH_ADDRESS;
+		job->flash_address[1] = DEFAULT_USER_FLASH_ADDRESS_SEC;
+		job->factory = factory;
+		job->delta = delta;
+		job->audit = audit;
+		job->read_size = read_size;
+		job->credits = credits;
+		job->read_window = read_window;
+		job->sim_opts = sim_opts;
+		job->resume = resume;
+		job->skip_same = skip_same;
+		job->sample = sample;
+		job->max_rate = max_rate;
+		job->cpu_pct = cpu_pct;
+		job->background = background;
+		job->no_trim = no_trim;
+		job->repair = repair;
+		job->split = split;
+		if (0 != flash_job_parse(job, job_args[i])) {
+			help(argv[0]);
+			exit(EINVAL);
 		}
-		printf("\n");
-
-		//# -------------------------------------------------------------------------------
-		//# Wait for Flash Program to complete.
-		//# -------------------------------------------------------------------------------
-		rc = flash_wait_op(CFG, cntl_reg, FLASH_OP_DONE, FLASH_OP_DONE, 120);
-		ept = time(NULL);
-		svt = evt = ept;
-		if (0 != rc)
-			goto __exit;
-		//# -------------------------------------------------------------------------------
-		//# Reset and wait
-		//# -------------------------------------------------------------------------------
-		rc =  flash_reset_wait(CFG, cntl_reg);
-		evt =  time(NULL);
-		if (0 != rc)
-			goto __exit;
-		dprintf("\n");
-
-		//# -------------------------------------------------------------------------------
-		//# Verify Flash Programmming
-		//# -------------------------------------------------------------------------------
-		dprintf("Verifying Flash\n");
-
-		lseek(FPGA_BIN, 0, SEEK_SET);   // Reset to beginning of file
-		svt = time(NULL);		// Get Start Verify Time
-		bc = 0;
-
-		raddress = address;
-		ma = address;
-		dprintf("Reading Block:\n");
-		
-		if(is_SPI) {
-			//SPI needs to send a READ_REQ at the beginning.
-			if (0 != rc)
-				goto __exit;
-			rc = write_config_word(CFG, cntl_reg, FLASH_READ_REQ);
-		}
-
-		for( i = 0; i < flash_words; i++) {
-			evt = time(NULL);
-			dif = read(FPGA_BIN,&edat,4);
-			if (!(dif))
-				edat = 0xFFFFFFFF;
-			
-			//----------------------------------------
-			//The way to check Flash ready is different
-			if (is_SPI) {
-				//----------------------------------------
-				// For SPI
-				// Data is read out serially
-				rc = flash_wait_op(CFG, cntl_reg, FLASH_RDATA_VALID, FLASH_RDATA_VALID, 30);
-				raddress += 4;
-				if (0 != rc)
-					goto __exit;
-			} else {
-				// For BPIx16
-				// At 512 word read size.
-				if ((i % 512) == 0) {
-					rc = flash_set_read_addr(CFG, addr_reg, size_reg, cntl_reg,
-							raddress, FLASH_READ_SIZE);
-					if (0 != rc)
-						goto __exit;
-					raddress += FLASH_READ_SIZE;
-					cntl_remain = FLASH_READ_SIZE -1;
-				}
-
-				cntl_remain = (cntl_remain - 1) & 0x3ff;
-				rc = flash_wait_ready(CFG, cntl_reg, cntl_remain);
-				if (0 != rc)
-					goto __exit;
-			}
-
-			
-			
-			// Read data from flash
-			rc = read_config_word(CFG, data_reg, &dat);
-			if (0 != rc)
-				goto __exit;
-
-			if ((edat != dat) && (print_cnt < 1024)) {
-				if (is_SPI) 
-				ma = raddress - 4; 
-				else
-				ma = raddress + (i % 512) - FLASH_READ_SIZE;
-				eprintf("Data Miscompare @: %08x --> %08x expected %08x\n",ma, dat, edat);
-				print_cnt++;
+		for (j = 0; j < i; j++)
+			if (jobs[j].card_no == job->card_no) {
+				eprintf("card%d is used by more than one job\n",
+					job->card_no);
+				exit(EINVAL);
 			}
-
-			if (((i+1) % (flash_block_size_words)) == 0) {
-				dprintf("\r %d", bc);
-				bc++;
+		for (j = 0; j < 2; j++)
+			if (job->dump[j] && 0 == strcmp(job->dump[j], "-")) {
+				eprintf("card%d: Dump to stdout needs a single card\n",
+					job->card_no);
+				exit(EINVAL);
 			}
-		} //Verify done.
-
-		rc = 0;		   /* Good */
-		dprintf("\n");
-		evt = time(NULL);  /* Get End of verification time */
-		//# -------------------------------------------------------------------------------
-		//# Calculate and Print Elapsed Times
-		//# -------------------------------------------------------------------------------
-		dprintf("Erase Time:   %d seconds\n", (int)(eet - set));
-		dprintf("Program Time: %d seconds\n", (int)(ept - spt));
-		dprintf("Verify Time:  %d seconds\n", (int)(evt - svt));
-	} // End Loop
-
-	dprintf("------------------------------------------\n");
-	dprintf("Total Time:   %d seconds\n", (int)(evt - t0));
-
-
-__exit:
-	dprintf("Flash RC: %d\n", rc);
-	dprintf("------------------------------------------\n");
+		if (sim_file && NULL == job->sim_file &&
+		    asprintf(&job->sim_alloc, "%s.%d", sim_file, job->card_no) > 0)
+			job->sim_file = job->sim_alloc;
+		job->numa = numa;
+		job->locked = locked;
+	}
 
-__exit0:
-	if (-1 != FPGA_BIN)
-		close(FPGA_BIN);
-	if (-1 != CFG) {
-		if (0 != cntl_reg)
-			flash_reset(CFG, cntl_reg);
-		close(CFG);
-	}
-	if (cfg_file)
-		free(cfg_file);
+	flash_sigint_setup(jobs, njobs);
+
+	/* Per card progress would interleave, report when all are done */
+	bool report = !quiet;
+	quiet = true;
+	for (i = 0; i < njobs; i++) {
+		if (report)
+			printf("card%d: %s%s %s%s%s\n", jobs[i].card_no,
+				jobs[i].dump[0] ? "dump " :
+				jobs[i].audit ? "audit " : "",
+				jobs[i].flash_type,
+				jobs[i].fpga_file[0] ? jobs[i].fpga_file[0] : "",
+				jobs[i].fpga_file[1] ? " " : "",
+				jobs[i].fpga_file[1] ? jobs[i].fpga_file[1] : "");
+		jobs[i].t0 = now_ns();
+		rc = pthread_create(&jobs[i].thread, NULL, flash_job_thread,
+				&jobs[i]);
+		if (0 != rc) {
+			eprintf("Can not start thread for card%d: %s\n",
+				jobs[i].card_no, strerror(rc));
+			jobs[i].rc = rc;
+			continue;
+		}
+		jobs[i].started = true;
+	}
+	rc = 0;
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		if (report && jobs[i].started)
+			printf("card%d: Flash RC: %d (%.3f seconds)\n",
+				jobs[i].card_no, jobs[i].rc,
+				(jobs[i].t1 - jobs[i].t0) / 1e9);
+		else if (report)
+			printf("card%d: Flash RC: %d (not started)\n",
+				jobs[i].card_no, jobs[i].rc);
+		if (0 != jobs[i].rc)
+			rc = jobs[i].rc;
+		free(jobs[i].sim_alloc);
+	}
+	rc = flash_trace_close(trace, rc);
+	metrics_close();
 	return rc;
 }
+
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include "capi_flash.h"
+#include "capi_flash_cfg.h"
+#include "capi_flash_sim.h"
+#include "capi_flash_trace.h"
+
+bool cfg_timing = false;
+static __thread struct cfg_stats stats;
+
+struct cfg_stats *cfg_stats(void)
+{
+	return &stats;
+}
+
+void cfg_stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+static uint64_t cfg_now(void)
+{
+	struct timespec ts;
+
+	if (!cfg_timing && !trace_active)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Account one syscall covering n registers from offset */
+static void cfg_account(int offset, int n, bool write, uint64_t t0)
+{
+	uint64_t ns = cfg_timing ? (cfg_now() - t0) / n : 0;
+	int i;
+
+	stats.syscalls++;
+	for (i = 0; i < n; i++) {
+		struct cfg_reg_stat *r = &stats.reg[(offset / 4 + i) %
+						(CFG_SPACE_SIZE / 4)];
+
+		if (write)
+			r->writes++;
+		else
+			r->reads++;
+		r->ns += ns;
+	}
+	stats.reg[(offset / 4) % (CFG_SPACE_SIZE / 4)].syscalls++;
+}
+
+int read_config_words(int cfg, int offset, int *vals, int n)
+{
+	uint64_t t0 = cfg_now();
+	ssize_t ret = n * 4;
+	int i;
+
+	if (cfg_sim_active(cfg)) {
+		for (i = 0; i < n && 4 * n == ret; i++)
+			if (4 != cfg_sim_read(cfg, offset + 4 * i, &vals[i]))
+				ret = -1;
+	} else {
+		ret = pread(cfg, vals, n * 4, offset);
+	}
+	cfg_account(offset, n, false, t0);
+	if (trace_active)
+		trace_access(offset, vals, n, false, n * 4 == ret, t0, cfg_now());
+	if (n * 4 == ret)
+		return 0;
+	return FLASH_ERR_CFG_READ;   /* The caller tells which register */
+}
+
+int write_config_words(int cfg, int offset, const int *vals, int n)
+{
+	uint64_t t0 = cfg_now();
+	ssize_t ret = n * 4;
+	int i;
+
+	if (cfg_sim_active(cfg)) {
+		for (i = 0; i < n && 4 * n == ret; i++)
+			if (4 != cfg_sim_write(cfg, offset + 4 * i, vals[i]))
+				ret = -1;
+	} else {
+		ret = pwrite(cfg, vals, n * 4, offset);
+	}
+	cfg_account(offset, n, true, t0);
+	if (trace_active)
+		trace_access(offset, vals, n, true, n * 4 == ret, t0, cfg_now());
+	if (n * 4 == ret)
+		return 0;
+	return FLASH_ERR_CFG_WRITE;   /* The caller tells which register */
+}
+
+int read_config_word(int cfg, int offset, int *retVal)
+{
+	return read_config_words(cfg, offset, retVal, 1);
+}
+
+int write_config_word(int cfg, int offset, int data)
+{
+	return write_config_words(cfg, offset, &data, 1);
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "capi_flash_decode.h"
+
+static const unsigned char bit_magic[] = {
+	0x00, 0x09, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x00,
+};
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+int decode_format(const unsigned char *head, size_t len)
+{
+	size_t i;
+
+	if (len >= sizeof(bit_magic) &&
+	    0 == memcmp(head, bit_magic, sizeof(bit_magic)))
+		return DECODE_BIT;
+	if (len >= 9 && ':' == head[0]) {
+		for (i = 1; i < 9 && hexval(head[i]) >= 0; i++)
+			;
+		if (9 == i)
+			return DECODE_MCS;
+	}
+	return DECODE_BIN;
+}
+
+const char *decode_name(int format)
+{
+	static const char *names[] = { "bin", "bit", "mcs" };
+
+	return names[format];
+}
+
+/* Next input byte, -1 at the end or on a read error (err set) */
+static int in_getc(struct decoder *d)
+{
+	ssize_t n;
+
+	if (d->in_pos == d->in_len) {
+		if (d->in_eof)
+			return -1;
+		n = d->read(d->arg, d->in, sizeof(d->in));
+		if (n < 0)
+			snprintf(d->err, sizeof(d->err), "Can not read image: %s",
+				strerror(errno));
+		if (n <= 0) {
+			d->in_eof = true;
+			return -1;
+		}
+		d->in_len = n;
+		d->in_pos = 0;
+	}
+	return d->in[d->in_pos++];
+}
+
+/* len input bytes, from what is buffered first */
+static ssize_t in_read(struct decoder *d, void *buf, size_t len)
+{
+	size_t n = d->in_len - d->in_pos;
+
+	if (n) {
+		n = n < len ? n : len;
+		memcpy(buf, d->in + d->in_pos, n);
+		d->in_pos += n;
+		return n;
+	}
+	if (d->in_eof)
+		return 0;
+	n = d->read(d->arg, buf, len);
+	if ((ssize_t)n < 0)
+		snprintf(d->err, sizeof(d->err), "Can not read image: %s",
+			strerror(errno));
+	return n;
+}
+
+static int in_be(struct decoder *d, int bytes, uint32_t *val)
+{
+	int c;
+
+	*val = 0;
+	while (bytes--) {
+		c = in_getc(d);
+		if (c < 0)
+			return EINVAL;
+		*val = *val << 8 | c;
+	}
+	return 0;
+}
+
+/*
+ * .bit header: a 9 byte field (the magic), a 1, then key byte fields
+ * 'a' design, 'b' part, 'c' date, 'd' time with a 16 bit length, and
+ * 'e' with the 32 bit length of the bitstream that follows.
+ */
+static int bit_header(struct decoder *d)
+{
+	char field[256];
+	uint32_t len, i;
+	int key, c;
+
+	if (0 != in_be(d, 2, &len))
+		goto __error;
+	for (i = 0; i < len; i++)
+		if (in_getc(d) < 0)
+			goto __error;
+	if (0 != in_be(d, 2, &len))
+		goto __error;
+	while ((key = in_getc(d)) >= 'a' && key <= 'd') {
+		if (0 != in_be(d, 2, &len))
+			goto __error;
+		for (i = 0; i < len; i++) {
+			c = in_getc(d);
+			if (c < 0)
+				goto __error;
+			if (i < sizeof(field) - 1)
+				field[i] = c;
+		}
+		field[len < sizeof(field) ? len : sizeof(field) - 1] = '\0';
+		if ('a' == key)
+			snprintf(d->design, sizeof(d->design), "%.*s",
+				(int)sizeof(d->design) - 1, field);
+		else if ('b' == key)
+			snprintf(d->part, sizeof(d->part), "%.*s",
+				(int)sizeof(d->part) - 1, field);
+	}
+	if ('e' != key || 0 != in_be(d, 4, &len))
+		goto __error;
+	d->bit_len = d->bit_left = len;
+	return 0;
+ __error:
+	if ('\0' == d->err[0])
+		snprintf(d->err, sizeof(d->err), "Bad .bit header");
+	return EINVAL;
+}
+
+static ssize_t bit_read(struct decoder *d, unsigned char *buf, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len && d->bit_left) {
+		n = in_read(d, buf + got, len - got < d->bit_left ?
+			len - got : d->bit_left);
+		if (n < 0)
+			return -1;
+		if (0 == n) {
+			snprintf(d->err, sizeof(d->err),
+				".bit image ends %llu bytes early",
+				(unsigned long long)d->bit_left);
+			return -1;
+		}
+		got += n;
+		d->bit_left -= n;
+	}
+	return got;
+}
+
+static ssize_t bin_read(struct decoder *d, unsigned char *buf, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		n = in_read(d, buf + got, len - got);
+		if (n < 0)
+			return -1;
+		if (0 == n)
+			break;
+		got += n;
+	}
+	return got;
+}
+
+/* Next record ":LLAAAATT<data>CC" into d->rec, its type or -1 */
+static int mcs_record(struct decoder *d, uint32_t *addr)
+{
+	unsigned char b[4 + 255 + 1];
+	unsigned sum = 0, i, n = 0, want = 5;
+	int c, hi, lo;
+
+	do
+		c = in_getc(d);
+	while (' ' == c || '\t' == c || '\r' == c || '\n' == c);
+	if (c < 0)
+		return 1;		/* No EOF record, end anyway */
+	d->line++;
+	if (':' != c)
+		goto __error;
+	for (i = 0; i < want; i++) {
+		hi = hexval(in_getc(d));
+		lo = hexval(in_getc(d));
+		if (hi < 0 || lo < 0)
+			goto __error;
+		b[i] = hi << 4 | lo;
+		sum += b[i];
+		if (0 == i)
+			want = 5 + b[0];
+	}
+	if (sum & 0xff)
+		goto __error;
+	n = b[0];
+	*addr = b[1] << 8 | b[2];
+	memcpy(d->rec, b + 4, n);
+	d->rec_len = n;
+	d->rec_pos = 0;
+	return b[3];
+ __error:
+	snprintf(d->err, sizeof(d->err), "Bad Intel hex record in line %lu",
+		d->line);
+	return -1;
+}
+
+static ssize_t mcs_read(struct decoder *d, unsigned char *buf, size_t len)
+{
+	size_t got = 0, n;
+	uint32_t addr;
+	uint64_t at;
+	int type;
+
+	while (got < len) {
+		if (d->rec_pos < d->rec_len) {
+			at = d->rec_at + d->rec_pos;
+			if (d->mcs_pos < at) {
+				/* Gap between records: erased flash */
+				n = at - d->mcs_pos < len - got ?
+					at - d->mcs_pos : len - got;
+				memset(buf + got, 0xFF, n);
+			} else {
+				n = d->rec_len - d->rec_pos < len - got ?
+					d->rec_len - d->rec_pos : len - got;
+				memcpy(buf + got, d->rec + d->rec_pos, n);
+				d->rec_pos += n;
+			}
+			d->mcs_pos += n;
+			got += n;
+			continue;
+		}
+		if (d->eof)
+			break;
+		type = mcs_record(d, &addr);
+		if (type < 0)
+			return -1;
+		switch (type) {
+		case 0x00:
+			addr += d->mcs_base;
+			if (!d->mcs_started) {
+				d->mcs_started = true;
+				d->mcs_first = addr;
+			}
+			if (addr < d->mcs_first ||
+			    addr - d->mcs_first < d->mcs_pos) {
+				snprintf(d->err, sizeof(d->err),
+					"Intel hex records out of order in line %lu",
+					d->line);
+				return -1;
+			}
+			d->rec_at = addr - d->mcs_first;
+			break;
+		case 0x01:
+			d->eof = true;
+			break;
+		case 0x02:		/* Extended segment address */
+			d->mcs_base = (d->rec[0] << 8 | d->rec[1]) << 4;
+			break;
+		case 0x04:		/* Extended linear address */
+			d->mcs_base = (d->rec[0] << 8 | d->rec[1]) << 16;
+			break;
+		default:		/* Start addresses */
+			break;
+		}
+		if (0x00 != type)
+			d->rec_len = 0;
+	}
+	return got;
+}
+
+static ssize_t decode_stream(struct decoder *d, unsigned char *buf, size_t len)
+{
+	if (DECODE_BIT == d->format)
+		return bit_read(d, buf, len);
+	if (DECODE_MCS == d->format)
+		return mcs_read(d, buf, len);
+	return bin_read(d, buf, len);
+}
+
+int decode_start(struct decoder *d, int format, int half, decode_read_fn fn,
+			void *arg)
+{
+	memset(d, 0, sizeof(*d));
+	d->format = format;
+	d->half = half;
+	d->read = fn;
+	d->arg = arg;
+	if (DECODE_BIT == format)
+		return bit_header(d);
+	return 0;
+}
+
+/* The half's nibble of a and of b in one byte, a's first */
+static inline unsigned char nibbles(int half, unsigned char a, unsigned char b)
+{
+	if (DECODE_PRIMARY == half)
+		return (a & 0x0f) << 4 | (b & 0x0f);
+	return (a & 0xf0) | b >> 4;
+}
+
+ssize_t decode_read(struct decoder *d, void *buf, size_t len)
+{
+	unsigned char *out = buf;
+	size_t got = 0, want, i;
+	ssize_t n;
+
+	if (DECODE_WHOLE == d->half) {
+		n = decode_stream(d, out, len);
+		if (n > 0)
+			d->out += n;
+		return n;
+	}
+	while (got < len) {
+		want = 2 * (len - got) < sizeof(d->pair) ?
+			2 * (len - got) : sizeof(d->pair);
+		n = decode_stream(d, d->pair, want);
+		if (n < 0)
+			return -1;
+		if (n % 2)
+			d->pair[n++] = 0xFF;	/* Odd length: pad */
+		for (i = 0; i < (size_t)n / 2; i++)
+			out[got + i] = nibbles(d->half, d->pair[2 * i],
+				d->pair[2 * i + 1]);
+		got += n / 2;
+		if ((size_t)n < want)
+			break;
+	}
+	d->out += got;
+	return got;
+}
@@ -0,0 +1,370 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "capi_flash_digest.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+/* POWER8 and later, which ppc64le starts at: vpmsumd is always there */
+#if defined(__powerpc64__) && defined(__LITTLE_ENDIAN__) && \
+    defined(__CRYPTO__) && defined(__GNUC__)
+#define CRC32C_VPMSUM
+#endif
+
+#define CRC32C_POLY     0x82f63b78	/* Castagnoli, reflected */
+#define CRC32C_POLY_MSB 0x1edc6f41	/* The same, x^31 first */
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+static const char *crc32c_name;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Slice-by-8: eight table lookups per 8 bytes */
+static uint32_t crc32c_sw(uint32_t c, const uint8_t *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = crc32c_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		lo = c ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		c = crc32c_table[7][lo & 0xff] ^
+		    crc32c_table[6][(lo >> 8) & 0xff] ^
+		    crc32c_table[5][(lo >> 16) & 0xff] ^
+		    crc32c_table[4][lo >> 24] ^
+		    crc32c_table[3][hi & 0xff] ^
+		    crc32c_table[2][(hi >> 8) & 0xff] ^
+		    crc32c_table[1][(hi >> 16) & 0xff] ^
+		    crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = crc32c_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc, v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t crc32c_hw(uint32_t c, const uint8_t *p, size_t len)
+{
+	uint64_t v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = __crc32cb(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = __crc32cd(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = __crc32cb(c, *p++);
+	return c;
+}
+#endif
+
+#ifdef CRC32C_VPMSUM
+/*
+ * Folding with carry-less multiplies, as the kernel's crc32c-vpmsum:
+ * four 16 byte lanes, each is moved on by 64 bytes with one vpmsumd
+ * (lo * x^576 ^ hi * x^512, mod P) and the next 16 bytes xored in. The
+ * lanes are then folded into one and that goes through the tables.
+ */
+typedef unsigned long long crc32c_v2 __attribute__((vector_size(16)));
+
+static crc32c_v2 crc32c_k64;	/* Fold by 64 bytes */
+static crc32c_v2 crc32c_k16;	/* Fold by 16 bytes */
+
+/*
+ * Fold constant for x^n: the product of two bit reflected values comes
+ * out one bit short, so x^(n-1) mod P, reflected, in the upper half.
+ */
+static unsigned long long crc32c_xn(unsigned n)
+{
+	uint64_t r = 1;
+	uint32_t b = 0;
+	int i;
+
+	while (--n) {
+		r <<= 1;
+		if (r & (1ULL << 32))
+			r ^= (1ULL << 32) | CRC32C_POLY_MSB;
+	}
+	for (i = 0; i < 32; i++)
+		if (r & (1ULL << i))
+			b |= 1U << (31 - i);
+	return (unsigned long long)b << 32;
+}
+
+static inline crc32c_v2 crc32c_fold(crc32c_v2 x, crc32c_v2 k)
+{
+	return (crc32c_v2)__builtin_crypto_vpmsumd(
+		(__vector unsigned long long)x,
+		(__vector unsigned long long)k);
+}
+
+static uint32_t crc32c_hw(uint32_t c, const uint8_t *p, size_t len)
+{
+	crc32c_v2 x[4], d;
+	uint8_t b[16];
+	int i;
+
+	if (len < 128)
+		return crc32c_sw(c, p, len);
+	for (i = 0; i < 4; i++)
+		memcpy(&x[i], p + 16 * i, 16);
+	x[0][0] ^= c;
+	p += 64;
+	len -= 64;
+	while (len >= 64) {
+		for (i = 0; i < 4; i++) {
+			memcpy(&d, p + 16 * i, 16);
+			x[i] = crc32c_fold(x[i], crc32c_k64) ^ d;
+		}
+		p += 64;
+		len -= 64;
+	}
+	for (i = 1; i < 4; i++)
+		x[0] = crc32c_fold(x[0], crc32c_k16) ^ x[i];
+	memcpy(b, &x[0], 16);
+	c = crc32c_sw(0, b, 16);
+	return crc32c_sw(c, p, len);
+}
+
+/* Only trusted once it agrees with the tables */
+static void crc32c_vpmsum_init(void)
+{
+	uint8_t buf[1000];
+	unsigned i;
+
+	crc32c_k64 = (crc32c_v2){ crc32c_xn(576), crc32c_xn(512) };
+	crc32c_k16 = (crc32c_v2){ crc32c_xn(192), crc32c_xn(128) };
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 131 + 7;
+	if (crc32c_hw(~0U, buf, sizeof(buf)) !=
+	    crc32c_sw(~0U, buf, sizeof(buf)))
+		return;
+	crc32c_fn = crc32c_hw;
+	crc32c_name = "vpmsum";
+}
+#endif
+
+static void crc32c_init(void)
+{
+	uint32_t n, c;
+	int k;
+
+	for (n = 0; n < 256; n++) {
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[0][n] = c;
+	}
+	for (n = 0; n < 256; n++) {
+		c = crc32c_table[0][n];
+		for (k = 1; k < 8; k++) {
+			c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+			crc32c_table[k][n] = c;
+		}
+	}
+	crc32c_fn = crc32c_sw;
+	crc32c_name = "slice-by-8";
+#ifdef CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_fn = crc32c_hw;
+		crc32c_name = "sse4.2";
+	}
+#endif
+#ifdef CRC32C_ARM
+	crc32c_fn = crc32c_hw;
+	crc32c_name = "armv8 crc";
+#endif
+#ifdef CRC32C_VPMSUM
+	crc32c_vpmsum_init();
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_fn(~crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_name;
+}
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256 *c, const uint8_t *p)
+{
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 |
+		       p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	memcpy(s, c->h, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+		t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(&s[1], &s[0], 7 * sizeof(s[0]));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		c->h[i] += s[i];
+}
+
+void sha256_init(struct sha256 *c)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(c->h, h0, sizeof(h0));
+	c->len = 0;
+	c->n = 0;
+}
+
+void sha256_update(struct sha256 *c, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t k;
+
+	c->len += len;
+	if (c->n) {
+		k = 64 - c->n < len ? 64 - c->n : len;
+		memcpy(c->buf + c->n, p, k);
+		c->n += k;
+		p += k;
+		len -= k;
+		if (c->n < 64)
+			return;
+		sha256_block(c, c->buf);
+		c->n = 0;
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block(c, p);
+	memcpy(c->buf, p, len);
+	c->n = len;
+}
+
+void sha256_final(struct sha256 *c, uint8_t out[SHA256_LEN])
+{
+	uint64_t bits = c->len * 8;
+	int i;
+
+	c->buf[c->n++] = 0x80;
+	if (c->n > 56) {
+		memset(c->buf + c->n, 0, 64 - c->n);
+		sha256_block(c, c->buf);
+		c->n = 0;
+	}
+	memset(c->buf + c->n, 0, 56 - c->n);
+	for (i = 0; i < 8; i++)
+		c->buf[56 + i] = bits >> (56 - 8 * i);
+	sha256_block(c, c->buf);
+	for (i = 0; i < 8; i++) {
+		out[4 * i]     = c->h[i] >> 24;
+		out[4 * i + 1] = c->h[i] >> 16;
+		out[4 * i + 2] = c->h[i] >> 8;
+		out[4 * i + 3] = c->h[i];
+	}
+}
+
+void digest_init(struct flash_digest *d)
+{
+	d->crc = 0;
+	d->len = 0;
+	sha256_init(&d->sha);
+}
+
+void digest_update(struct flash_digest *d, const void *buf, size_t len)
+{
+	d->crc = crc32c(d->crc, buf, len);
+	d->len += len;
+	sha256_update(&d->sha, buf, len);
+}
+
+void digest_final(struct flash_digest *d, char *hex)
+{
+	uint8_t sha[SHA256_LEN];
+	int i;
+
+	sha256_final(&d->sha, sha);
+	for (i = 0; i < SHA256_LEN; i++)
+		sprintf(hex + 2 * i, "%02x", sha[i]);
+}
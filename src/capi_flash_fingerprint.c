@@ -0,0 +1,139 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include "capi_flash_fingerprint.h"
+
+#define FP_FORMAT_IN   "address %x type %7s blocksize %d subsys %x size %llu " \
+		       "blocks %d crc32c %x sha256 %64s time %ld"
+#define FP_FORMAT_OUT  "address 0x%08x type %s blocksize %d subsys 0x%04x " \
+		       "size %llu blocks %d crc32c %08x sha256 %s time %ld\n"
+
+/* All fingerprints in the store, lines that do not parse are dropped */
+static int fp_load(const char *path, struct fingerprint *fps)
+{
+	char line[256];
+	struct fingerprint fp;
+	unsigned long long size;
+	int n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (NULL == f)
+		return ENOENT == errno ? 0 : -errno;
+	while (n < FINGERPRINT_MAX && fgets(line, sizeof(line), f)) {
+		memset(&fp, 0, sizeof(fp));
+		if (9 != sscanf(line, FP_FORMAT_IN, &fp.address, fp.type,
+				&fp.block_size, &fp.subsys, &size, &fp.blocks,
+				&fp.crc32c, fp.sha256, &fp.time))
+			continue;
+		fp.size = size;
+		fps[n++] = fp;
+	}
+	fclose(f);
+	return n;
+}
+
+/* Write a new store next to the old one and rename it over it */
+static int fp_save(const char *path, const struct fingerprint *fps, int n)
+{
+	char tmp[PATH_MAX];
+	int i, rc = 0;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (NULL == f)
+		return errno;
+	for (i = 0; i < n; i++)
+		fprintf(f, FP_FORMAT_OUT, fps[i].address, fps[i].type,
+			fps[i].block_size, fps[i].subsys,
+			(unsigned long long)fps[i].size, fps[i].blocks,
+			fps[i].crc32c, fps[i].sha256, fps[i].time);
+	if (0 != fflush(f) || 0 != fsync(fileno(f)))
+		rc = errno;
+	if (0 != fclose(f) && 0 == rc)
+		rc = errno;
+	if (0 == rc && 0 != rename(tmp, path))
+		rc = errno;
+	if (0 != rc)
+		unlink(tmp);
+	return rc;
+}
+
+int fingerprint_find(const char *path, uint32_t address,
+			struct fingerprint *fp)
+{
+	struct fingerprint fps[FINGERPRINT_MAX];
+	int i, n;
+
+	n = fp_load(path, fps);
+	if (n < 0)
+		return -n;
+	for (i = 0; i < n; i++)
+		if (fps[i].address == address) {
+			*fp = fps[i];
+			return 0;
+		}
+	return ENOENT;
+}
+
+/* Rewrite the store without address' fingerprint and with fp if given */
+static int fp_update(const char *path, uint32_t address,
+			const struct fingerprint *fp)
+{
+	struct fingerprint fps[FINGERPRINT_MAX + 1];
+	int i, j, n;
+
+	n = fp_load(path, fps);
+	if (n < 0)
+		return -n;
+	for (i = j = 0; i < n; i++)
+		if (fps[i].address != address)
+			fps[j++] = fps[i];
+	if (j == n && NULL == fp)
+		return 0;	/* Nothing to drop */
+	if (fp)
+		fps[j++] = *fp;
+	if (j > FINGERPRINT_MAX)
+		return ENOSPC;
+	return fp_save(path, fps, j);
+}
+
+int fingerprint_store(const char *path, const struct fingerprint *fp)
+{
+	return fp_update(path, fp->address, fp);
+}
+
+int fingerprint_drop(const char *path, uint32_t address)
+{
+	return fp_update(path, address, NULL);
+}
+
+int fingerprint_match(const struct fingerprint *a,
+			const struct fingerprint *b)
+{
+	return a->address == b->address && 0 == strcmp(a->type, b->type) &&
+		a->block_size == b->block_size && a->subsys == b->subsys &&
+		a->size == b->size && a->blocks == b->blocks &&
+		a->crc32c == b->crc32c && 0 == strcmp(a->sha256, b->sha256);
+}
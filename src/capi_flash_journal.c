@@ -0,0 +1,114 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include "capi_flash_journal.h"
+
+#define JOURNAL_MAGIC   "capi-flash-journal 1"
+
+int journal_load(struct flash_journal *j, const char *path)
+{
+	char line[256];
+	struct journal_round jr;
+	unsigned long long size;
+	int r, rc = 0;
+	FILE *f;
+
+	memset(j, 0, sizeof(*j));
+	j->path = path;
+	f = fopen(path, "r");
+	if (NULL == f)
+		return errno;
+	if (NULL == fgets(line, sizeof(line), f) ||
+	    strncmp(line, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) ||
+	    NULL == fgets(line, sizeof(line), f) ||
+	    3 != sscanf(line, "card %d type %7s blocksize %d", &j->card,
+			j->type, &j->block_size))
+		rc = EINVAL;
+	while (0 == rc && fgets(line, sizeof(line), f)) {
+		memset(&jr, 0, sizeof(jr));
+		if (6 != sscanf(line, "round %d address %x size %llu blocks %d "
+				"confirmed %d sha256 %64s", &r, &jr.address,
+				&size, &jr.blocks, &jr.confirmed, jr.sha256) ||
+		    r < 0 || r > 1)
+			rc = EINVAL;
+		jr.size = size;
+		if (0 == rc)
+			j->round[r] = jr;
+	}
+	fclose(f);
+	return rc;
+}
+
+/* Write a new file next to the journal and rename it over the old one */
+int journal_save(const struct flash_journal *j)
+{
+	char tmp[PATH_MAX];
+	const struct journal_round *jr;
+	int r, rc = 0;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", j->path);
+	f = fopen(tmp, "w");
+	if (NULL == f)
+		return errno;
+	fprintf(f, JOURNAL_MAGIC"\ncard %d type %s blocksize %d\n", j->card,
+		j->type, j->block_size);
+	for (r = 0; r < 2; r++) {
+		jr = &j->round[r];
+		if (jr->sha256[0])
+			fprintf(f, "round %d address 0x%08x size %llu blocks %d "
+				"confirmed %d sha256 %s\n", r, jr->address,
+				(unsigned long long)jr->size, jr->blocks,
+				jr->confirmed, jr->sha256);
+	}
+	if (0 != fflush(f) || 0 != fsync(fileno(f)))
+		rc = errno;
+	if (0 != fclose(f) && 0 == rc)
+		rc = errno;
+	if (0 == rc && 0 != rename(tmp, j->path))
+		rc = errno;
+	if (0 != rc)
+		unlink(tmp);
+	return rc;
+}
+
+int journal_remove(const struct flash_journal *j)
+{
+	if (0 != unlink(j->path) && ENOENT != errno)
+		return errno;
+	return 0;
+}
+
+int journal_confirmed(const struct flash_journal *prev,
+			const struct flash_journal *j, int round)
+{
+	const struct journal_round *p = &prev->round[round];
+	const struct journal_round *n = &j->round[round];
+
+	if (prev->card != j->card || strcmp(prev->type, j->type) ||
+	    prev->block_size != j->block_size || p->address != n->address ||
+	    p->size != n->size || p->blocks != n->blocks ||
+	    strcmp(p->sha256, n->sha256) || p->confirmed > p->blocks)
+		return 0;
+	return p->confirmed;
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "capi_flash_metrics.h"
+
+enum { METRICS_OFF, METRICS_JSON, METRICS_JSONL };
+
+static int format = METRICS_OFF;
+static FILE *out;
+static pthread_mutex_t cards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct flash_metrics *cards, **cards_tail = &cards;
+
+static uint64_t metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double wps(unsigned long words, uint64_t ns)
+{
+	return ns ? words * 1e9 / ns : 0.0;
+}
+
+void metrics_json_str(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; s++) {
+		if ('"' == *s || '\\' == *s)
+			fputc('\\', f);
+		if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* One line, written in one go so lines from several cards do not mix */
+static void emit(const char *line)
+{
+	flockfile(out);
+	fputs(line, out);
+	fputc('\n', out);
+	fflush(out);
+	funlockfile(out);
+}
+
+/* format is "json" or "jsonl", path NULL or "-" is stdout */
+int metrics_open(const char *fmt, const char *path)
+{
+	if (0 == strcmp(fmt, "json"))
+		format = METRICS_JSON;
+	else if (0 == strcmp(fmt, "jsonl"))
+		format = METRICS_JSONL;
+	else
+		return EINVAL;
+	if (NULL == path || 0 == strcmp(path, "-")) {
+		out = stdout;
+		return 0;
+	}
+	out = fopen(path, "w");
+	if (NULL == out) {
+		format = METRICS_OFF;
+		return errno;
+	}
+	return 0;
+}
+
+static void metrics_free(struct flash_metrics *m)
+{
+	int i;
+
+	for (i = 0; i < m->nphases; i++) {
+		free(m->phase[i].block);
+		free(m->phase[i].block_ns);
+	}
+	free(m->json);
+	free(m);
+}
+
+/* json: the document with all cards, in the order they started */
+void metrics_close(void)
+{
+	struct flash_metrics *m, *n;
+
+	if (METRICS_OFF == format)
+		return;
+	if (METRICS_JSON == format) {
+		fputs("{\"cards\":[", out);
+		for (m = cards; m; m = m->next)
+			fprintf(out, "%s%s", m->json ? m->json : "{}",
+				m->next ? "," : "");
+		fputs("]}\n", out);
+	}
+	for (m = cards; m; m = n) {
+		n = m->next;
+		metrics_free(m);
+	}
+	cards = NULL;
+	cards_tail = &cards;
+	if (stdout != out)
+		fclose(out);
+	else
+		fflush(out);
+	format = METRICS_OFF;
+}
+
+struct flash_metrics *metrics_card_start(int card, const char *type)
+{
+	struct flash_metrics *m;
+
+	if (METRICS_OFF == format)
+		return NULL;
+	m = calloc(1, sizeof(*m));
+	if (NULL == m)
+		return NULL;
+	m->card = card;
+	m->type = type;
+	pthread_mutex_lock(&cards_lock);
+	*cards_tail = m;
+	cards_tail = &m->next;
+	pthread_mutex_unlock(&cards_lock);
+	return m;
+}
+
+void metrics_phase_start(struct flash_metrics *m, const char *name, int round,
+			unsigned long block_words)
+{
+	struct metrics_phase *p;
+	char *line = NULL;
+
+	if (NULL == m || m->nphases == METRICS_MAX_PHASES)
+		return;
+	p = &m->phase[m->nphases++];
+	p->name = name;
+	p->round = round;
+	p->block_words = block_words;
+	m->t_block = metrics_now();
+	if (METRICS_JSONL == format &&
+	    asprintf(&line, "{\"event\":\"phase_start\",\"card\":%d,"
+		     "\"phase\":\"%s\",\"round\":%d,\"t_ns\":%lu}", m->card,
+		     name, round, (unsigned long)m->t_block) > 0) {
+		emit(line);
+		free(line);
+	}
+}
+
+void metrics_block(struct flash_metrics *m, int block)
+{
+	struct metrics_phase *p;
+	uint64_t now, ns;
+	char *line = NULL;
+	void *b, *t;
+
+	if (NULL == m || 0 == m->nphases)
+		return;
+	p = &m->phase[m->nphases - 1];
+	now = metrics_now();
+	ns = now - m->t_block;
+	m->t_block = now;
+	if (p->nblocks == p->max_blocks) {
+		int max = p->max_blocks ? 2 * p->max_blocks : 256;
+
+		b = realloc(p->block, max * sizeof(*p->block));
+		if (b)
+			p->block = b;
+		t = realloc(p->block_ns, max * sizeof(*p->block_ns));
+		if (t)
+			p->block_ns = t;
+		if (NULL == b || NULL == t)
+			return;
+		p->max_blocks = max;
+	}
+	p->block[p->nblocks] = block;
+	p->block_ns[p->nblocks++] = ns;
+	if (METRICS_JSONL == format &&
+	    asprintf(&line, "{\"event\":\"block\",\"card\":%d,\"phase\":\"%s\","
+		     "\"round\":%d,\"block\":%d,\"ns\":%lu,\"words_per_s\":%.0f}",
+		     m->card, p->name, p->round, block, (unsigned long)ns,
+		     wps(p->block_words, ns)) > 0) {
+		emit(line);
+		free(line);
+	}
+}
+
+static void phase_json(FILE *f, struct metrics_phase *p)
+{
+	int slow[METRICS_SLOWEST];
+	int nslow = 0, i, j;
+	uint64_t min = UINT64_MAX, max = 0, sum = 0;
+
+	fprintf(f, "{\"phase\":\"%s\",\"round\":%d,\"ns\":%lu,\"words\":%lu,"
+		"\"words_per_s\":%.0f,\"syscalls\":%lu", p->name, p->round,
+		(unsigned long)p->ns, p->words, wps(p->words, p->ns),
+		p->syscalls);
+	if (0 == p->nblocks) {
+		fputc('}', f);
+		return;
+	}
+	/* Slowest blocks, insertion into a short sorted list */
+	for (i = 0; i < p->nblocks; i++) {
+		uint64_t ns = p->block_ns[i];
+
+		sum += ns;
+		if (ns < min)
+			min = ns;
+		if (ns > max)
+			max = ns;
+		for (j = nslow; j > 0 && p->block_ns[slow[j - 1]] < ns; j--)
+			if (j < METRICS_SLOWEST)
+				slow[j] = slow[j - 1];
+		if (j < METRICS_SLOWEST) {
+			slow[j] = i;
+			if (nslow < METRICS_SLOWEST)
+				nslow++;
+		}
+	}
+	fprintf(f, ",\"blocks\":{\"count\":%d,\"block_words\":%lu,"
+		"\"min_words_per_s\":%.0f,\"avg_words_per_s\":%.0f,"
+		"\"max_words_per_s\":%.0f,\"words_per_s\":[", p->nblocks,
+		p->block_words, wps(p->block_words, max),
+		wps(p->block_words * p->nblocks, sum), wps(p->block_words, min));
+	for (i = 0; i < p->nblocks; i++)
+		fprintf(f, "%s%.0f", i ? "," : "",
+			wps(p->block_words, p->block_ns[i]));
+	fputs("],\"slowest\":[", f);
+	for (i = 0; i < nslow; i++)
+		fprintf(f, "%s{\"block\":%d,\"ns\":%lu,\"words_per_s\":%.0f}",
+			i ? "," : "", p->block[slow[i]],
+			(unsigned long)p->block_ns[slow[i]],
+			wps(p->block_words, p->block_ns[slow[i]]));
+	fputs("]}}", f);
+}
+
+void metrics_phase_end(struct flash_metrics *m, uint64_t ns,
+			unsigned long words, unsigned long syscalls)
+{
+	struct metrics_phase *p;
+	char *line = NULL;
+	size_t len;
+	FILE *f;
+
+	if (NULL == m || 0 == m->nphases)
+		return;
+	p = &m->phase[m->nphases - 1];
+	p->ns = ns;
+	p->words = words;
+	p->syscalls = syscalls;
+	if (METRICS_JSONL != format)
+		return;
+	f = open_memstream(&line, &len);
+	if (NULL == f)
+		return;
+	fprintf(f, "{\"event\":\"phase_end\",\"card\":%d,\"data\":", m->card);
+	phase_json(f, p);
+	fputc('}', f);
+	fclose(f);
+	emit(line);
+	free(line);
+}
+
+void metrics_card_end(struct flash_metrics *m, int rc, uint64_t ns,
+			const struct metrics_poll *polls, int npolls,
+			unsigned long cfg_syscalls, unsigned long img_syscalls)
+{
+	char *json = NULL;
+	size_t len;
+	FILE *f;
+	int i;
+
+	if (NULL == m)
+		return;
+	m->rc = rc;
+	m->ns = ns;
+	f = open_memstream(&json, &len);
+	if (NULL == f)
+		return;
+	if (METRICS_JSONL == format)
+		fputs("{\"event\":\"card\",", f);
+	else
+		fputc('{', f);
+	fprintf(f, "\"card\":%d,\"type\":", m->card);
+	metrics_json_str(f, m->type);
+	fprintf(f, ",\"rc\":%d,\"ns\":%lu,\"phases\":[", rc,
+		(unsigned long)ns);
+	for (i = 0; i < m->nphases; i++) {
+		if (i)
+			fputc(',', f);
+		phase_json(f, &m->phase[i]);
+	}
+	fputs("],\"polls\":{", f);
+	for (i = 0; i < npolls; i++)
+		fprintf(f, "%s\"%s\":{\"waits\":%lu,\"polls\":%lu,\"sleeps\":%lu,"
+			"\"ns\":%lu,\"max_ns\":%lu}", i ? "," : "",
+			polls[i].name, polls[i].waits, polls[i].polls,
+			polls[i].sleeps, (unsigned long)polls[i].ns,
+			(unsigned long)polls[i].max_ns);
+	fprintf(f, "},\"syscalls\":{\"total\":%lu,\"config\":%lu,\"image\":%lu}}",
+		cfg_syscalls + img_syscalls, cfg_syscalls, img_syscalls);
+	fclose(f);
+	if (METRICS_JSONL == format) {
+		emit(json);
+		free(json);
+	} else {
+		m->json = json;
+	}
+}
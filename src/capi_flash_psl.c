@@ -0,0 +1,95 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "libcapiflash.h"
+
+/*
+ * The psl-devices board table. A copy of the file is built into the
+ * library (capi_flash_psl_table.c, generated by make), so a lookup needs
+ * neither the file nor a parse of it per card. An installed file that
+ * was edited, to flash the factory area for example, still wins.
+ */
+extern const char capi_flash_psl_table[];
+
+static int board_parse(const char *line, int psl_id,
+			struct capi_flash_board *b)
+{
+	unsigned id, addr, addr2;
+	int n;
+
+	if ('#' == line[0])
+		return ENOENT;
+	memset(b, 0, sizeof(*b));
+	n = sscanf(line, "%x %63s %31s %x %d %7s %x", &id, b->board, b->fpga,
+		&addr, &b->block_size_kb, b->type, &addr2);
+	if (n < 3 || (int)id != psl_id)
+		return ENOENT;
+	b->psl_id = psl_id;
+	if (n < 5)
+		b->block_size_kb = 0;
+	else
+		b->address = addr;
+	if (n < 6)
+		snprintf(b->type, sizeof(b->type), "BPIx16");
+	if (n >= 7) {
+		b->address2 = addr2;
+		b->has_address2 = true;
+	}
+	return 0;
+}
+
+static int board_builtin(int psl_id, struct capi_flash_board *b)
+{
+	const char *p = capi_flash_psl_table;
+	char line[256];
+	size_t len;
+
+	while (*p) {
+		len = strcspn(p, "\n");
+		snprintf(line, sizeof(line), "%.*s", (int)len, p);
+		p += p[len] ? len + 1 : len;
+		if (0 == board_parse(line, psl_id, b)) {
+			b->table = "built-in";
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+int capi_flash_board(const char *path, int psl_id,
+			struct capi_flash_board *b)
+{
+	char line[256];
+	FILE *f;
+	int rc = ENOENT;
+
+	if (NULL == path)
+		return board_builtin(psl_id, b);
+	f = fopen(path, "r");
+	if (NULL == f)
+		return ENOENT == errno ? board_builtin(psl_id, b) : errno;
+	while (fgets(line, sizeof(line), f))
+		if (0 == board_parse(line, psl_id, b)) {
+			b->table = path;
+			rc = 0;
+			break;
+		}
+	fclose(f);
+	return rc;
+}
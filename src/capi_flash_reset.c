@@ -0,0 +1,411 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "capi_flash.h"
+
+/*
+ * Card reset, as capi-reset does it: select the image to load on PERST,
+ * write reset, then wait for the card's sysfs directory to go away, to
+ * come back and for the AFU device to show up again.
+ *
+ * The waits sleep on kernel uevents (NETLINK_KOBJECT_UEVENT) instead of
+ * polling, and every wakeup checks the sysfs and /dev paths as well, so
+ * a uevent that is lost or comes before we look does not stall the
+ * reset. Without the netlink socket (not root, no netlink in a
+ * container) the paths are checked every RESET_POLL_MS.
+ *
+ * Several cards are reset together by writing reset to each of them and
+ * then waiting for all of them on the one socket, each card with its own
+ * timeout from its reset write.
+ */
+#define EEH_MAX_FREEZES		"/sys/kernel/debug/powerpc/eeh_max_freezes"
+#define EEH_SAVED		CXL_LOCK_DIR"/eeh_max_freezes"
+#define EEH_USERS		CXL_LOCK_DIR"/eeh_max_freezes.users"
+#define EEH_RESET_FREEZES	"100000"
+#define RESET_POLL_MS		10
+#define RESET_RECHECK_MS	1000	/* Look anyway while waiting on uevents */
+#define UEVENT_BUF		8192
+
+enum { RESET_WAIT_GONE, RESET_WAIT_BACK, RESET_WAIT_AFU, RESET_DONE };
+
+struct reset_wait {
+	int card;
+	int state;
+	bool active;			/* Reset written, not done or timed out */
+	bool afu_added;			/* uevent seen, /dev node may lag */
+	ino_t ino;			/* Card's sysfs directory before reset */
+	char dir[PATH_MAX];
+	char afu[PATH_MAX];
+	uint64_t t0;
+	struct capi_flash_reset_times *t;
+};
+
+static uint64_t reset_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_sysfs(const char *path, const char *val)
+{
+	int fd, rc = 0;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return errno;
+	if (write(fd, val, strlen(val)) < 0)
+		rc = errno;
+	close(fd);
+	return rc;
+}
+
+static int uevent_open(void)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,		/* Kernel events, not udev's */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	if (0 != bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool ends_with(const char *s, const char *tail)
+{
+	size_t n = strlen(s), m = strlen(tail);
+
+	return n >= m && 0 == strcmp(s + n - m, tail);
+}
+
+/*
+ * Reset step a uevent stands for. The message is "action@devpath"
+ * followed by KEY=value strings, all NUL terminated.
+ */
+static int uevent_step(struct reset_wait *w, const char *buf, size_t len)
+{
+	char card[16], afu[32];
+	const char *p, *action = NULL, *devpath = NULL, *devname = NULL;
+
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (0 == strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (0 == strncmp(p, "DEVPATH=", 8))
+			devpath = p + 8;
+		else if (0 == strncmp(p, "DEVNAME=", 8))
+			devname = p + 8;
+	}
+	if (NULL == action)
+		return -1;
+	snprintf(card, sizeof(card), "/card%d", w->card);
+	snprintf(afu, sizeof(afu), "cxl/afu%d.0m", w->card);
+	if (devpath && ends_with(devpath, card)) {
+		if (0 == strcmp(action, "remove"))
+			return RESET_WAIT_BACK;
+		if (0 == strcmp(action, "add"))
+			return RESET_WAIT_AFU;
+	}
+	if (devname && 0 == strcmp(devname, afu) && 0 == strcmp(action, "add"))
+		return RESET_DONE;
+	return -1;
+}
+
+/* Move on to state, noting when each step was seen */
+static void reset_step(struct reset_wait *w, int state)
+{
+	uint64_t ns = reset_now() - w->t0;
+
+	for (; w->state < state; w->state++) {
+		if (RESET_WAIT_GONE == w->state)
+			w->t->gone_ns = ns;
+		else if (RESET_WAIT_BACK == w->state)
+			w->t->back_ns = ns;
+		else
+			w->t->done_ns = ns;
+	}
+}
+
+/* What the paths say, for when a uevent was missed */
+static void reset_check(struct reset_wait *w)
+{
+	struct stat st;
+
+	/* Gone and back already if the directory is a new one */
+	if (RESET_WAIT_GONE == w->state) {
+		if (0 != stat(w->dir, &st))
+			reset_step(w, RESET_WAIT_BACK);
+		else if (st.st_ino != w->ino)
+			reset_step(w, RESET_WAIT_AFU);
+	}
+	if (RESET_WAIT_BACK == w->state && 0 == stat(w->dir, &st))
+		reset_step(w, RESET_WAIT_AFU);
+	if (RESET_WAIT_AFU == w->state && 0 == stat(w->afu, &st))
+		reset_step(w, RESET_DONE);
+}
+
+static void uevent_read(struct reset_wait *w, int n, int fd)
+{
+	char buf[UEVENT_BUF];
+	ssize_t len;
+	int i, step;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		for (i = 0; i < n; i++) {
+			if (!w[i].active)
+				continue;
+			step = uevent_step(&w[i], buf, len);
+			if (step < 0)
+				continue;
+			w[i].t->uevents++;
+			/* The AFU node is there once we can stat() it */
+			if (RESET_DONE == step) {
+				w[i].afu_added = true;
+				step = RESET_WAIT_AFU;
+			}
+			if (step > w[i].state)
+				reset_step(&w[i], step);
+		}
+	}
+}
+
+/* Wait until every card is back or has timed out, rc[] tells which */
+static void reset_wait(struct reset_wait *w, int n, int fd, int timeout_s,
+			int *rc)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint64_t timeout = timeout_s * 1000000000ULL, ns, left;
+	bool fast;
+	int i, ms;
+
+	for (;;) {
+		left = UINT64_MAX;
+		fast = fd < 0;
+		for (i = 0; i < n; i++) {
+			if (!w[i].active)
+				continue;
+			reset_check(&w[i]);
+			ns = reset_now() - w[i].t0;
+			if (RESET_DONE == w[i].state || ns >= timeout) {
+				rc[i] = RESET_DONE == w[i].state ? 0 : ETIMEDOUT;
+				w[i].active = false;
+				continue;
+			}
+			if (timeout - ns < left)
+				left = timeout - ns;
+			fast |= w[i].afu_added;
+		}
+		if (UINT64_MAX == left)
+			return;
+		ms = (left + 999999) / 1000000;
+		if (fast)
+			ms = ms < RESET_POLL_MS ? ms : RESET_POLL_MS;
+		else if (ms > RESET_RECHECK_MS)
+			ms = RESET_RECHECK_MS;
+		if (fd < 0) {
+			usleep(ms * 1000);
+			continue;
+		}
+		if (poll(&pfd, 1, ms) > 0)
+			uevent_read(w, n, fd);
+	}
+}
+
+/*
+ * Resetting too often gets a card fenced, eeh_max_freezes is raised
+ * while we reset. Resets running at the same time, in this process or
+ * in others, must not restore it while another one is still waiting:
+ * the first one saves the value to EEH_SAVED, the last one puts it back.
+ * Each process holds a shared flock() on EEH_USERS while its resets run,
+ * the one which can get an exclusive lock on it is the last. Both are
+ * done holding EEH_SAVED locked, which is only ever held briefly.
+ * A process which died with the budget raised leaves the saved value
+ * behind, the next reset restores that one.
+ */
+static pthread_mutex_t eeh_lock = PTHREAD_MUTEX_INITIALIZER;
+static int eeh_users;
+static int eeh_fd = -1;			/* EEH_USERS, shared lock */
+static char eeh_mem[32];		/* Saved here without EEH_SAVED */
+
+static void eeh_read(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	n = pread(fd, buf, len - 1, 0);
+	buf[n > 0 ? n : 0] = '\0';
+}
+
+static void eeh_raise(void)
+{
+	char saved[32];
+	int efd, sfd = -1;
+
+	pthread_mutex_lock(&eeh_lock);
+	if (eeh_users++)
+		goto __exit;
+	efd = open(EEH_MAX_FREEZES, O_RDWR | O_CLOEXEC);
+	if (efd < 0)
+		goto __exit;		/* Not on PowerNV, no EEH */
+	mkdir(CXL_LOCK_DIR, 0755);
+	sfd = open(EEH_SAVED, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (sfd >= 0)
+		eeh_fd = open(EEH_USERS, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (sfd < 0 || eeh_fd < 0) {
+		eeh_read(efd, eeh_mem, sizeof(eeh_mem));
+		goto __raise;
+	}
+	flock(sfd, LOCK_EX);
+	flock(eeh_fd, LOCK_SH);
+	eeh_read(sfd, saved, sizeof(saved));
+	if ('\0' == saved[0]) {
+		eeh_read(efd, saved, sizeof(saved));
+		if (pwrite(sfd, saved, strlen(saved), 0) < 0)
+			snprintf(eeh_mem, sizeof(eeh_mem), "%s", saved);
+	}
+ __raise:
+	if (pwrite(efd, EEH_RESET_FREEZES, strlen(EEH_RESET_FREEZES), 0) < 0)
+		eeh_mem[0] = '\0';
+	close(efd);
+ __exit:
+	if (sfd >= 0)
+		close(sfd);
+	pthread_mutex_unlock(&eeh_lock);
+}
+
+static int eeh_restore(void)
+{
+	char saved[32] = "";
+	int efd, sfd = -1, rc = 0;
+	bool last = true;
+
+	pthread_mutex_lock(&eeh_lock);
+	if (--eeh_users)
+		goto __exit;
+	if (eeh_fd >= 0) {
+		sfd = open(EEH_SAVED, O_RDWR | O_CLOEXEC);
+		if (sfd >= 0)
+			flock(sfd, LOCK_EX);
+		last = sfd >= 0 && 0 == flock(eeh_fd, LOCK_EX | LOCK_NB);
+		if (last) {
+			eeh_read(sfd, saved, sizeof(saved));
+			if (0 != ftruncate(sfd, 0))
+				rc = errno;
+		}
+	}
+	if (last && '\0' == saved[0])
+		snprintf(saved, sizeof(saved), "%s", eeh_mem);
+	if (saved[0]) {
+		efd = open(EEH_MAX_FREEZES, O_WRONLY | O_CLOEXEC);
+		if (efd < 0 || pwrite(efd, saved, strlen(saved), 0) < 0)
+			rc = EIO;
+		if (efd >= 0)
+			close(efd);
+	}
+	if (eeh_fd >= 0)
+		close(eeh_fd);		/* Before EEH_SAVED is unlocked */
+	eeh_fd = -1;
+	eeh_mem[0] = '\0';
+	if (sfd >= 0)
+		close(sfd);
+ __exit:
+	pthread_mutex_unlock(&eeh_lock);
+	return rc;
+}
+
+int capi_flash_reset_cards(const int *cards, int n, const char *region,
+			int timeout_s, struct capi_flash_reset_times *t, int *rc)
+{
+	struct reset_wait *w;
+	struct stat st;
+	char path[PATH_MAX];
+	int i, fd, err = 0;
+
+	for (i = 0; i < n; i++) {
+		memset(&t[i], 0, sizeof(t[i]));
+		rc[i] = EINVAL;
+	}
+	if (strcmp(region, "user") && strcmp(region, "factory"))
+		return EINVAL;
+	w = calloc(n, sizeof(*w));
+	if (NULL == w)
+		return ENOMEM;
+
+	/* Listen before the resets, their first uevents come quickly */
+	fd = uevent_open();
+	eeh_raise();
+
+	for (i = 0; i < n; i++) {
+		w[i].card = cards[i];
+		w[i].t = &t[i];
+		t[i].polled = fd < 0;
+		snprintf(w[i].dir, sizeof(w[i].dir), CXL_SYSFS_PATH"%d",
+			cards[i]);
+		snprintf(w[i].afu, sizeof(w[i].afu), "/dev/cxl/afu%d.0m",
+			cards[i]);
+		if (0 != stat(w[i].dir, &st)) {
+			rc[i] = ENODEV;
+			continue;
+		}
+		w[i].ino = st.st_ino;
+		snprintf(path, sizeof(path),
+			CXL_SYSFS_PATH"%d/load_image_on_perst", cards[i]);
+		rc[i] = write_sysfs(path, region);
+		snprintf(path, sizeof(path), CXL_SYSFS_PATH"%d/reset",
+			cards[i]);
+		w[i].t0 = reset_now();
+		if (0 == rc[i])
+			rc[i] = write_sysfs(path, "1");
+		w[i].active = 0 == rc[i];
+	}
+	reset_wait(w, n, fd, timeout_s, rc);
+
+	/* Only after the last card is back */
+	err = eeh_restore();
+	if (fd >= 0)
+		close(fd);
+	free(w);
+	for (i = 0; i < n; i++)
+		if (0 != rc[i]) {
+			err = rc[i];
+			break;
+		}
+	return err;
+}
+
+int capi_flash_reset(int card, const char *region, int timeout_s,
+			struct capi_flash_reset_times *t)
+{
+	int rc;
+
+	return capi_flash_reset_cards(&card, 1, region, timeout_s, t, &rc);
+}
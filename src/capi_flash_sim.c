@@ -0,0 +1,477 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Simulated CAPI flash controller behind the CAPI VSEC.
+ *
+ * The model follows what capi-flash expects from the card:
+ *  - CNTL = 0 resets the controller, FLASH_READY is set reset_us later.
+ *  - CNTL = FLASH_PROG_REQ erases SIZE + 1 blocks at ADDR. FLASH_ERASE_STATUS
+ *    is set while erasing, FLASH_PROG_STATUS once the port takes data.
+ *    Every word written to DATA occupies the write port for prog_ns,
+ *    FLASH_PORT_READY (busy) is set while the port fifo holds words. A
+ *    word written to a full fifo is lost. SPI parts need 64 extra flush
+ *    words before FLASH_OP_DONE shows up.
+ *  - CNTL = FLASH_READ_REQ starts a read at ADDR. BPI reads SIZE + 1 words
+ *    and counts down the 10 bit remain field in CNTL as words get loaded
+ *    into DATA. SPI reads serially and flags FLASH_RDATA_VALID instead.
+ *    Reading DATA before the next word is loaded returns the old value.
+ *
+ * weak=N makes flash block N marginal: the first time it is programmed
+ * bit 0 of its words stays erased, once it is erased again it takes the
+ * data. bad=N does so every time.
+ *
+ * Addresses are in words for BPIx16 and in bytes for SPI. The flash array
+ * is a 4 GB sparse mapping of the backing file. It is stored inverted, so
+ * file holes read back as erased (all ones) flash and programming can only
+ * clear bits, like the real parts.
+ */
+
+#define _GNU_SOURCE /* For getsubopt */
+#include <stdbool.h>
+#include "capi_flash.h"
+#include "capi_flash_sim.h"
+
+#define SIM_FLASH_BYTES     (1ULL << 32)
+#define SIM_FLASH_MASK      ((SIM_FLASH_BYTES / 4) - 1)  /* word index */
+#define SIM_VSEC_OFFSET     0x140
+#define SIM_SPI_FLUSH_WORDS 64
+
+enum sim_state {
+	SIM_IDLE = 0,
+	SIM_PROG,
+	SIM_READ,
+};
+
+struct cfg_sim {
+	int fd;
+	uint32_t *flash;		/* inverted flash contents */
+	bool is_spi;
+	uint64_t block_words;
+
+	unsigned erase_us;
+	unsigned prog_ns;
+	unsigned read_ns;
+	unsigned reset_us;
+	unsigned fifo;
+
+	uint32_t space[1024];		/* 4 KB of plain config space */
+	int addr_reg, size_reg, cntl_reg, data_reg;
+
+	uint32_t addr, size;
+	enum sim_state state;
+	uint64_t ready_at;		/* FLASH_READY after reset */
+	uint64_t erase_done_at;
+	uint64_t drain_at;		/* write port fifo empty */
+	uint64_t prog_count, prog_store, prog_expect;
+	uint64_t base;			/* word index of ADDR */
+	uint64_t rd_next;		/* next word to load */
+	uint64_t rd_num;		/* BPI words requested */
+	uint64_t rd_at;			/* next word loaded */
+	uint32_t rdata;
+
+	int64_t weak_block;		/* weak=, -1: none */
+	int64_t bad_block;		/* bad=, -1: none */
+	unsigned weak_progs;
+
+	unsigned long errors;
+};
+
+void *cfg_sim_tab[CFG_SIM_MAX_FD];
+static __thread char sim_err[128];
+
+const char *cfg_sim_error(void)
+{
+	return sim_err;
+}
+
+/* Failed cfg_sim_open(), keeps a message set on the way */
+static int sim_error(int err)
+{
+	if ('\0' == sim_err[0])
+		snprintf(sim_err, sizeof(sim_err), "%s", strerror(err));
+	errno = err;
+	return -1;
+}
+
+static uint64_t sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int sim_parse_opts(struct cfg_sim *s, const char *opts, bool *legacy,
+			uint32_t *subsys)
+{
+	enum { O_ERASE, O_PROG, O_READ, O_RESET, O_FIFO, O_LAYOUT, O_SUBSYS,
+	       O_WEAK, O_BAD };
+	char *const tokens[] = {
+		[O_ERASE]  = "erase_us",
+		[O_PROG]   = "prog_ns",
+		[O_READ]   = "read_ns",
+		[O_RESET]  = "reset_us",
+		[O_FIFO]   = "fifo",
+		[O_LAYOUT] = "layout",
+		[O_SUBSYS] = "subsys",
+		[O_WEAK]   = "weak",
+		[O_BAD]    = "bad",
+		NULL
+	};
+	char *buf, *p, *val;
+	int rc = 0;
+
+	if (NULL == opts)
+		return 0;
+	buf = strdup(opts);
+	if (NULL == buf)
+		return ENOMEM;
+	p = buf;
+	while (*p != '\0' && 0 == rc) {
+		int o = getsubopt(&p, tokens, &val);
+
+		if (o < 0 || (NULL == val && o != O_LAYOUT)) {
+			snprintf(sim_err, sizeof(sim_err), "Bad sim option '%s'",
+				val ? val : "");
+			rc = EINVAL;
+			break;
+		}
+		switch (o) {
+		case O_ERASE:
+			s->erase_us = strtoul(val, NULL, 0);
+			break;
+		case O_PROG:
+			s->prog_ns = strtoul(val, NULL, 0);
+			break;
+		case O_READ:
+			s->read_ns = strtoul(val, NULL, 0);
+			break;
+		case O_RESET:
+			s->reset_us = strtoul(val, NULL, 0);
+			break;
+		case O_FIFO:
+			s->fifo = strtoul(val, NULL, 0);
+			if (0 == s->fifo)
+				s->fifo = 1;
+			break;
+		case O_LAYOUT:
+			*legacy = (NULL != val && 0 == strcmp(val, "legacy"));
+			break;
+		case O_SUBSYS:
+			*subsys = strtoul(val, NULL, 0);
+			break;
+		case O_WEAK:
+			s->weak_block = strtoll(val, NULL, 0);
+			break;
+		case O_BAD:
+			s->bad_block = strtoll(val, NULL, 0);
+			break;
+		}
+	}
+	free(buf);
+	return rc;
+}
+
+/* Static part of config space: PCI ID, subsystem and ext. capability list */
+static void sim_init_space(struct cfg_sim *s, bool legacy, uint32_t subsys)
+{
+	uint32_t vsec_len = legacy ? 0x400 : 0x80;
+
+	s->space[PCI_ID / 4] = ((legacy ? CAPI_LEGACY0 : CAPI_PCIID) << 16) |
+		IBM_PCIID;
+	s->space[SUB_DEV_ID / 4] = (subsys << 16) | IBM_PCIID;
+	/* An AER capability first, so the VSEC walk has to follow next */
+	s->space[PCI_ECAP / 4] = (SIM_VSEC_OFFSET << 20) | (1 << 16) | 0x0001;
+	s->space[SIM_VSEC_OFFSET / 4] = (0 << 20) | (1 << 16) | ECAP_VSEC;
+	s->space[SIM_VSEC_OFFSET / 4 + 1] = (vsec_len << 20) | (1 << 16) |
+		CAPI_VSECID;
+
+	if (legacy) {
+		s->addr_reg = 0x920;
+		s->size_reg = 0x924;
+		s->cntl_reg = 0x928;
+		s->data_reg = 0x92c;
+	} else {
+		s->addr_reg = SIM_VSEC_OFFSET + FLASH_ADDR_OFFSET;
+		s->size_reg = SIM_VSEC_OFFSET + FLASH_SIZE_OFFSET;
+		s->cntl_reg = SIM_VSEC_OFFSET + FLASH_CNTL_OFFSET;
+		s->data_reg = SIM_VSEC_OFFSET + FLASH_DATA_OFFSET;
+	}
+}
+
+int cfg_sim_open(const char *path, const char *opts, bool is_spi,
+		int block_size_kb)
+{
+	struct cfg_sim *s;
+	struct stat st;
+	bool legacy = false;
+	uint32_t subsys = 0x0605;
+	int fd, err;
+
+	sim_err[0] = '\0';
+	s = calloc(1, sizeof(*s));
+	if (NULL == s)
+		return sim_error(ENOMEM);
+	s->erase_us = CFG_SIM_ERASE_US;
+	s->prog_ns = CFG_SIM_PROG_NS;
+	s->read_ns = CFG_SIM_READ_NS;
+	s->reset_us = CFG_SIM_RESET_US;
+	s->fifo = CFG_SIM_FIFO_DEPTH;
+	s->is_spi = is_spi;
+	s->block_words = (uint64_t)block_size_kb * 1024 / 4;
+	s->weak_block = -1;
+	s->bad_block = -1;
+	err = sim_parse_opts(s, opts, &legacy, &subsys);
+	if (0 != err)
+		goto err_free;
+	sim_init_space(s, legacy, subsys);
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		err = errno;
+		goto err_free;
+	}
+	if (fd >= CFG_SIM_MAX_FD) {
+		errno = EMFILE;
+		goto err_close;
+	}
+	if (0 != fstat(fd, &st))
+		goto err_close;
+	if ((uint64_t)st.st_size < SIM_FLASH_BYTES &&
+	    0 != ftruncate(fd, SIM_FLASH_BYTES))
+		goto err_close;
+	s->flash = mmap(NULL, SIM_FLASH_BYTES, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, fd, 0);
+	if (MAP_FAILED == s->flash)
+		goto err_close;
+
+	s->fd = fd;
+	cfg_sim_tab[fd] = s;
+	return fd;
+
+ err_close:
+	err = errno;
+	close(fd);
+ err_free:
+	free(s);
+	return sim_error(err);
+}
+
+unsigned long cfg_sim_errors(int fd)
+{
+	return cfg_sim_active(fd) ?
+		((struct cfg_sim *)cfg_sim_tab[fd])->errors : 0;
+}
+
+void cfg_sim_close(int fd)
+{
+	struct cfg_sim *s;
+
+	if (!cfg_sim_active(fd))
+		return;
+	s = cfg_sim_tab[fd];
+	cfg_sim_tab[fd] = NULL;
+	munmap(s->flash, SIM_FLASH_BYTES);
+	close(fd);
+	free(s);
+}
+
+static uint64_t sim_word_index(struct cfg_sim *s, uint32_t addr)
+{
+	return (s->is_spi ? (uint64_t)addr >> 2 : addr) & SIM_FLASH_MASK;
+}
+
+/* Words sitting in the write port that have not been programmed yet */
+static uint64_t sim_fifo_fill(struct cfg_sim *s, uint64_t now)
+{
+	if (s->drain_at <= now || 0 == s->prog_ns)
+		return 0;
+	return (s->drain_at - now + s->prog_ns - 1) / s->prog_ns;
+}
+
+static void sim_load(struct cfg_sim *s, uint64_t now)
+{
+	if (SIM_READ != s->state || now < s->rd_at)
+		return;
+	if (!s->is_spi && s->rd_next >= s->rd_num)
+		return;
+	s->rdata = ~s->flash[(s->base + s->rd_next) & SIM_FLASH_MASK];
+	s->rd_next++;
+	s->rd_at = UINT64_MAX;		/* loaded, wait for DATA read */
+}
+
+static uint32_t sim_cntl(struct cfg_sim *s, uint64_t now)
+{
+	uint32_t v = 0;
+
+	if (now >= s->ready_at)
+		v |= FLASH_READY;
+	switch (s->state) {
+	case SIM_PROG:
+		if (now < s->erase_done_at) {
+			v |= FLASH_ERASE_STATUS | FLASH_PORT_READY;
+			break;
+		}
+		v |= FLASH_PROG_STATUS;
+		if (sim_fifo_fill(s, now) > 0)
+			v |= FLASH_PORT_READY;
+		if (s->prog_count >= s->prog_expect && now >= s->drain_at)
+			v |= FLASH_OP_DONE;
+		break;
+	case SIM_READ:
+		sim_load(s, now);
+		v |= FLASH_READ_STATUS;
+		if (s->is_spi) {
+			if (UINT64_MAX == s->rd_at)
+				v |= FLASH_RDATA_VALID;
+		} else {
+			/* Remaining words, counting the one not yet loaded */
+			uint64_t left = s->rd_num - s->rd_next;
+
+			if (UINT64_MAX == s->rd_at)
+				left--;
+			v |= (left & 0x3ff);
+		}
+		break;
+	default:
+		break;
+	}
+	return v;
+}
+
+static void sim_erase(struct cfg_sim *s, uint64_t now)
+{
+	uint64_t blocks = (uint64_t)s->size + 1;
+	uint64_t words = blocks * s->block_words;
+
+	s->base = sim_word_index(s, s->addr);
+	if (s->base + words > SIM_FLASH_MASK + 1)
+		words = SIM_FLASH_MASK + 1 - s->base;
+	memset(&s->flash[s->base], 0, words * 4);
+	s->state = SIM_PROG;
+	s->erase_done_at = now + blocks * s->erase_us * 1000ULL;
+	s->drain_at = s->erase_done_at;
+	s->prog_count = 0;
+	s->prog_store = blocks * s->block_words;
+	s->prog_expect = s->prog_store + (s->is_spi ? SIM_SPI_FLUSH_WORDS : 0);
+}
+
+static void sim_read_req(struct cfg_sim *s, uint64_t now)
+{
+	s->base = sim_word_index(s, s->addr);
+	s->state = SIM_READ;
+	s->rd_next = 0;
+	s->rd_num = (uint64_t)(s->size & 0x3ff) + 1;
+	s->rd_at = now + s->read_ns;
+}
+
+/* weak= and bad=: the word at index w does not take bit 0 */
+static bool sim_weak_word(struct cfg_sim *s, uint64_t w)
+{
+	int64_t b = w / s->block_words;
+
+	if (b == s->bad_block)
+		return true;
+	if (b != s->weak_block)
+		return false;
+	if (0 == w % s->block_words)
+		s->weak_progs++;
+	return s->weak_progs <= 1;
+}
+
+static void sim_data_write(struct cfg_sim *s, uint32_t val, uint64_t now)
+{
+	uint64_t w;
+
+	if (SIM_PROG != s->state || now < s->erase_done_at ||
+	    sim_fifo_fill(s, now) >= s->fifo) {
+		s->errors++;		/* word is lost, like on the card */
+		return;
+	}
+	if (s->prog_count < s->prog_store) {
+		w = (s->base + s->prog_count) & SIM_FLASH_MASK;
+		if (sim_weak_word(s, w))
+			val |= 1;
+		s->flash[w] |= ~val;
+	}
+	s->prog_count++;
+	s->drain_at = (s->drain_at > now ? s->drain_at : now) + s->prog_ns;
+}
+
+static uint32_t sim_data_read(struct cfg_sim *s, uint64_t now)
+{
+	sim_load(s, now);
+	/* BPI keeps the last word and remain 0x3ff until the next request */
+	if (SIM_READ == s->state && UINT64_MAX == s->rd_at &&
+	    (s->is_spi || s->rd_next < s->rd_num))
+		s->rd_at = now + s->read_ns;	/* consume, fetch next */
+	return s->rdata;
+}
+
+int cfg_sim_read(int fd, int offset, int *val)
+{
+	struct cfg_sim *s = cfg_sim_tab[fd];
+	uint64_t now;
+
+	if (offset < 0 || offset > (int)sizeof(s->space) - 4 || (offset & 3)) {
+		errno = EINVAL;
+		return -1;
+	}
+	now = sim_now();
+	if (offset == s->addr_reg)
+		*val = s->addr;
+	else if (offset == s->size_reg)
+		*val = s->size;
+	else if (offset == s->cntl_reg)
+		*val = sim_cntl(s, now);
+	else if (offset == s->data_reg)
+		*val = sim_data_read(s, now);
+	else
+		*val = s->space[offset / 4];
+	return 4;
+}
+
+int cfg_sim_write(int fd, int offset, int val)
+{
+	struct cfg_sim *s = cfg_sim_tab[fd];
+	uint64_t now;
+
+	if (offset < 0 || offset > (int)sizeof(s->space) - 4 || (offset & 3)) {
+		errno = EINVAL;
+		return -1;
+	}
+	now = sim_now();
+	if (offset == s->addr_reg) {
+		s->addr = val;
+	} else if (offset == s->size_reg) {
+		s->size = val;
+	} else if (offset == s->cntl_reg) {
+		if (0 == val) {
+			s->state = SIM_IDLE;
+			s->ready_at = now + s->reset_us * 1000ULL;
+		} else if (val & FLASH_PROG_REQ) {
+			sim_erase(s, now);
+		} else if (val & FLASH_READ_REQ) {
+			sim_read_req(s, now);
+		}
+	} else if (offset == s->data_reg) {
+		sim_data_write(s, val, now);
+	} else {
+		s->space[offset / 4] = val;
+	}
+	return 4;
+}
@@ -0,0 +1,485 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "capi_flash_trace.h"
+
+#define CHUNK_HDR	16
+#define REC_MAX		32	/* tag, two varint times, register, value */
+
+struct trace_buf {
+	struct trace_buf *next;
+	uint32_t len;			/* Record bytes after the header */
+	uint8_t data[CHUNK_HDR + TRACE_BUF_SIZE];
+};
+
+/* A thread's records, in its own buffer */
+struct trace_stream {
+	int id;
+	struct trace_buf *buf;
+	uint64_t t;			/* Start of its last record */
+	uint32_t val[TRACE_REGS];
+	uint32_t gen[TRACE_REGS];	/* val[] is of chunk gen */
+	uint32_t chunk_gen;
+};
+
+bool trace_active = false;
+
+static struct {
+	int fd;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t full_cond;	/* Writer: buffers to write, or stop */
+	pthread_cond_t free_cond;	/* Streams: a buffer is free again */
+	struct trace_buf *full, **full_tail;
+	struct trace_buf *free;
+	int nbufs;
+	bool stop;
+	int err;
+	uint64_t t0;
+	unsigned gen;			/* Of the open trace, streams of
+					   an earlier one are gone */
+	struct trace_stream *streams[TRACE_MAX_STREAMS];
+	int nstreams;
+	int dropped;			/* Threads past TRACE_MAX_STREAMS */
+} tr = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.full_cond = PTHREAD_COND_INITIALIZER,
+	.free_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct trace_stream *stream;
+static __thread unsigned stream_gen;	/* stream is of trace tr.gen */
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			return n < 0 ? errno : EIO;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *trace_writer(void *arg)
+{
+	struct trace_buf *list, *b;
+	int rc;
+
+	(void)arg;
+	pthread_mutex_lock(&tr.lock);
+	while (1) {
+		while (NULL == tr.full && !tr.stop)
+			pthread_cond_wait(&tr.full_cond, &tr.lock);
+		if (NULL == tr.full)
+			break;
+		list = tr.full;
+		tr.full = NULL;
+		tr.full_tail = &tr.full;
+		pthread_mutex_unlock(&tr.lock);
+		for (b = list; b; b = b->next) {
+			rc = write_all(tr.fd, b->data, CHUNK_HDR + b->len);
+			if (0 != rc && 0 == tr.err)
+				tr.err = rc;
+		}
+		pthread_mutex_lock(&tr.lock);
+		while (list) {
+			b = list;
+			list = b->next;
+			b->next = tr.free;
+			tr.free = b;
+		}
+		pthread_cond_broadcast(&tr.free_cond);
+	}
+	pthread_mutex_unlock(&tr.lock);
+	return NULL;
+}
+
+int trace_open(const char *path)
+{
+	uint8_t hdr[16];
+	uint32_t v = TRACE_VERSION;
+	int rc;
+
+	tr.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (tr.fd < 0)
+		return errno;
+	memcpy(hdr, TRACE_MAGIC, 8);
+	memcpy(hdr + 8, &v, 4);
+	memset(hdr + 12, 0, 4);
+	rc = write_all(tr.fd, hdr, sizeof(hdr));
+	if (0 == rc)
+		rc = pthread_create(&tr.writer, NULL, trace_writer, NULL);
+	if (0 != rc) {
+		close(tr.fd);
+		tr.fd = -1;
+		return rc;
+	}
+	tr.full_tail = &tr.full;
+	tr.t0 = trace_now();
+	tr.gen++;
+	trace_active = true;
+	return 0;
+}
+
+/* Queue the stream's buffer for the writer, under tr.lock */
+static void stream_submit(struct trace_stream *s)
+{
+	struct trace_buf *b = s->buf;
+	uint32_t len = b->len;
+	uint16_t id = s->id;
+
+	memcpy(b->data, &len, 4);
+	memcpy(b->data + 4, &id, 2);
+	b->next = NULL;
+	*tr.full_tail = b;
+	tr.full_tail = &b->next;
+	s->buf = NULL;
+	pthread_cond_signal(&tr.full_cond);
+}
+
+/* Room for need more bytes: hand a full buffer over, start a chunk */
+static bool stream_room(struct trace_stream *s, uint32_t need)
+{
+	struct trace_buf *b;
+
+	if (s->buf && s->buf->len + need <= TRACE_BUF_SIZE)
+		return true;
+	pthread_mutex_lock(&tr.lock);
+	if (s->buf)
+		stream_submit(s);
+	while (NULL == tr.free && tr.nbufs >= TRACE_MAX_BUFS)
+		pthread_cond_wait(&tr.free_cond, &tr.lock);
+	b = tr.free;
+	if (b)
+		tr.free = b->next;
+	else if ((b = malloc(sizeof(*b))))
+		tr.nbufs++;
+	pthread_mutex_unlock(&tr.lock);
+	if (NULL == b)
+		return false;
+	b->len = 0;
+	memset(b->data + 6, 0, 2);
+	memcpy(b->data + 8, &s->t, 8);
+	s->buf = b;
+	s->chunk_gen++;
+	return true;
+}
+
+/*
+ * The thread's stream. One left over from an earlier trace was freed by
+ * trace_close(), the generation tells. A thread which got none, past
+ * TRACE_MAX_STREAMS, is counted once and noted on close.
+ */
+static struct trace_stream *stream_get(void)
+{
+	struct trace_stream *s = NULL;
+
+	if (stream_gen == tr.gen)
+		return stream;
+	pthread_mutex_lock(&tr.lock);
+	if (tr.nstreams < TRACE_MAX_STREAMS &&
+	    (s = calloc(1, sizeof(*s)))) {
+		s->id = tr.nstreams;
+		s->t = trace_now() - tr.t0;
+		tr.streams[tr.nstreams++] = s;
+	} else {
+		tr.dropped++;
+	}
+	pthread_mutex_unlock(&tr.lock);
+	stream = s;
+	stream_gen = tr.gen;
+	return s;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* dt since the stream's last record, which this one becomes */
+static uint8_t *put_time(struct trace_stream *s, uint8_t *p, uint64_t t)
+{
+	uint64_t rel = t > tr.t0 ? t - tr.t0 : 0;
+
+	p = put_varint(p, rel > s->t ? rel - s->t : 0);
+	if (rel > s->t)
+		s->t = rel;
+	return p;
+}
+
+void trace_access(int offset, const int *vals, int n, bool write, bool ok,
+			uint64_t t0, uint64_t t1)
+{
+	struct trace_stream *s = stream_get();
+	uint32_t reg, v;
+	uint8_t *p, *tag;
+	int i;
+
+	if (NULL == s || !stream_room(s, n * REC_MAX))
+		return;
+	p = s->buf->data + CHUNK_HDR + s->buf->len;
+	for (i = 0; i < n; i++) {
+		reg = (offset / 4 + i) % TRACE_REGS;
+		v = ok ? (uint32_t)vals[i] : 0;
+		tag = p++;
+		*tag = (write ? TRACE_WRITE : 0) | (ok ? 0 : TRACE_ERROR);
+		if (i) {
+			*tag |= TRACE_CONT;
+		} else {
+			p = put_time(s, p, t0);
+			p = put_varint(p, t1 > t0 ? t1 - t0 : 0);
+		}
+		p = put_varint(p, reg);
+		if (s->gen[reg] == s->chunk_gen && s->val[reg] == v) {
+			*tag |= TRACE_SAME;
+		} else {
+			memcpy(p, &v, 4);
+			p += 4;
+			s->val[reg] = v;
+			s->gen[reg] = s->chunk_gen;
+		}
+	}
+	s->buf->len = p - (s->buf->data + CHUNK_HDR);
+}
+
+void trace_note(const char *fmt, ...)
+{
+	struct trace_stream *s;
+	char text[256];
+	va_list ap;
+	uint8_t *p;
+	int len;
+
+	if (!trace_active)
+		return;
+	va_start(ap, fmt);
+	len = vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(text) - 1)
+		len = sizeof(text) - 1;
+	s = stream_get();
+	if (NULL == s || !stream_room(s, REC_MAX + len))
+		return;
+	p = s->buf->data + CHUNK_HDR + s->buf->len;
+	*p++ = TRACE_NOTE;
+	p = put_time(s, p, trace_now());
+	p = put_varint(p, len);
+	memcpy(p, text, len);
+	p += len;
+	s->buf->len = p - (s->buf->data + CHUNK_HDR);
+}
+
+int trace_close(void)
+{
+	struct trace_buf *b;
+	int i, rc;
+
+	if (!trace_active)
+		return 0;
+	if (tr.dropped) {
+		/* Stream 0's thread is done, the note goes there */
+		stream = tr.streams[0];
+		stream_gen = tr.gen;
+		trace_note("%d threads not traced, only %d streams",
+			tr.dropped, TRACE_MAX_STREAMS);
+	}
+	trace_active = false;
+	pthread_mutex_lock(&tr.lock);
+	for (i = 0; i < tr.nstreams; i++)
+		if (tr.streams[i]->buf)
+			stream_submit(tr.streams[i]);
+	tr.stop = true;
+	pthread_cond_signal(&tr.full_cond);
+	pthread_mutex_unlock(&tr.lock);
+	pthread_join(tr.writer, NULL);
+
+	rc = tr.err;
+	if (0 != close(tr.fd) && 0 == rc)
+		rc = errno;
+	tr.fd = -1;
+	while ((b = tr.free)) {
+		tr.free = b->next;
+		free(b);
+	}
+	for (i = 0; i < tr.nstreams; i++)
+		free(tr.streams[i]);
+	tr.nstreams = 0;
+	tr.dropped = 0;
+	tr.nbufs = 0;
+	tr.stop = false;
+	tr.err = 0;
+	return rc;
+}
+
+int trace_reader_open(struct trace_reader *r, const char *path)
+{
+	uint8_t hdr[16];
+	uint32_t v;
+
+	memset(r, 0, sizeof(*r));
+	r->f = fopen(path, "r");
+	if (NULL == r->f)
+		return errno;
+	if (1 != fread(hdr, sizeof(hdr), 1, r->f) ||
+	    memcmp(hdr, TRACE_MAGIC, 8)) {
+		fclose(r->f);
+		r->f = NULL;
+		return EINVAL;
+	}
+	memcpy(&v, hdr + 8, 4);
+	if (TRACE_VERSION != v) {
+		fclose(r->f);
+		r->f = NULL;
+		return EINVAL;
+	}
+	return 0;
+}
+
+static int get_varint(struct trace_reader *r, uint64_t *v)
+{
+	int shift = 0;
+	uint8_t b;
+
+	*v = 0;
+	do {
+		if (r->pos >= r->len || shift > 63)
+			return -EINVAL;
+		b = r->chunk[r->pos++];
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return 0;
+}
+
+/* Next chunk into r->chunk: 1, or 0 at the end of the file */
+static int reader_chunk(struct trace_reader *r)
+{
+	uint8_t hdr[CHUNK_HDR];
+	uint16_t id;
+	void *p;
+
+	if (1 != fread(hdr, sizeof(hdr), 1, r->f))
+		return 0;
+	memcpy(&r->len, hdr, 4);
+	memcpy(&id, hdr + 4, 2);
+	memcpy(&r->t, hdr + 8, 8);
+	if (r->len > TRACE_BUF_SIZE)
+		return -EINVAL;
+	p = realloc(r->chunk, r->len ? r->len : 1);
+	if (NULL == p)
+		return -ENOMEM;
+	r->chunk = p;
+	if (r->len && 1 != fread(r->chunk, r->len, 1, r->f))
+		return -EINVAL;
+	r->stream = id;
+	r->pos = 0;
+	r->dur = 0;
+	r->chunk_gen++;
+	r->chunks++;
+	return 1;
+}
+
+int trace_reader_next(struct trace_reader *r, struct trace_rec *rec)
+{
+	uint64_t dt, reg, len;
+	int rc;
+
+	while (r->pos >= r->len) {
+		rc = reader_chunk(r);
+		if (rc <= 0)
+			return rc;
+	}
+	rec->tag = r->chunk[r->pos++];
+	rec->stream = r->stream;
+	rec->note[0] = '\0';
+	if (rec->tag & TRACE_NOTE) {
+		if (get_varint(r, &dt) || get_varint(r, &len) ||
+		    len >= sizeof(rec->note) || r->pos + len > r->len)
+			return -EINVAL;
+		r->t += dt;
+		memcpy(rec->note, r->chunk + r->pos, len);
+		rec->note[len] = '\0';
+		r->pos += len;
+		rec->t_ns = r->t;
+		rec->dur_ns = 0;
+		rec->offset = -1;
+		rec->value = 0;
+		return 1;
+	}
+	if (!(rec->tag & TRACE_CONT)) {
+		if (get_varint(r, &dt) || get_varint(r, &r->dur))
+			return -EINVAL;
+		r->t += dt;
+	}
+	if (get_varint(r, &reg) || reg >= TRACE_REGS)
+		return -EINVAL;
+	if (rec->tag & TRACE_SAME) {
+		if (r->gen[reg] != r->chunk_gen)
+			return -EINVAL;
+	} else {
+		if (r->pos + 4 > r->len)
+			return -EINVAL;
+		memcpy(&r->val[reg], r->chunk + r->pos, 4);
+		r->gen[reg] = r->chunk_gen;
+		r->pos += 4;
+	}
+	rec->t_ns = r->t;
+	rec->dur_ns = r->dur;
+	rec->offset = reg * 4;
+	rec->value = r->val[reg];
+	return 1;
+}
+
+void trace_reader_close(struct trace_reader *r)
+{
+	if (r->f)
+		fclose(r->f);
+	free(r->chunk);
+	r->f = NULL;
+	r->chunk = NULL;
+}
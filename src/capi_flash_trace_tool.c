@@ -0,0 +1,594 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * capi-flash-trace: looks at a capi-flash --trace file.
+ *
+ *   analyse  where the time went: accesses and time per register, the
+ *            gaps between syscalls, status polls and the longest gaps
+ *   replay   runs a stream's accesses again against a simulated card,
+ *            as fast as it can or with the recorded gaps (--timed), and
+ *            checks the flash data read back against the recording
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include "capi_flash.h"
+#include "capi_flash_cfg.h"
+#include "capi_flash_sim.h"
+#include "capi_flash_trace.h"
+
+#define TOP_GAPS		10
+#define GAP_BUCKETS		24	/* log2 us, the last one takes the rest */
+#define POLL_MIN		3	/* Reads of one register to be a poll */
+#define REPLAY_MAX_REGS		16	/* Registers per syscall */
+#define REPLAY_SPIN_NS		100000	/* Shorter gaps are not slept */
+
+static const char *version = GIT_VERSION;
+static bool quiet = false;
+static int verbose = 0;
+
+#define dprintf(fmt, ...) do { \
+	if (!quiet) \
+		printf( fmt, ## __VA_ARGS__); \
+	} while (0)
+
+#define eprintf(fmt, ...) do { \
+		fprintf(stderr, "Error: "fmt, ## __VA_ARGS__); \
+	} while (0)
+
+#define vprintf(fmt, ...) do { \
+	if (verbose > 0) \
+		printf( fmt, ## __VA_ARGS__); \
+	} while (0)
+
+struct stream_stat {
+	bool seen;
+	unsigned long records;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long errors;
+	unsigned long syscalls;
+	uint64_t t_first;
+	uint64_t t_end;			/* End of the last syscall */
+	uint64_t busy_ns;		/* In syscalls */
+	/* Poll being run */
+	int poll_reg;
+	unsigned long poll_len;
+	uint64_t poll_t0;
+};
+
+struct reg_stat {
+	unsigned long reads;
+	unsigned long writes;
+	uint64_t ns;
+	unsigned long polls;
+	unsigned long poll_reads;
+	uint64_t poll_ns;
+	uint64_t poll_max_ns;
+};
+
+struct gap {
+	uint64_t ns;
+	uint64_t t;
+	int stream;
+	int prev_offset;
+	int offset;
+};
+
+static void help(const char *prog)
+{
+	printf("Usage: %s [options] analyse FILE\n"
+		"       %s [options] replay FILE -S SIM\n"
+		"	  -v, --verbose    Print the records, or the replayed accesses\n"
+		"	  -q, --quiet      Only the summary\n"
+		"	  -V, --version    Print version\n"
+		"	  -h, --help       This help\n"
+		"	replay:\n"
+		"	  -S, --sim        Simulated card backing file to replay against\n"
+		"	  -O, --sim-opts   Simulator options, see capi-flash\n"
+		"	  -s, --stream     Stream (a card's thread) to replay (default: 0)\n"
+		"	  -t, --type       Flash type if the trace does not have it\n"
+		"	  -b, --blocksize  Block size in KB if the trace does not have it\n"
+		"	  -T, --timed      Keep the recorded gaps between the accesses\n\n",
+		prog, prog);
+}
+
+static const char *access_name(const struct trace_rec *rec)
+{
+	if (rec->tag & TRACE_NOTE)
+		return "note";
+	return rec->tag & TRACE_WRITE ? "write" : "read";
+}
+
+static void print_rec(const struct trace_rec *rec)
+{
+	if (rec->tag & TRACE_NOTE) {
+		printf("%2d %12.6f note  %s\n", rec->stream, rec->t_ns / 1e9,
+			rec->note);
+		return;
+	}
+	printf("%2d %12.6f %-5s 0x%03x 0x%08x %8.3f us%s%s\n", rec->stream,
+		rec->t_ns / 1e9, access_name(rec), rec->offset, rec->value,
+		rec->dur_ns / 1e3, rec->tag & TRACE_CONT ? " cont" : "",
+		rec->tag & TRACE_ERROR ? " FAILED" : "");
+}
+
+static void poll_end(struct stream_stat *s, struct reg_stat *regs)
+{
+	struct reg_stat *r;
+	uint64_t ns;
+
+	if (s->poll_reg >= 0 && s->poll_len >= POLL_MIN) {
+		r = &regs[s->poll_reg];
+		ns = s->t_end - s->poll_t0;
+		r->polls++;
+		r->poll_reads += s->poll_len;
+		r->poll_ns += ns;
+		if (ns > r->poll_max_ns)
+			r->poll_max_ns = ns;
+	}
+	s->poll_len = 0;
+}
+
+static void gap_add(struct gap *top, const struct gap *g)
+{
+	int i;
+
+	for (i = TOP_GAPS - 1; i >= 0 && g->ns > top[i].ns; i--)
+		if (i < TOP_GAPS - 1)
+			top[i + 1] = top[i];
+	if (++i < TOP_GAPS)
+		top[i] = *g;
+}
+
+static int analyse(const char *file)
+{
+	static struct stream_stat streams[TRACE_MAX_STREAMS];
+	static struct reg_stat regs[TRACE_REGS];
+	static int last_offset[TRACE_MAX_STREAMS];
+	unsigned long hist[GAP_BUCKETS + 1] = { 0 };
+	struct gap top[TOP_GAPS], g;
+	struct trace_reader r;
+	struct trace_rec rec;
+	struct stream_stat *s;
+	unsigned long notes = 0, records = 0, syscalls = 0;
+	uint64_t gap, us;
+	int i, b, reg, rc;
+
+	rc = trace_reader_open(&r, file);
+	if (0 != rc) {
+		eprintf("%s: %s\n", file, EINVAL == rc ? "Not a capi-flash trace" :
+			strerror(rc));
+		return rc;
+	}
+	memset(top, 0, sizeof(top));
+	if (!quiet)
+		printf("Notes:\n");
+	while (1 == (rc = trace_reader_next(&r, &rec))) {
+		if (rec.stream >= TRACE_MAX_STREAMS)
+			continue;
+		if (verbose)
+			print_rec(&rec);
+		s = &streams[rec.stream];
+		if (!s->seen) {
+			s->seen = true;
+			s->t_first = rec.t_ns;
+			s->t_end = rec.t_ns;
+			s->poll_reg = -1;
+		}
+		if (rec.tag & TRACE_NOTE) {
+			notes++;
+			if (!quiet && !verbose)
+				printf("  %2d %12.6f %s\n", rec.stream,
+					rec.t_ns / 1e9, rec.note);
+			continue;
+		}
+		records++;
+		s->records++;
+		reg = rec.offset / 4;
+		if (rec.tag & TRACE_WRITE) {
+			s->writes++;
+			regs[reg].writes++;
+		} else {
+			s->reads++;
+			regs[reg].reads++;
+		}
+		if (rec.tag & TRACE_CONT) {
+			/* Part of the syscall before, no poll */
+			poll_end(s, regs);
+			s->poll_reg = -1;
+			continue;
+		}
+
+		/* A syscall: the gap since the stream's one before */
+		syscalls++;
+		s->syscalls++;
+		if (rec.tag & TRACE_ERROR)
+			s->errors++;
+		gap = rec.t_ns > s->t_end ? rec.t_ns - s->t_end : 0;
+		if (s->syscalls > 1) {
+			us = gap / 1000;
+			for (b = 0; us && b < GAP_BUCKETS; b++)
+				us >>= 1;
+			hist[b]++;
+			g.ns = gap;
+			g.t = rec.t_ns;
+			g.stream = rec.stream;
+			g.prev_offset = last_offset[rec.stream];
+			g.offset = rec.offset;
+			gap_add(top, &g);
+		}
+		last_offset[rec.stream] = rec.offset;
+
+		/* Reads of one register in a row are polls */
+		if (!(rec.tag & TRACE_WRITE) && reg == s->poll_reg) {
+			s->poll_len++;
+		} else {
+			poll_end(s, regs);
+			s->poll_reg = rec.tag & TRACE_WRITE ? -1 : reg;
+			s->poll_len = 1;
+			s->poll_t0 = rec.t_ns;
+		}
+		regs[reg].ns += rec.dur_ns;
+		s->busy_ns += rec.dur_ns;
+		s->t_end = rec.t_ns + rec.dur_ns;
+	}
+	trace_reader_close(&r);
+	if (rc < 0) {
+		eprintf("%s: Damaged trace, summary is up to there\n", file);
+		rc = -rc;
+	}
+	for (i = 0; i < TRACE_MAX_STREAMS; i++)
+		if (streams[i].seen)
+			poll_end(&streams[i], regs);
+
+	printf("%lu accesses in %lu syscalls, %lu notes\n", records, syscalls,
+		notes);
+	printf("Streams:\n");
+	printf("  %2s %10s %10s %10s %6s %10s %10s\n", "id", "reads",
+		"writes", "syscalls", "errors", "elapsed", "in syscall");
+	for (i = 0; i < TRACE_MAX_STREAMS; i++) {
+		s = &streams[i];
+		if (!s->seen)
+			continue;
+		printf("  %2d %10lu %10lu %10lu %6lu %9.3fs %9.3fs\n", i,
+			s->reads, s->writes, s->syscalls, s->errors,
+			(s->t_end - s->t_first) / 1e9, s->busy_ns / 1e9);
+	}
+
+	printf("Registers:\n");
+	printf("  %5s %10s %10s %10s %8s %10s %10s %10s\n", "reg", "reads",
+		"writes", "in syscall", "polls", "poll reads", "polling",
+		"longest");
+	for (i = 0; i < TRACE_REGS; i++) {
+		if (0 == regs[i].reads && 0 == regs[i].writes)
+			continue;
+		printf("  0x%03x %10lu %10lu %9.3fs %8lu %10lu %9.3fs %8.3fms\n",
+			i * 4, regs[i].reads, regs[i].writes, regs[i].ns / 1e9,
+			regs[i].polls, regs[i].poll_reads, regs[i].poll_ns / 1e9,
+			regs[i].poll_max_ns / 1e6);
+	}
+
+	printf("Gaps between syscalls:\n");
+	for (b = 0; b <= GAP_BUCKETS; b++) {
+		if (0 == hist[b])
+			continue;
+		if (0 == b)
+			printf("  %10s %-8s %10lu\n", "", "< 1 us", hist[b]);
+		else if (GAP_BUCKETS == b)
+			printf("  %7lu us %-8s %10lu\n", 1UL << (b - 1), "and up",
+				hist[b]);
+		else
+			printf("  %7lu us %-8s %10lu\n", 1UL << (b - 1), "",
+				hist[b]);
+	}
+	printf("Longest gaps:\n");
+	for (i = 0; i < TOP_GAPS && top[i].ns; i++)
+		printf("  %10.3f ms at %10.6f s, stream %d, 0x%03x then 0x%03x\n",
+			top[i].ns / 1e6, top[i].t / 1e9, top[i].stream,
+			top[i].prev_offset, top[i].offset);
+	return rc;
+}
+
+struct replay {
+	int fd;
+	const char *sim_file;
+	const char *sim_opts;
+	const char *type;
+	int block_size;
+	int data_reg;			/* Offset, -1 until the trace says */
+	bool timed;
+	uint64_t t_first;		/* Of the recording */
+	uint64_t t_start;		/* Of the replay */
+	/* Syscall being collected */
+	struct trace_rec first;
+	int vals[REPLAY_MAX_REGS];
+	int n;
+	/* Result */
+	unsigned long syscalls;
+	unsigned long accesses;
+	unsigned long skipped;
+	unsigned long data_reads;
+	unsigned long miscompares;
+	unsigned long failed;
+	uint64_t t_end;
+};
+
+static uint64_t replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* "open card=N type=T blocksize=N" and "regs ... data=0x.." */
+static void replay_note(struct replay *rp, const struct trace_rec *rec)
+{
+	static char type[16];
+	const char *p;
+	int bs;
+
+	if (0 == strncmp(rec->note, "open ", 5)) {
+		p = strstr(rec->note, " type=");
+		if (p && NULL == rp->type &&
+		    1 == sscanf(p, " type=%15s", type))
+			rp->type = type;
+		p = strstr(rec->note, " blocksize=");
+		if (p && 0 == rp->block_size &&
+		    1 == sscanf(p, " blocksize=%d", &bs))
+			rp->block_size = bs;
+	} else if (0 == strncmp(rec->note, "regs ", 5)) {
+		p = strstr(rec->note, " data=");
+		if (p)
+			sscanf(p, " data=%i", &rp->data_reg);
+	}
+}
+
+static int replay_syscall(struct replay *rp)
+{
+	const struct trace_rec *rec = &rp->first;
+	int vals[REPLAY_MAX_REGS];
+	struct timespec ts;
+	uint64_t t;
+	int i, rc;
+
+	if (0 == rp->n)
+		return 0;
+	if (rp->fd < 0) {
+		if (NULL == rp->type) {
+			eprintf("No flash type in the trace, use --type\n");
+			return EINVAL;
+		}
+		rp->fd = cfg_sim_open(rp->sim_file, rp->sim_opts,
+			strcmp(rp->type, "BPIx16") != 0,
+			rp->block_size ? rp->block_size : DEFAULT_BLOCK_SIZE);
+		if (rp->fd < 0) {
+			rc = errno;
+			eprintf("Can not open %s: %s\n", rp->sim_file,
+				cfg_sim_error());
+			return rc;
+		}
+		rp->t_first = rec->t_ns;
+		rp->t_start = replay_now();
+		dprintf("Replaying %s %dKB blocks against %s\n", rp->type,
+			rp->block_size ? rp->block_size : DEFAULT_BLOCK_SIZE,
+			rp->sim_file);
+	}
+	if (rp->timed) {
+		/* Most gaps are below the timer slack, spin those */
+		t = rp->t_start + (rec->t_ns - rp->t_first);
+		if (t > replay_now() + REPLAY_SPIN_NS) {
+			ts.tv_sec = (t - REPLAY_SPIN_NS) / 1000000000ULL;
+			ts.tv_nsec = (t - REPLAY_SPIN_NS) % 1000000000ULL;
+			while (EINTR == clock_nanosleep(CLOCK_MONOTONIC,
+					TIMER_ABSTIME, &ts, NULL))
+				;
+		}
+		while (replay_now() < t)
+			;
+	}
+	if (rec->tag & TRACE_ERROR) {
+		/* Failed on the card, nothing to do again */
+		rp->skipped += rp->n;
+		rp->n = 0;
+		return 0;
+	}
+	if (rec->tag & TRACE_WRITE) {
+		rc = write_config_words(rp->fd, rec->offset, rp->vals, rp->n);
+	} else {
+		rc = read_config_words(rp->fd, rec->offset, vals, rp->n);
+		for (i = 0; 0 == rc && i < rp->n; i++) {
+			if (rec->offset + i * 4 != rp->data_reg)
+				continue;
+			rp->data_reads++;
+			if (vals[i] == rp->vals[i])
+				continue;
+			if (verbose || 0 == rp->miscompares)
+				printf("Miscompare at %.6f s: 0x%08x, recorded 0x%08x\n",
+					rec->t_ns / 1e9, vals[i], rp->vals[i]);
+			rp->miscompares++;
+		}
+	}
+	if (0 != rc)
+		rp->failed++;
+	rp->syscalls++;
+	rp->accesses += rp->n;
+	rp->t_end = rec->t_ns + rec->dur_ns;
+	rp->n = 0;
+	return 0;
+}
+
+static int replay(const char *file, struct replay *rp, int stream)
+{
+	struct trace_reader r;
+	struct trace_rec rec;
+	unsigned long lost;
+	uint64_t t;
+	int rc;
+
+	rc = trace_reader_open(&r, file);
+	if (0 != rc) {
+		eprintf("%s: %s\n", file, EINVAL == rc ? "Not a capi-flash trace" :
+			strerror(rc));
+		return rc;
+	}
+	while (1 == (rc = trace_reader_next(&r, &rec))) {
+		if (rec.stream != stream)
+			continue;
+		if (verbose)
+			print_rec(&rec);
+		if (rec.tag & TRACE_NOTE) {
+			replay_note(rp, &rec);
+			continue;
+		}
+		if ((rec.tag & TRACE_CONT) && rp->n && rp->n < REPLAY_MAX_REGS) {
+			rp->vals[rp->n++] = rec.value;
+			continue;
+		}
+		rc = replay_syscall(rp);
+		if (0 != rc)
+			break;
+		rp->first = rec;
+		rp->vals[0] = rec.value;
+		rp->n = 1;
+	}
+	trace_reader_close(&r);
+	if (rc < 0)
+		eprintf("%s: Damaged trace, replayed up to there\n", file);
+	if (rc <= 0)
+		rc = replay_syscall(rp);
+	if (rp->fd < 0) {
+		eprintf("No config space accesses of stream %d in %s\n",
+			stream, file);
+		return 0 == rc ? ENOENT : rc;
+	}
+	t = replay_now() - rp->t_start;
+	lost = cfg_sim_errors(rp->fd);
+	cfg_sim_close(rp->fd);
+
+	printf("Replayed %lu accesses in %lu syscalls in %.3f s, recorded %.3f s\n",
+		rp->accesses, rp->syscalls, t / 1e9,
+		(rp->t_end - rp->t_first) / 1e9);
+	if (rp->skipped || rp->failed)
+		printf("%lu failed on the card and skipped, %lu failed now\n",
+			rp->skipped, rp->failed);
+	if (lost)
+		printf("%lu words lost by the simulated flash, flash protocol errors\n",
+			lost);
+	if (rp->data_reg < 0)
+		printf("No data register in the trace, flash data not checked\n");
+	else
+		printf("%lu flash data reads, %lu miscompares\n",
+			rp->data_reads, rp->miscompares);
+	if (0 == rc && (rp->miscompares || rp->failed))
+		rc = EIO;
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	struct replay rp = {
+		.fd = -1,
+		.data_reg = -1,
+	};
+	const char *cmd, *file;
+	int stream = 0;
+	int opt;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "verbose",   no_argument,       NULL, 'v' },
+			{ "help",      no_argument,       NULL, 'h' },
+			{ "version",   no_argument,       NULL, 'V' },
+			{ "quiet",     no_argument,       NULL, 'q' },
+			{ "sim",       required_argument, NULL, 'S' },
+			{ "sim-opts",  required_argument, NULL, 'O' },
+			{ "stream",    required_argument, NULL, 's' },
+			{ "type",      required_argument, NULL, 't' },
+			{ "blocksize", required_argument, NULL, 'b' },
+			{ "timed",     no_argument,       NULL, 'T' },
+			{ 0,           no_argument,       NULL, 0   },
+		};
+		opt = getopt_long(argc, argv, "vhVqTS:O:s:t:b:",
+				long_options, &option_index);
+		if (-1 == opt)
+			break;
+		switch (opt) {
+		case 'v':
+			verbose++;
+			break;
+		case 'V':
+			printf("Version : %s\n", version);
+			exit(0);
+		case 'h':
+			help(argv[0]);
+			exit(0);
+		case 'q':
+			quiet = true;
+			break;
+		case 'S':
+			rp.sim_file = optarg;
+			break;
+		case 'O':
+			rp.sim_opts = optarg;
+			break;
+		case 's':
+			stream = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 't':
+			rp.type = optarg;
+			break;
+		case 'b':
+			rp.block_size = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'T':
+			rp.timed = true;
+			break;
+		default:
+			help(argv[0]);
+			exit(EINVAL);
+		}
+	}
+	if (argc - optind != 2) {
+		help(argv[0]);
+		exit(EINVAL);
+	}
+	cmd = argv[optind];
+	file = argv[optind + 1];
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	if (0 == strcmp(cmd, "analyse") || 0 == strcmp(cmd, "analyze"))
+		return analyse(file);
+	if (0 == strcmp(cmd, "replay")) {
+		if (NULL == rp.sim_file) {
+			eprintf("replay needs --sim, it does not touch real cards\n");
+			exit(EINVAL);
+		}
+		return replay(file, &rp, stream);
+	}
+	eprintf("Unknown command '%s'\n", cmd);
+	help(argv[0]);
+	exit(EINVAL);
+}
@@ -0,0 +1,1155 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * capi-flashd: keeps the CAPI cards discovered and their config space
+ * open, and runs flash, verify, audit, dump and reset jobs sent over a
+ * Unix socket. Jobs run one at a time per card and in parallel across
+ * cards, each on the card's worker thread.
+ *
+ * One request per connection, a line of text:
+ *
+ *   flash  card=N[,file=F][,file2=F][,address=A][,address2=A][,delta]
+ *   verify card=N,file=F[,file2=F][,address=A][,address2=A]
+ *   audit  card=N[,file=F][,address=A][,size=N]
+ *   dump   card=N,dump=F,size=N[,address=A]
+ *          flash, verify, audit and dump also take [,rate=N][,cpu=P][,idle]
+ *          to run in the background of a live AFU, flash and verify take
+ *          [,repair] to program the blocks which miscompare again
+ *          and, on SPIx8 without file2=, [,split] to split file= by nibbles
+ *          flash takes [,stream] to poll the write port once per burst of
+ *          words, like capi-flash --stream; it is off by default
+ *   reset  card=N[,region=user|factory]
+ *   cancel card=N
+ *   status
+ *
+ * Type, block size and addresses default to the card's psl-devices
+ * entry. rate= and cpu= pace the job to N config accesses per second
+ * and P percent of a CPU, idle runs it SCHED_IDLE. A flash is never
+ * followed by a reset, that is a job of its own. The daemon answers with "queued", then streams progress lines
+ * and ends with "done id=<id> rc=<rc>".
+ *
+ * SIGINT and SIGTERM cancel the running jobs, fail the queued ones and
+ * stop the daemon, which then closes its --trace file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "capi_flash.h"
+#include "libcapiflash.h"
+
+#define FLASHD_SOCKET		"/var/run/capi-flashd.sock"
+#define FLASHD_MAX_CARDS	16
+#define FLASHD_LINE		1024
+#define FLASHD_MISCOMPARES	1024	/* Reported per job */
+
+static const char *version = GIT_VERSION;
+static bool quiet = false;
+static int verbose = 0;
+
+#define dprintf(fmt, ...) do { \
+	if (!quiet) \
+		printf( fmt, ## __VA_ARGS__); \
+	} while (0)
+
+#define eprintf(fmt, ...) do { \
+		fprintf(stderr, "Error: "fmt, ## __VA_ARGS__); \
+	} while (0)
+
+#define vprintf(fmt, ...) do { \
+	if (verbose > 0) \
+		printf( fmt, ## __VA_ARGS__); \
+	} while (0)
+
+enum job_op { OP_FLASH, OP_VERIFY, OP_AUDIT, OP_DUMP, OP_RESET };
+
+static const char *job_ops[] = {
+	[OP_FLASH]  = "flash",
+	[OP_VERIFY] = "verify",
+	[OP_AUDIT]  = "audit",
+	[OP_DUMP]   = "dump",
+	[OP_RESET]  = "reset",
+};
+
+struct flashd_job {
+	unsigned long id;
+	enum job_op op;
+	int card_no;
+	char *file[2];
+	int address[2];		/* -1: card default */
+	char *dump;
+	uint64_t size;
+	bool delta;
+	bool repair;		/* Program blocks which miscompare again */
+	bool split;		/* SPIx8 from file= alone */
+	bool stream;		/* Poll the write port once per burst */
+	unsigned long max_rate;	/* Config accesses per second, 0: any */
+	int cpu_pct;		/* CPU budget, 0: any */
+	bool idle;		/* SCHED_IDLE while it runs */
+	const char *region;	/* reset: user or factory */
+	int fd;			/* Client connection */
+	int miscompares;
+	char *line;		/* Request, file names point into it */
+	struct flashd_job *next;
+};
+
+/* A discovered card, its open handle and its job queue */
+struct flashd_card {
+	int card_no;
+	char board[64];
+	char type[8];
+	int block_size_kb;
+	int address[2];		/* psl-devices partition, secondary */
+	struct capi_flash *h;
+	int lock_fd;		/* Card lock, held across resets */
+	char *sim_file;
+
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct flashd_job *head, **tail;
+	int queued;
+	struct flashd_job *running;
+	bool stop;		/* Daemon exits, fail the queued jobs */
+};
+
+static struct flashd_card cards[FLASHD_MAX_CARDS];
+static int ncards;
+static unsigned long next_id = 1;
+static const char *sim_base;
+static const char *sim_opts;
+static volatile sig_atomic_t flashd_stop;
+static bool tracing;
+
+/* Best effort, a client that went away does not stop the job */
+static void client_printf(int fd, const char *fmt, ...)
+{
+	char line[FLASHD_LINE];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (n >= (int)sizeof(line))
+		n = sizeof(line) - 1;
+	if (n > 0 && write(fd, line, n) < 0)
+		return;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *op_names[] = {
+	[CAPI_FLASH_OP_ERASE]   = "erase",
+	[CAPI_FLASH_OP_PROGRAM] = "program",
+	[CAPI_FLASH_OP_VERIFY]  = "verify",
+	[CAPI_FLASH_OP_COMPARE] = "compare",
+	[CAPI_FLASH_OP_READ]    = "read",
+};
+
+/* Library events to progress lines for the client */
+static void job_event(struct capi_flash *h, const struct capi_flash_event *ev,
+			void *arg)
+{
+	struct flashd_job *job = arg;
+	const char *op = op_names[ev->op];
+
+	(void)h;
+	switch (ev->type) {
+	case CAPI_FLASH_EV_START:
+		client_printf(job->fd, "start op=%s\n", op);
+		break;
+	case CAPI_FLASH_EV_BLOCK:
+		client_printf(job->fd, "block op=%s n=%d\n", op, ev->block);
+		break;
+	case CAPI_FLASH_EV_MISCOMPARE:
+		if (job->miscompares++ < FLASHD_MISCOMPARES)
+			client_printf(job->fd, "miscompare address=0x%08x data=0x%08x expected=0x%08x\n",
+				ev->address, ev->data, ev->expected);
+		break;
+	case CAPI_FLASH_EV_WAIT:
+		client_printf(job->fd, "wait ns=%lu\n", (unsigned long)ev->ns);
+		break;
+	case CAPI_FLASH_EV_NOTE:
+		client_printf(job->fd, "note %s\n", ev->msg);
+		break;
+	case CAPI_FLASH_EV_DONE:
+		client_printf(job->fd, "phase op=%s rc=%d ns=%lu words=%lu syscalls=%lu\n",
+			op, ev->rc, (unsigned long)ev->ns, ev->words,
+			ev->syscalls);
+		break;
+	case CAPI_FLASH_EV_COMMIT:
+		client_printf(job->fd, "commit op=%s block=%d\n", op,
+			ev->block);
+		break;
+	}
+}
+
+/*
+ * The worker opens and closes the handle, cancel uses it from the
+ * accept loop. Both go under the card lock.
+ */
+static int card_open(struct flashd_card *c)
+{
+	struct capi_flash_params p;
+	struct capi_flash *h;
+	int rc;
+
+	memset(&p, 0, sizeof(p));
+	p.type = c->type;
+	p.block_size_kb = c->block_size_kb;
+	p.credits = 0;
+	p.sim_file = c->sim_file;
+	p.sim_opts = sim_opts;
+	p.locked = true;
+	rc = capi_flash_open(&h, c->card_no, &p);
+	if (0 != rc) {
+		eprintf("card%d: %s\n", c->card_no, h ?
+			capi_flash_error(h) : strerror(rc));
+		capi_flash_close(h);
+		return rc;
+	}
+	pthread_mutex_lock(&c->lock);
+	c->h = h;
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+static void card_close(struct flashd_card *c)
+{
+	struct capi_flash *h;
+
+	pthread_mutex_lock(&c->lock);
+	h = c->h;
+	c->h = NULL;
+	pthread_mutex_unlock(&c->lock);
+	capi_flash_close(h);
+}
+
+/*
+ * Type, block size and addresses from the card's psl-devices entry,
+ * the file if it is there, else the table built into libcapiflash.
+ */
+static void card_psl_lookup(struct flashd_card *c, const char *psl, int psl_id)
+{
+	struct capi_flash_board b;
+
+	if (0 != capi_flash_board(psl, psl_id, &b)) {
+		vprintf("card%d not in %s, it uses defaults\n", c->card_no, psl);
+		return;
+	}
+	snprintf(c->board, sizeof(c->board), "%s", b.board);
+	snprintf(c->type, sizeof(c->type), "%s", b.type);
+	if (b.block_size_kb) {
+		c->address[0] = b.address;
+		c->block_size_kb = b.block_size_kb;
+	}
+	if (b.has_address2)
+		c->address[1] = b.address2;
+}
+
+/*
+ * Open a card, find its psl-devices entry and open it again if that
+ * asks for another flash type or block size.
+ */
+static int card_discover(struct flashd_card *c, int card_no, const char *psl)
+{
+	char type[8], owner[128];
+	int bs, rc;
+
+	c->card_no = card_no;
+	snprintf(c->type, sizeof(c->type), "BPIx16");
+	snprintf(c->board, sizeof(c->board), "unknown");
+	c->block_size_kb = DEFAULT_BLOCK_SIZE;
+	c->address[0] = DEFAULT_USER_FLASH_ADDRESS;
+	c->address[1] = DEFAULT_USER_FLASH_ADDRESS_SEC;
+	if (sim_base && asprintf(&c->sim_file, "%s.%d", sim_base, card_no) < 0)
+		return ENOMEM;
+	rc = capi_flash_lock(card_no, c->sim_file, &c->lock_fd, owner,
+		sizeof(owner));
+	if (0 != rc) {
+		eprintf("card%d: %s%s\n", card_no, EBUSY == rc ?
+			"locked by " : "", owner);
+		return rc;
+	}
+	rc = card_open(c);
+	if (0 != rc)
+		return rc;
+	snprintf(type, sizeof(type), "%s", c->type);
+	bs = c->block_size_kb;
+	card_psl_lookup(c, psl, capi_flash_info(c->h)->psl_id);
+	if (strcmp(type, c->type) || bs != c->block_size_kb) {
+		card_close(c);
+		rc = card_open(c);
+	}
+	return rc;
+}
+
+/*
+ * Reset the card to load the region's image, like capi-reset. The
+ * handle is closed across the reset and opened again, the card lock is
+ * kept.
+ */
+static int card_reset(struct flashd_card *c, struct flashd_job *job)
+{
+	struct capi_flash_reset_times t;
+	int rc;
+
+	card_close(c);
+	if (c->sim_file) {
+		client_printf(job->fd, "note Simulated card, reopening only\n");
+		return card_open(c);
+	}
+	rc = capi_flash_reset(c->card_no, job->region, RESET_TIMEOUT, &t);
+	client_printf(job->fd, "phase op=reset rc=%d ns=%lu gone_ns=%lu back_ns=%lu uevents=%lu%s\n",
+		rc, (unsigned long)t.done_ns, (unsigned long)t.gone_ns,
+		(unsigned long)t.back_ns, t.uevents, t.polled ? " polled" : "");
+	if (0 != rc)
+		return rc;
+	return card_open(c);
+}
+
+/* SPIx8 from file= alone: the flashes' halves of a combined image */
+static int job_image(struct flashd_job *job, int round, bool split,
+			struct capi_flash_image **img)
+{
+	int rc;
+
+	if (split)
+		rc = capi_flash_image_open_half(img, job->file[0], round ?
+			CAPI_FLASH_IMAGE_SECONDARY : CAPI_FLASH_IMAGE_PRIMARY);
+	else
+		rc = capi_flash_image_open(img, job->file[round]);
+	if (0 != rc)
+		client_printf(job->fd, "error %s\n", *img ?
+			capi_flash_image_error(*img) : strerror(rc));
+	return rc;
+}
+
+/* Size of the image, a compressed one is read through if no op did yet */
+static int job_image_size(struct flashd_job *job,
+			struct capi_flash_image *img, uint64_t *size)
+{
+	*size = capi_flash_image_size(img);
+	if (0 == *size && *capi_flash_image_error(img)) {
+		client_printf(job->fd, "error %s\n",
+			capi_flash_image_error(img));
+		return EIO;
+	}
+	return 0;
+}
+
+/* Worker thread's policy for a background job, and back */
+static void job_idle(struct flashd_job *job, bool idle)
+{
+	struct sched_param sp = { .sched_priority = 0 };
+
+	if (!job->idle)
+		return;
+	if (0 != pthread_setschedparam(pthread_self(),
+			idle ? SCHED_IDLE : SCHED_OTHER, &sp))
+		client_printf(job->fd, "note Can not set %s\n",
+			idle ? "SCHED_IDLE" : "SCHED_OTHER");
+}
+
+/* Run one job on the card's open handle */
+/*
+ * Verify, or flash with delta, and with repair program the blocks which
+ * still differ again, up to REPAIR_PASSES times. Tells the client which
+ * blocks differed.
+ */
+static int job_verify(struct flashd_card *c, struct flashd_job *job,
+			int address, struct capi_flash_image *img)
+{
+	unsigned long ndiff;
+	uint64_t size;
+	uint8_t *map;
+	int b, n, nblocks, ndiff_blocks, pass, rc;
+
+	rc = job_image_size(job, img, &size);
+	if (0 != rc)
+		return rc;
+	nblocks = capi_flash_blocks(c->h, size);
+	map = calloc(CAPI_FLASH_MAP_BYTES(nblocks), 1);
+	if (NULL == map)
+		return ENOMEM;
+	if (OP_FLASH == job->op && job->delta) {
+		rc = capi_flash_delta_map(c->h, address, img, map,
+				&ndiff_blocks, &ndiff);
+		if (0 == rc || FLASH_VERIFY_MISMATCH == rc)
+			client_printf(job->fd, "differ blocks=%d\n",
+				ndiff_blocks);
+		if (FLASH_VERIFY_MISMATCH == rc)
+			rc = 0;
+	} else {
+		rc = capi_flash_verify_map(c->h, address, img, map, &ndiff);
+	}
+	for (pass = 0; 0 == rc && ndiff; pass++) {
+		for (b = 0, n = 0; b < nblocks; b++)
+			if (CAPI_FLASH_MAP_TEST(map, b))
+				n++;
+		client_printf(job->fd, "differ words=%lu blocks=%d\n", ndiff, n);
+		if (!job->repair || REPAIR_PASSES == pass)
+			break;
+		client_printf(job->fd, "repair pass=%d\n", pass + 1);
+		rc = capi_flash_repair(c->h, address, img, map, &ndiff);
+	}
+	free(map);
+	if (0 == rc && ndiff)
+		rc = FLASH_VERIFY_MISMATCH;
+	return rc;
+}
+
+static int job_run(struct flashd_card *c, struct flashd_job *job)
+{
+	struct capi_flash_image *img = NULL;
+	struct capi_flash_digest fd, id;
+	unsigned long ndiff;
+	uint64_t size;
+	int round, rounds, address, dump_fd;
+	int rc = 0;
+
+	if (OP_RESET == job->op)
+		return card_reset(c, job);
+	if ((OP_FLASH == job->op || OP_VERIFY == job->op) &&
+	    0 == strcmp(c->type, "SPIx8") && !job->file[1] && !job->split) {
+		client_printf(job->fd, "error card%d is SPIx8, it needs file2= or split\n",
+			c->card_no);
+		return EINVAL;
+	}
+	if (job->split && strcmp(c->type, "SPIx8")) {
+		client_printf(job->fd, "error card%d is %s, split is for SPIx8 only\n",
+			c->card_no, c->type);
+		return EINVAL;
+	}
+	if (NULL == c->h) {
+		rc = card_open(c);
+		if (0 != rc) {
+			client_printf(job->fd, "error card%d can not be opened\n",
+				c->card_no);
+			return rc;
+		}
+	}
+	capi_flash_set_event_cb(c->h, job_event, job);
+	rc = capi_flash_set_pace(c->h, job->max_rate, job->cpu_pct);
+	capi_flash_set_credits(c->h, job->stream ? -1 : 0);
+	job_idle(job, true);
+	rounds = (strcmp(c->type, "SPIx8") == 0 && (job->file[1] || job->split)) ?
+		2 : 1;
+	for (round = 0; 0 == rc && round < rounds; round++) {
+		address = job->address[round] >= 0 ? job->address[round] :
+			c->address[round];
+		client_printf(job->fd, "round n=%d address=0x%08x\n", round,
+			address);
+		if (job->file[round] || job->split) {
+			rc = job_image(job, round, job->split, &img);
+			if (0 != rc)
+				break;
+		}
+		switch (job->op) {
+		case OP_FLASH:
+			if (job->delta) {
+				rc = job_verify(c, job, address, img);
+				break;
+			}
+			rc = capi_flash_write(c->h, address, img);
+			if (0 != rc)
+				break;
+			/* Fall through */
+		case OP_VERIFY:
+			rc = job_verify(c, job, address, img);
+			break;
+		case OP_AUDIT:
+			size = job->size;
+			if (img) {
+				rc = job_image_size(job, img, &size);
+				if (0 != rc)
+					break;
+			}
+			rc = capi_flash_audit(c->h, address, img, size,
+					&fd, &id, &ndiff);
+			if (0 != rc && FLASH_VERIFY_MISMATCH != rc)
+				break;
+			client_printf(job->fd, "digest flash crc32c=%08x sha256=%s len=%lu\n",
+				fd.crc32c, fd.sha256, (unsigned long)fd.len);
+			if (img)
+				client_printf(job->fd, "digest image crc32c=%08x sha256=%s len=%lu differ=%lu\n",
+					id.crc32c, id.sha256,
+					(unsigned long)id.len, ndiff);
+			break;
+		case OP_DUMP:
+			dump_fd = open(job->dump, O_WRONLY | O_CREAT | O_TRUNC,
+					0644);
+			if (dump_fd < 0) {
+				client_printf(job->fd, "error Can not open %s: %s\n",
+					job->dump, strerror(errno));
+				rc = EACCES;
+				break;
+			}
+			rc = capi_flash_dump(c->h, address, job->size, dump_fd,
+					NULL);
+			if (0 != close(dump_fd) && 0 == rc)
+				rc = EIO;
+			break;
+		case OP_RESET:
+			break;
+		}
+		capi_flash_image_close(img);
+		img = NULL;
+	}
+	if (0 != rc && FLASH_VERIFY_MISMATCH != rc && c->h &&
+	    *capi_flash_error(c->h))
+		client_printf(job->fd, "error %s\n", capi_flash_error(c->h));
+	capi_flash_set_event_cb(c->h, NULL, NULL);
+	capi_flash_set_pace(c->h, 0, 0);
+	capi_flash_set_credits(c->h, 0);
+	job_idle(job, false);
+	/* Cancel sticks to the handle, start over with a new one */
+	if (FLASH_CANCELED == rc) {
+		card_close(c);
+		card_open(c);
+	}
+	return rc;
+}
+
+static void job_free(struct flashd_job *job)
+{
+	if (job->fd >= 0)
+		close(job->fd);
+	free(job->line);
+	free(job);
+}
+
+/* Card worker: runs the queued jobs in order */
+static void *card_worker(void *arg)
+{
+	struct flashd_card *c = arg;
+	struct flashd_job *job;
+	uint64_t t0;
+	int rc;
+
+	/* The trace stream of this thread starts with the card's open and
+	   regs notes, capi-flash-trace replay needs them */
+	if (tracing) {
+		card_close(c);
+		card_open(c);
+	}
+	pthread_mutex_lock(&c->lock);
+	while (1) {
+		while (NULL == c->head && !c->stop)
+			pthread_cond_wait(&c->cond, &c->lock);
+		job = c->head;
+		if (NULL == job)
+			break;
+		c->head = job->next;
+		if (NULL == c->head)
+			c->tail = &c->head;
+		c->queued--;
+		if (c->stop) {
+			client_printf(job->fd, "error Daemon stopping\n");
+			client_printf(job->fd, "done id=%lu rc=%d\n", job->id,
+				ECANCELED);
+			job_free(job);
+			continue;
+		}
+		c->running = job;
+		pthread_mutex_unlock(&c->lock);
+
+		vprintf("card%d: job %lu %s\n", c->card_no, job->id,
+			job_ops[job->op]);
+		t0 = now_ns();
+		rc = job_run(c, job);
+		client_printf(job->fd, "done id=%lu rc=%d ns=%lu\n", job->id, rc,
+			(unsigned long)(now_ns() - t0));
+		vprintf("card%d: job %lu rc %d\n", c->card_no, job->id, rc);
+
+		pthread_mutex_lock(&c->lock);
+		c->running = NULL;
+		pthread_mutex_unlock(&c->lock);
+		job_free(job);
+		pthread_mutex_lock(&c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+/*
+ * SIGINT, SIGTERM: stop taking requests, cancel the running jobs and
+ * fail the queued ones, so the workers are done with the config space
+ * before the trace is closed.
+ */
+static void flashd_stop_signal(int sig)
+{
+	(void)sig;
+	flashd_stop = 1;
+}
+
+static void cards_stop(void)
+{
+	struct flashd_card *c;
+	int i;
+
+	for (i = 0; i < ncards; i++) {
+		c = &cards[i];
+		pthread_mutex_lock(&c->lock);
+		c->stop = true;
+		if (c->running && c->h)
+			capi_flash_cancel(c->h);
+		pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+	}
+	for (i = 0; i < ncards; i++)
+		pthread_join(cards[i].worker, NULL);
+}
+
+static struct flashd_card *card_find(int card_no)
+{
+	int i;
+
+	for (i = 0; i < ncards; i++)
+		if (cards[i].card_no == card_no)
+			return &cards[i];
+	return NULL;
+}
+
+static int job_parse(struct flashd_job *job, char *arg)
+{
+	enum { J_CARD, J_FILE, J_FILE2, J_ADDR, J_ADDR2, J_DELTA, J_SIZE,
+	       J_DUMP, J_REGION, J_RATE, J_CPU, J_IDLE, J_REPAIR, J_SPLIT,
+	       J_STREAM };
+	char *const tokens[] = {
+		[J_CARD]   = "card",
+		[J_FILE]   = "file",
+		[J_FILE2]  = "file2",
+		[J_ADDR]   = "address",
+		[J_ADDR2]  = "address2",
+		[J_DELTA]  = "delta",
+		[J_SIZE]   = "size",
+		[J_DUMP]   = "dump",
+		[J_REGION] = "region",
+		[J_RATE]   = "rate",
+		[J_CPU]    = "cpu",
+		[J_IDLE]   = "idle",
+		[J_REPAIR] = "repair",
+		[J_SPLIT]  = "split",
+		[J_STREAM] = "stream",
+		NULL
+	};
+	char *val;
+	int o;
+
+	while (*arg != '\0') {
+		o = getsubopt(&arg, tokens, &val);
+		if (o < 0 || (NULL == val && o != J_DELTA && o != J_IDLE &&
+			      o != J_REPAIR && o != J_SPLIT && o != J_STREAM))
+			return EINVAL;
+		switch (o) {
+		case J_CARD:
+			job->card_no = strtol(val, (char **)NULL, 0);
+			break;
+		case J_FILE:
+			job->file[0] = val;
+			break;
+		case J_FILE2:
+			job->file[1] = val;
+			break;
+		case J_ADDR:
+			job->address[0] = strtol(val, (char **)NULL, 0);
+			break;
+		case J_ADDR2:
+			job->address[1] = strtol(val, (char **)NULL, 0);
+			break;
+		case J_DELTA:
+			job->delta = true;
+			break;
+		case J_SIZE:
+			job->size = strtoull(val, (char **)NULL, 0);
+			break;
+		case J_DUMP:
+			job->dump = val;
+			break;
+		case J_REGION:
+			if (strcmp(val, "user") && strcmp(val, "factory"))
+				return EINVAL;
+			job->region = val;
+			break;
+		case J_RATE:
+			job->max_rate = strtoul(val, (char **)NULL, 0);
+			break;
+		case J_CPU:
+			job->cpu_pct = strtol(val, (char **)NULL, 0);
+			break;
+		case J_IDLE:
+			job->idle = true;
+			break;
+		case J_REPAIR:
+			job->repair = true;
+			break;
+		case J_SPLIT:
+			job->split = true;
+			break;
+		case J_STREAM:
+			job->stream = true;
+			break;
+		}
+	}
+	if (job->split && (job->file[1] || NULL == job->file[0]))
+		return EINVAL;
+	switch (job->op) {
+	case OP_FLASH:
+	case OP_VERIFY:
+		return job->file[0] ? 0 : EINVAL;
+	case OP_AUDIT:
+		return (job->file[0] || job->size) ? 0 : EINVAL;
+	case OP_DUMP:
+		return (job->dump && job->size) ? 0 : EINVAL;
+	case OP_RESET:
+		break;
+	}
+	return 0;
+}
+
+static void flashd_status(int fd)
+{
+	struct flashd_card *c;
+	int i;
+
+	for (i = 0; i < ncards; i++) {
+		c = &cards[i];
+		pthread_mutex_lock(&c->lock);
+		client_printf(fd, "card%d %s %s blocksize=%d address=0x%08x address2=0x%08x %s queued=%d",
+			c->card_no, c->board, c->type, c->block_size_kb,
+			c->address[0], c->address[1],
+			c->running ? "running" : "idle", c->queued);
+		if (c->running)
+			client_printf(fd, " id=%lu op=%s", c->running->id,
+				job_ops[c->running->op]);
+		client_printf(fd, "\n");
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+/* Read a request, answer status and cancel, queue anything else */
+static void flashd_request(int fd)
+{
+	struct flashd_job *job;
+	struct flashd_card *c;
+	char *line, *args;
+	ssize_t n;
+	size_t len = 0;
+	unsigned i;
+
+	line = malloc(FLASHD_LINE);
+	if (NULL == line) {
+		close(fd);
+		return;
+	}
+	while (len < FLASHD_LINE - 1) {
+		n = read(fd, line + len, FLASHD_LINE - 1 - len);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+		if (memchr(line + len - n, '\n', n))
+			break;
+	}
+	line[len] = '\0';
+	line[strcspn(line, "\r\n")] = '\0';
+	args = line + strcspn(line, " \t");
+	if (*args)
+		*args++ = '\0';
+	args += strspn(args, " \t");
+
+	if (0 == strcmp(line, "status")) {
+		flashd_status(fd);
+		client_printf(fd, "done rc=0\n");
+		goto close;
+	}
+	job = calloc(1, sizeof(*job));
+	if (NULL == job)
+		goto close;
+	job->fd = fd;
+	job->line = line;
+	job->card_no = -1;
+	job->address[0] = job->address[1] = -1;
+	job->region = "factory";
+	job->op = OP_RESET + 1;
+	for (i = 0; i < sizeof(job_ops) / sizeof(job_ops[0]); i++)
+		if (0 == strcmp(line, job_ops[i]))
+			job->op = i;
+	if (0 == strcmp(line, "cancel")) {
+		if (0 != job_parse(job, args) || NULL == (c = card_find(job->card_no))) {
+			client_printf(fd, "error Usage: cancel card=N\n");
+			client_printf(fd, "done rc=%d\n", EINVAL);
+		} else {
+			pthread_mutex_lock(&c->lock);
+			if (c->running && c->h)
+				capi_flash_cancel(c->h);
+			client_printf(fd, "done rc=%d\n", c->running ? 0 : ENOENT);
+			pthread_mutex_unlock(&c->lock);
+		}
+		job_free(job);
+		return;
+	}
+	if (job->op > OP_RESET || 0 != job_parse(job, args)) {
+		client_printf(fd, "error Invalid request '%s %s'\n", line, args);
+		client_printf(fd, "done rc=%d\n", EINVAL);
+		job_free(job);
+		return;
+	}
+	c = card_find(job->card_no);
+	if (NULL == c) {
+		client_printf(fd, "error No card%d\n", job->card_no);
+		client_printf(fd, "done rc=%d\n", ENODEV);
+		job_free(job);
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	job->id = next_id++;
+	client_printf(fd, "queued id=%lu card=%d ahead=%d\n", job->id,
+		c->card_no, c->queued + (c->running ? 1 : 0));
+	*c->tail = job;
+	c->tail = &job->next;
+	c->queued++;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	return;
+ close:
+	free(line);
+	close(fd);
+}
+
+static int flashd_listen(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		eprintf("Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Error");
+		return -1;
+	}
+	unlink(path);
+	/* Flashing takes root, so does talking to the daemon */
+	if (0 != bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    0 != chmod(path, 0600) || 0 != listen(fd, 16)) {
+		perror("Error");
+		eprintf("Can not listen on %s\n", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Client: send one request, copy the answer to stdout and exit with
+ * the rc of its "done" line. Relative file names are made absolute,
+ * the daemon runs elsewhere.
+ */
+static int flashd_client(const char *path, const char *req)
+{
+	struct sockaddr_un sa;
+	char buf[FLASHD_LINE * 4], line[FLASHD_LINE], *p, *q, *abs;
+	FILE *f;
+	int fd, rc = EIO;
+	size_t n = 0;
+
+	for (p = (char *)req; *p && n < sizeof(line) - 1; ) {
+		q = NULL;
+		if (0 == strncmp(p, "file=", 5) || 0 == strncmp(p, "file2=", 6) ||
+		    0 == strncmp(p, "dump=", 5))
+			q = strchr(p, '=') + 1;
+		if (q && '/' != *q) {
+			char name[PATH_MAX];
+			size_t l = strcspn(q, ",");
+
+			snprintf(name, sizeof(name), "%.*s", (int)l, q);
+			abs = realpath(name, NULL);
+			if (NULL == abs && ENOENT == errno && 0 == strncmp(p, "dump=", 5)) {
+				char cwd[PATH_MAX];
+
+				if (getcwd(cwd, sizeof(cwd)) &&
+				    asprintf(&abs, "%s/%s", cwd, name) < 0)
+					abs = NULL;
+			}
+			if (abs) {
+				n += snprintf(line + n, sizeof(line) - n, "%.*s%s",
+					(int)(q - p), p, abs);
+				free(abs);
+				p = q + l;
+				continue;
+			}
+		}
+		line[n++] = *p++;
+	}
+	if (n > sizeof(line) - 2)
+		n = sizeof(line) - 2;
+	line[n++] = '\n';
+	line[n] = '\0';
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || 0 != connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		perror("Error");
+		eprintf("Can not connect to %s\n", path);
+		return ECONNREFUSED;
+	}
+	if (write(fd, line, n) != (ssize_t)n) {
+		perror("Error");
+		close(fd);
+		return EIO;
+	}
+	f = fdopen(fd, "r");
+	if (NULL == f) {
+		close(fd);
+		return ENOMEM;
+	}
+	while (fgets(buf, sizeof(buf), f)) {
+		fputs(buf, stdout);
+		if (0 == strncmp(buf, "done ", 5) && (p = strstr(buf, "rc=")))
+			rc = strtol(p + 3, NULL, 0);
+	}
+	fclose(f);
+	return rc;
+}
+
+static void help(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+		"	  -h, --help       This help\n"
+		"	  -v, --verbose    More Verbose\n"
+		"	  -V, --version    Print version\n"
+		"	  -q, --quiet      No messages\n"
+		"	  -s, --socket     Unix socket (default: %s)\n"
+		"	  -P, --psl-devices  Board table (default: %s)\n"
+		"	  -C, --card       Serve only this card, repeat per card\n"
+		"	  -c, --client     Send a request to the daemon and print the\n"
+		"	                   answer, e.g. -c \"flash card=0,file=image.bin\"\n"
+		"	  -S, --sim        Use simulated cards backed by <file>.<card>\n"
+		"	  -n, --sim-cards  Number of simulated cards (default: 1)\n"
+		"	  -O, --sim-opts   Simulator options\n"
+		"	  -e, --trace      Record every config space access of the\n"
+		"	                   jobs to this file, see capi-flash-trace\n\n",
+		prog,
+		FLASHD_SOCKET, PSL_DEVICES);
+	printf("Requests: flash, verify, audit, dump, reset, cancel, status\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *sock_path = FLASHD_SOCKET;
+	const char *psl = PSL_DEVICES;
+	const char *request = NULL;
+	const char *trace = NULL;
+	struct sigaction sa;
+	sigset_t stop_sigs;
+	int card_list[FLASHD_MAX_CARDS];
+	int ncard_list = 0, nsim = 1;
+	struct dirent *de;
+	DIR *dir;
+	struct timeval rcv_timeout = { 5, 0 };
+	int i, cmd, lfd, fd, card_no, rc;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "verbose",     no_argument,       NULL, 'v' },
+			{ "help",        no_argument,       NULL, 'h' },
+			{ "version",     no_argument,       NULL, 'V' },
+			{ "quiet",       no_argument,       NULL, 'q' },
+			{ "socket",      required_argument, NULL, 's' },
+			{ "psl-devices", required_argument, NULL, 'P' },
+			{ "card",        required_argument, NULL, 'C' },
+			{ "client",      required_argument, NULL, 'c' },
+			{ "sim",         required_argument, NULL, 'S' },
+			{ "sim-cards",   required_argument, NULL, 'n' },
+			{ "sim-opts",    required_argument, NULL, 'O' },
+			{ "trace",       required_argument, NULL, 'e' },
+			{ 0,             no_argument,       NULL, 0   },
+		};
+		cmd = getopt_long(argc, argv, "vhVqs:P:C:c:S:n:O:e:",
+			long_options, &option_index);
+		if (cmd == -1)
+			break;
+		switch (cmd) {
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+			help(argv[0]);
+			exit(0);
+		case 'V':
+			printf("%s\n", version);
+			exit(0);
+		case 'q':
+			quiet = true;
+			break;
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'P':
+			psl = optarg;
+			break;
+		case 'C':
+			if (ncard_list == FLASHD_MAX_CARDS) {
+				eprintf("Not more than %d cards\n",
+					FLASHD_MAX_CARDS);
+				exit(EINVAL);
+			}
+			card_list[ncard_list++] = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'c':
+			request = optarg;
+			break;
+		case 'S':
+			sim_base = optarg;
+			break;
+		case 'n':
+			nsim = strtol(optarg, (char **)NULL, 0);
+			break;
+		case 'O':
+			sim_opts = optarg;
+			break;
+		case 'e':
+			trace = optarg;
+			break;
+		default:
+			help(argv[0]);
+			exit(EINVAL);
+		}
+	}
+	if (request)
+		return flashd_client(sock_path, request);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	/* Only the accept loop takes SIGINT and SIGTERM, not the threads */
+	sigemptyset(&stop_sigs);
+	sigaddset(&stop_sigs, SIGINT);
+	sigaddset(&stop_sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_sigs, NULL);
+	if (trace) {
+		rc = capi_flash_trace_open(trace);
+		if (0 != rc) {
+			eprintf("Can not open %s: %s\n", trace, strerror(rc));
+			exit(rc);
+		}
+		tracing = true;
+	}
+
+	/* Cards: -C, the simulated ones or what /sys/class/cxl has */
+	if (0 == ncard_list && sim_base) {
+		for (i = 0; i < nsim && i < FLASHD_MAX_CARDS; i++)
+			card_list[ncard_list++] = i;
+	} else if (0 == ncard_list) {
+		dir = opendir("/sys/class/cxl");
+		while (dir && (de = readdir(dir)) && ncard_list < FLASHD_MAX_CARDS)
+			if (1 == sscanf(de->d_name, "card%d", &card_no))
+				card_list[ncard_list++] = card_no;
+		if (dir)
+			closedir(dir);
+	}
+	for (i = 0; i < ncard_list; i++) {
+		struct flashd_card *c = &cards[ncards];
+
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->cond, NULL);
+		c->tail = &c->head;
+		c->lock_fd = -1;
+		if (0 != card_discover(c, card_list[i], psl)) {
+			if (-1 != c->lock_fd)
+				close(c->lock_fd);
+			pthread_cond_destroy(&c->cond);
+			pthread_mutex_destroy(&c->lock);
+			free(c->sim_file);
+			memset(c, 0, sizeof(*c));
+			continue;
+		}
+		dprintf("card%d: %s %s blocksize %d KB address 0x%08x\n",
+			c->card_no, c->board, c->type, c->block_size_kb,
+			c->address[0]);
+		if (0 != pthread_create(&c->worker, NULL, card_worker, c)) {
+			eprintf("Can not start worker for card%d\n", c->card_no);
+			exit(EAGAIN);
+		}
+		ncards++;
+	}
+	if (0 == ncards) {
+		eprintf("No CAPI cards found\n");
+		exit(ENODEV);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	/* No SA_RESTART, accept() has to return */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = flashd_stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	pthread_sigmask(SIG_UNBLOCK, &stop_sigs, NULL);
+	lfd = flashd_listen(sock_path);
+	if (lfd < 0)
+		exit(EACCES);
+	dprintf("Listening on %s\n", sock_path);
+	while (!flashd_stop) {
+		fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (EINTR != errno && ECONNABORTED != errno)
+				perror("Error");
+			continue;
+		}
+		/* A client has a moment to send its request line */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout,
+			sizeof(rcv_timeout));
+		flashd_request(fd);
+	}
+	dprintf("Stopping\n");
+	close(lfd);
+	unlink(sock_path);
+	cards_stop();
+	rc = 0;
+	if (trace) {
+		rc = capi_flash_trace_close();
+		if (0 != rc)
+			eprintf("Can not write %s: %s\n", trace, strerror(rc));
+		vprintf("Config space trace in %s\n", trace);
+	}
+	return rc;
+}
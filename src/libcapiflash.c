@@ -0,0 +1,2676 @@
+/*
+ * Copyright 2016 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *	 http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE /* For asprintf, pipe2 */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <limits.h>
+#include "capi_flash.h"
+#include "capi_flash_cfg.h"
+#include "capi_flash_digest.h"
+#include "capi_flash_sim.h"
+#include "capi_flash_decode.h"
+#include "capi_flash_trace.h"
+#include "capi_flash_fingerprint.h"
+#include "libcapiflash.h"
+
+/*
+ * Polling policies. Waits for the write port, for SPI read data and for
+ * the BPIx16 remain counter (bounded by flash_wait_ready()) are
+ * short and only spin. The erase, program done and reset waits spin for a
+ * few polls, then sleep with exponential backoff up to max_sleep_us, so a
+ * four minute erase does not keep a core busy.
+ */
+enum poll_op {
+	POLL_READY = 0,
+	POLL_PORT,
+	POLL_ERASE,
+	POLL_PROG,
+	POLL_RDATA,
+	POLL_REMAIN,
+	POLL_PACE,
+	POLL_OPS
+};
+
+struct poll_policy {
+	const char *name;
+	unsigned spin;			/* Polls before the first sleep */
+	unsigned min_sleep_us;
+	unsigned max_sleep_us;
+};
+
+static const struct poll_policy poll_policies[POLL_OPS] = {
+	[POLL_READY]  = { "ready",  64,        10, 10000 },
+	[POLL_PORT]   = { "port",   UINT_MAX,   0,     0 },
+	[POLL_ERASE]  = { "erase",  64,        50, 20000 },
+	[POLL_PROG]   = { "prog",   64,        10, 10000 },
+	[POLL_RDATA]  = { "rdata",  UINT_MAX,   0,     0 },
+	[POLL_REMAIN] = { "remain", UINT_MAX,   0,     0 },
+	[POLL_PACE]   = { "pace",   0,          0,     0 },	/* Stats only */
+};
+
+/*
+ * Background pacing, capi_flash_set_pace(). Every wait for the card
+ * first checks the config accesses and the thread CPU time of the
+ * current window against the limits and sleeps off any excess. The
+ * window starts again after PACE_WINDOW_NS, so a long erase does not
+ * build up credit for a burst afterwards. While pacing, the erase,
+ * program and reset waits sleep from the first poll that is not done.
+ */
+#define PACE_WINDOW_NS		1000000000ULL
+#define PACE_CHECK_CALLS	256	/* Without a rate */
+
+struct flash_pace {
+	unsigned long rate;	/* Config accesses per second, 0: any */
+	int cpu_pct;		/* Thread CPU per wall time, 0: any */
+	unsigned long quantum;	/* Accesses between checks */
+	unsigned long next;	/* cfg_stats()->syscalls of the next check */
+	unsigned long calls0;	/* Window start */
+	uint64_t t0;
+	uint64_t cpu0;
+};
+
+/*
+ * Words the flash write port takes after it reported ready (not busy)
+ * before it has to be polled again, per flash type. Used with --stream.
+ */
+static const struct {
+	const char *type;
+	int credits;
+} port_credits[] = {
+	{ "BPIx16", 8 },
+	{ "SPIx4",  16 },
+	{ "SPIx8",  16 },
+};
+
+/* A burst whose ready poll takes longer than this is a stall */
+#define PORT_STALL_POLLS(credits)	(64UL * (credits))
+
+/*
+ * A word pushed into a full write port is lost and the controller then
+ * waits for it forever. A streamed program which is not done this long
+ * after its last word overran the port and is programmed again with the
+ * per word handshake: STREAM_DONE_SECS plus STREAM_DONE_NS_WORD per word
+ * written (about 1 MB/s, slow NOR programming), at most the 120 s of the
+ * per word handshake.
+ */
+#define STREAM_DONE_SECS	5
+#define STREAM_DONE_NS_WORD	4000ULL
+#define PROG_DONE_SECS		120
+#define FLASH_STREAM_OVERRUN	(-1)	/* Internal, never returned */
+
+#define ERR_SIZE	256
+
+/* An open card and the flash registers found behind the CAPI VSEC */
+struct capi_flash {
+	int cfg;
+	int lock_fd;		/* CXL_LOCK_DIR/card<N>.lock */
+	int addr_reg;
+	int size_reg;
+	int cntl_reg;
+	int data_reg;
+	bool is_SPI;
+	int block_words;	/* Flash block size in 4B words */
+	int credits;		/* Words written per port ready poll */
+	int type_credits;	/* Default of the flash type, -1 credits */
+	int read_window;	/* BPIx16 words per read request */
+	bool probe;		/* Config space read only, see params */
+	bool trim;		/* Leave the erased tail of images unprogrammed */
+	struct capi_flash_info info;
+	char *cfg_path;
+	char *fp_path;		/* Fingerprint store, --skip-same */
+
+	capi_flash_event_fn event;
+	void *event_arg;
+	volatile int cancel;
+	struct flash_pace pace;
+
+	struct capi_flash_poll_stat poll[POLL_OPS];
+	char err[ERR_SIZE];
+};
+
+/*
+ * Bitstream image source. Regular files are mapped, anything else that
+ * can seek is read through a large aligned buffer. Both hand the image
+ * out as pointer/length chunks of words. The tail is padded with erased
+ * flash (0xFFFFFFFF) here and nowhere else, so the program and verify
+ * loops can run past the end of the file.
+ *
+ * gzip, xz and zstd compressed files are decoded on the fly by the
+ * matching decompressor through a pipe into the same buffer. Their size
+ * is learned at the end of the first pass over the stream, seeking
+ * backwards (verify, delta) decodes the stream again from the start.
+ *
+ * .bit and .mcs files, and the halves of a combined SPIx8 image, go
+ * through a decoder (capi_flash_decode.c) into the buffer the same way,
+ * reading the file or the decompressor's output from the beginning.
+ */
+#define IMAGE_BUF_SIZE     (4 * 1024 * 1024)
+#define IMAGE_PAD_WORDS    1024
+
+static const struct image_codec {
+	const char *tool;
+	unsigned char magic[6];
+	int magic_len;
+} image_codecs[] = {
+	{ "gzip", { 0x1f, 0x8b }, 2 },
+	{ "xz",   { 0xfd, '7', 'z', 'X', 'Z', 0x00 }, 6 },
+	{ "zstd", { 0x28, 0xb5, 0x2f, 0xfd }, 4 },
+};
+
+struct capi_flash_image {
+	char *path;
+	const struct image_codec *codec;	/* Compressed file */
+	pid_t pid;		/* Decompressor feeding fd */
+	uint64_t stream_pos;	/* Word offset of the next read from fd */
+	int fd;
+	off_t size;		/* Bytes in the file */
+	bool size_known;	/* Not for a stream before its end */
+	uint64_t words;		/* Words in the file, last one may be partial */
+	uint64_t pos;		/* Next word handed out */
+	uint32_t *map;		/* mmap()ed file */
+	const uint32_t *user;	/* Caller's buffer, capi_flash_image_buffer() */
+	uint32_t *buf;		/* Read buffer if the file can not be mapped */
+	uint64_t buf_pos;	/* Word offset of buf[0] */
+	uint64_t buf_len;	/* Valid words in buf */
+	uint32_t tail;		/* Partial last word of a mapped file */
+	off_t raw_size;		/* Bytes in the file, before decoding */
+	uint64_t raw_pos;	/* Next byte of the file for the decoder */
+	int format;		/* DECODE_BIN, DECODE_BIT, DECODE_MCS */
+	struct decoder *dec;	/* Not raw or a half of it */
+	uint64_t payload;	/* Bytes up to the trailing erased words */
+	bool payload_known;
+	unsigned long syscalls;	/* Issued for image file access */
+	char err[ERR_SIZE];
+};
+
+static const uint32_t image_pad[IMAGE_PAD_WORDS] = {
+	[0 ... IMAGE_PAD_WORDS - 1] = 0xFFFFFFFF
+};
+
+static void flash_err(struct capi_flash *h, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(h->err, sizeof(h->err), fmt, ap);
+	va_end(ap);
+}
+
+static void image_err(struct capi_flash_image *img, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(img->err, sizeof(img->err), fmt, ap);
+	va_end(ap);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void flash_event(struct capi_flash *h, struct capi_flash_event *ev)
+{
+	if (h->event)
+		h->event(h, ev, h->event_arg);
+}
+
+static void flash_note(struct capi_flash *h, const char *fmt, ...)
+{
+	struct capi_flash_event ev = { .type = CAPI_FLASH_EV_NOTE };
+	char msg[ERR_SIZE];
+	va_list ap;
+
+	if (NULL == h->event)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	ev.msg = msg;
+	flash_event(h, &ev);
+}
+
+/* START and DONE events of an op, DONE carries its time and syscalls */
+struct flash_op {
+	enum capi_flash_op op;
+	struct capi_flash_image *img;
+	uint64_t ns;
+	unsigned long syscalls;
+	unsigned long sim_errors;	/* Words the simulator lost so far */
+	int block;		/* Passed on with DONE */
+};
+
+static unsigned long op_syscalls(struct flash_op *o)
+{
+	return cfg_stats()->syscalls + (o->img ? o->img->syscalls : 0);
+}
+
+static void op_start(struct capi_flash *h, struct flash_op *o,
+			enum capi_flash_op op, struct capi_flash_image *img)
+{
+	struct capi_flash_event ev = { .type = CAPI_FLASH_EV_START, .op = op };
+
+	o->op = op;
+	o->img = img;
+	o->block = 0;
+	o->syscalls = op_syscalls(o);
+	o->sim_errors = cfg_sim_errors(h->cfg);
+	o->ns = now_ns();
+	flash_event(h, &ev);
+}
+
+static int op_done(struct capi_flash *h, struct flash_op *o, int rc,
+			unsigned long words)
+{
+	struct capi_flash_event ev = {
+		.type = CAPI_FLASH_EV_DONE,
+		.op = o->op,
+		.block = o->block,
+		.rc = rc,
+		.ns = now_ns() - o->ns,
+		.words = words,
+		.syscalls = op_syscalls(o) - o->syscalls,
+	};
+	unsigned long lost = cfg_sim_errors(h->cfg) - o->sim_errors;
+
+	if (lost)
+		flash_note(h, "Simulated flash lost %lu words, flash protocol errors",
+			lost);
+	flash_event(h, &ev);
+	return rc;
+}
+
+/* Block done: progress event and the point to give up on cancel */
+static int flash_block_done(struct capi_flash *h, enum capi_flash_op op,
+			int block)
+{
+	struct capi_flash_event ev = {
+		.type = CAPI_FLASH_EV_BLOCK,
+		.op = op,
+		.block = block,
+	};
+
+	flash_event(h, &ev);
+	if (h->cancel) {
+		flash_err(h, "Canceled");
+		return FLASH_CANCELED;
+	}
+	return 0;
+}
+
+static int flash_reset(struct capi_flash *h)
+{
+	int rc;
+	rc = write_config_word(h->cfg, h->cntl_reg, 0);
+	return rc;
+}
+
+static void poll_record(struct capi_flash *h, enum poll_op op, uint64_t ns,
+			unsigned long polls, unsigned long sleeps)
+{
+	struct capi_flash_poll_stat *p = &h->poll[op];
+	uint64_t us = ns / 1000;
+	int b = 0;
+
+	while (us && b < CAPI_FLASH_POLL_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	p->waits++;
+	p->polls += polls;
+	p->sleeps += sleeps;
+	p->ns += ns;
+	if (ns > p->max_ns)
+		p->max_ns = ns;
+	p->bucket[b]++;
+}
+
+static void poll_sleep(unsigned us)
+{
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+	nanosleep(&ts, NULL);
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleep until this thread is back within the pacing limits */
+static void flash_pace(struct capi_flash *h)
+{
+	struct flash_pace *p = &h->pace;
+	unsigned long calls = cfg_stats()->syscalls;
+	uint64_t now, ns, want = 0, cpu;
+
+	if ((0 == p->rate && 0 == p->cpu_pct) || calls < p->next)
+		return;
+	now = now_ns();
+	if (0 == p->t0) {
+		p->t0 = now;
+		p->calls0 = calls;
+		p->cpu0 = thread_cpu_ns();
+	}
+	if (p->rate)
+		want = (calls - p->calls0) * 1000000000ULL / p->rate;
+	if (p->cpu_pct) {
+		cpu = (thread_cpu_ns() - p->cpu0) * 100 / p->cpu_pct;
+		if (cpu > want)
+			want = cpu;
+	}
+	ns = now - p->t0;
+	if (want > ns) {
+		poll_sleep((want - ns) / 1000);
+		poll_record(h, POLL_PACE, now_ns() - now, 0, 1);
+		now = now_ns();
+	}
+	if (now - p->t0 > PACE_WINDOW_NS) {
+		p->t0 = now;
+		p->calls0 = cfg_stats()->syscalls;
+		p->cpu0 = thread_cpu_ns();
+	}
+	p->next = cfg_stats()->syscalls + p->quantum;
+}
+
+static int flash_wait_op(struct capi_flash *h, int mask, int wait_cond,
+	unsigned timeout, enum poll_op op)
+{
+	const struct poll_policy *pp = &poll_policies[op];
+	struct capi_flash_event ev = { .type = CAPI_FLASH_EV_WAIT };
+	int rc = 0;
+	int config_word = 0x0;
+	unsigned long polls = 0, sleeps = 0;
+	unsigned spin = pp->spin;
+	unsigned sleep_us = pp->min_sleep_us;
+	uint64_t st, lt, ct;
+
+	flash_pace(h);
+	if (pp->max_sleep_us && (h->pace.rate || h->pace.cpu_pct))
+		spin = 1;
+	st = now_ns();
+	lt = st;
+
+	while (1) {
+		rc = read_config_word(h->cfg, h->cntl_reg, &config_word);
+		polls++;
+		if (0 != rc) {
+			flash_err(h, "read_config_word: 0x%x", h->cntl_reg);
+			return rc;
+		}
+		if (FLASH_CHECK_BIT(config_word, mask, wait_cond))
+			break;
+		if (polls < spin && (polls & 0x3ff))
+			continue;
+		if (h->cancel) {
+			flash_err(h, "Canceled");
+			return FLASH_CANCELED;
+		}
+		ct = now_ns();
+		if ((ct - lt) > 5000000000ULL) {
+			ev.ns = ct - st;
+			flash_event(h, &ev);
+			lt = ct;
+		}
+		if ((ct - st) > timeout * 1000000000ULL) {
+			flash_err(h, "Flash not ready after %d min (mask: 0x%x cond: 0x%x)",
+					timeout/60, mask, wait_cond);
+			return FLASH_READY_TIMEOUT;
+		}
+		if (polls >= spin) {
+			poll_sleep(sleep_us);
+			sleeps++;
+			sleep_us *= 2;
+			if (sleep_us > pp->max_sleep_us)
+				sleep_us = pp->max_sleep_us;
+		}
+	}
+	poll_record(h, op, now_ns() - st, polls, sleeps);
+	return 0;
+}
+
+static int flash_reset_wait(struct capi_flash *h)
+{
+	int rc;
+	// -------------------------------------------------------------------------------
+	// Reset Any Previously Aborted Sequences
+	// -------------------------------------------------------------------------------
+	rc = flash_reset(h);
+	if (0 != rc) {
+		flash_err(h, "Flash Reset, write_config_word: 0x%x",
+			h->cntl_reg);
+		return rc;
+	}
+	// -------------------------------------------------------------------------------
+	// Wait for Flash to be Ready
+	// -------------------------------------------------------------------------------
+	rc = flash_wait_op(h, FLASH_READY, FLASH_READY, 120, POLL_READY);
+	return rc;
+}
+
+static int flash_write(struct capi_flash *h, int data)
+{
+	int rc;
+	// ccw added
+	// -------------------------------------------------------------------------------
+	// Poll for flash port to be ready - offset 0x58 bit 12(LE) = 1 means busy
+	// -------------------------------------------------------------------------------
+	rc = flash_wait_op(h, FLASH_PORT_READY, 0x0, 30, POLL_PORT);
+	if (0 != rc)
+		return rc;
+	rc = write_config_word(h->cfg, h->data_reg, data);
+	if (0 != rc)
+		flash_err(h, "write_config_word: 0x%x", h->data_reg);
+	return rc;
+}
+
+/*
+ * Write ADDR, SIZE and CNTL to start a flash operation. The registers
+ * are adjacent in both VSEC layouts, which takes a single pwrite().
+ */
+static int flash_setup_op(struct capi_flash *h, int address, int size,
+			int cntl)
+{
+	int regs[3] = { address, size, cntl };
+	int rc;
+
+	if (h->size_reg == h->addr_reg + 4 && h->cntl_reg == h->size_reg + 4)
+		rc = write_config_words(h->cfg, h->addr_reg, regs, 3);
+	else {
+		rc = write_config_word(h->cfg, h->addr_reg, address);
+		if (0 == rc)
+			rc = write_config_word(h->cfg, h->size_reg, size);
+		if (0 == rc)
+			rc = write_config_word(h->cfg, h->cntl_reg, cntl);
+	}
+	if (0 != rc)
+		flash_err(h, "Can not start flash operation 0x%x @ 0x%x", cntl,
+			address);
+	return rc;
+}
+
+//# -------------------------------------------------------------------------------
+//# Setup for Program From Flash
+//# -------------------------------------------------------------------------------
+static int flash_erase(struct capi_flash *h, int address, int num_blocks)
+{
+	int rc;
+
+	/* Set Address Reg, size of transfer to flash in blocks and
+	   send program request to flash */
+	rc = flash_setup_op(h, address, num_blocks, FLASH_PROG_REQ);
+	if (0 != rc)
+		return rc;
+	//# -------------------------------------------------------------------------------
+	//# Wait for Flash Erase to complete.
+	//# -------------------------------------------------------------------------------
+	rc = flash_wait_op(h, FLASH_ERASE_STATUS | FLASH_PROG_STATUS,
+		FLASH_PROG_STATUS, 240, POLL_ERASE);
+	return rc;
+}
+
+/* Search vsec_offset and config_word in PCI Extended Capabilities */
+static int search_capi_vsec(struct capi_flash *h, int *rc_vsec_offset,
+			int *rc_config_word)
+{
+	int rc = 0;
+	// Search PCI Extended Capabilities list for CAPI VSEC offset
+	int next_ecap = PCI_ECAP, ecap_offset = PCI_ECAP;
+	int config_word = 0x0;
+	int ecap[2];
+	*rc_vsec_offset = 0;   /* Set to some invalid address */
+	*rc_config_word = 0;
+
+	while (next_ecap != 0x0) {
+		// Read ecap header together with the vsec length/revision/ID
+		rc = read_config_words(h->cfg, ecap_offset, ecap, 2);
+		if (0 != rc) {
+			flash_err(h, "Can not Read ecap_offset1 @0x%x",
+				ecap_offset);
+			return rc;
+		}
+		config_word = ecap[0];
+		next_ecap = ECAP_NEXT(config_word);
+		if ( ECAP_ID(config_word) == ECAP_VSEC ) {
+				config_word = ecap[1];
+				if (VSEC_ID(config_word) == CAPI_VSECID) {
+					*rc_vsec_offset = ecap_offset;
+					*rc_config_word = config_word;
+					return 0;   /* Found */
+				}
+		}
+		ecap_offset = next_ecap;
+	}
+	flash_err(h, "Unable to find CAPI VSEC");
+	return ENODEV;
+}
+
+/* Set Read Address */
+static int flash_set_read_addr(struct capi_flash *h, int raddress, int r_size)
+{
+	int rc;
+
+	rc = flash_reset_wait(h);
+	if (0 != rc)
+		return rc;
+	//# -------------------------------------------------------------------------------
+	//# Setup for Reading From Flash
+	//# -------------------------------------------------------------------------------
+	// Set read address, read size in words and request the read
+	rc = flash_setup_op(h, raddress, r_size -1, FLASH_READ_REQ);
+	return rc;
+}
+
+/*
+ * Remain counter polling, tuned from the waits seen so far. Most words
+ * are there at the first poll. A word that is not spins for twice the
+ * average number of polls, after that the wait is bounded by time: 64
+ * times the slowest wait seen, but at least READ_WAIT_MIN_NS.
+ */
+struct read_tune {
+	unsigned long waits;
+	unsigned long polls;
+	uint64_t max_ns;
+};
+
+#define READ_WAIT_MIN_NS	1000000ULL		/* 1 ms */
+#define READ_WAIT_MAX_NS	1000000000ULL		/* 1 s */
+
+/*
+ * poll control register until data count matches expected value
+ * if data register is read too soon, previous data value will be
+ * captured and remaining data is then shifted
+ */
+static int flash_wait_ready(struct capi_flash *h, int cntl_remain,
+			struct read_tune *t)
+{
+	int rc = 0;
+	int data;
+	unsigned long polls = 0;
+	unsigned long spin = 2 * (t->polls / (t->waits + 1)) + 2;
+	uint64_t limit = t->max_ns * 64;
+	uint64_t st = 0, ns = 0;
+
+	flash_pace(h);
+	if (limit < READ_WAIT_MIN_NS)
+		limit = READ_WAIT_MIN_NS;
+	if (limit > READ_WAIT_MAX_NS)
+		limit = READ_WAIT_MAX_NS;
+	while (1) {
+		rc = read_config_word(h->cfg, h->cntl_reg, &data);
+		polls++;
+		if (0 != rc) {
+			flash_err(h, "read_config_word: 0x%x", h->cntl_reg);
+			return rc;
+		}
+		if (cntl_remain == (data & FLASH_REMAIN_MASK))
+			break;
+		if (1 == polls)
+			st = now_ns();
+		if (polls < spin)
+			continue;
+		ns = now_ns() - st;
+		if (ns > limit) {
+			flash_err(h, "CNTL remain 0x%x not reached after %lu polls, %lu us (0x%x)",
+				cntl_remain, polls, (unsigned long)(ns / 1000), data);
+			return FLASH_READY_TIMEOUT;
+		}
+	}
+	if (st)
+		ns = now_ns() - st;
+	t->waits++;
+	t->polls += polls;
+	if (ns > t->max_ns)
+		t->max_ns = ns;
+	poll_record(h, POLL_REMAIN, ns, polls, 0);
+	return 0;
+}
+
+/* Flash address of a block, bytes for SPI and 4B words for BPIx16 */
+static int flash_block_addr(struct capi_flash *h, int address, int block)
+{
+	if (h->is_SPI)
+		return address + block * h->block_words * 4;
+	return address + block * h->block_words;
+}
+
+/* Library addresses are bytes, BPIx16 takes 4B word addresses */
+static int flash_addr(struct capi_flash *h, uint32_t address)
+{
+	if (h->is_SPI)
+		return address;
+	return address >> 2;
+}
+
+/*
+ * Sequential flash read. BPIx16 sets up a read window every
+ * h->read_window words and polls the remain counter, SPI reads
+ * out serially after a single READ_REQ.
+ */
+struct flash_reader {
+	struct capi_flash *h;
+	int raddress;
+	int cntl_remain;
+	int count;
+	int window;		/* Words left in the current read window */
+	struct read_tune tune;
+};
+
+static int flash_read_start(struct flash_reader *r, struct capi_flash *h,
+			int address)
+{
+	int rc;
+
+	r->h = h;
+	r->raddress = address;
+	r->cntl_remain = 0;
+	r->count = 0;
+	r->window = 0;
+	memset(&r->tune, 0, sizeof(r->tune));
+	if (!h->is_SPI)
+		return 0;
+	//SPI needs to send a READ_REQ at the beginning.
+	rc = write_config_word(h->cfg, h->addr_reg, address);
+	if (0 == rc)
+		rc = write_config_word(h->cfg, h->cntl_reg, FLASH_READ_REQ);
+	if (0 != rc)
+		flash_err(h, "Can not start read @ 0x%x", address);
+	return rc;
+}
+
+/* Read next word, ma returns its flash address */
+static int flash_read_next(struct flash_reader *r, int *dat, int *ma)
+{
+	struct capi_flash *h = r->h;
+	int rc;
+
+	//----------------------------------------
+	//The way to check Flash ready is different
+	if (h->is_SPI) {
+		//----------------------------------------
+		// For SPI
+		// Data is read out serially
+		rc = flash_wait_op(h, FLASH_RDATA_VALID, FLASH_RDATA_VALID, 30,
+				POLL_RDATA);
+		if (0 != rc)
+			return rc;
+		*ma = r->raddress;
+		r->raddress += 4;
+	} else {
+		// For BPIx16
+		// At read window size.
+		if (0 == r->window) {
+			rc = flash_set_read_addr(h, r->raddress, h->read_window);
+			if (0 != rc)
+				return rc;
+			r->window = h->read_window;
+			r->cntl_remain = h->read_window -1;
+		}
+		r->cntl_remain = (r->cntl_remain - 1) & FLASH_REMAIN_MASK;
+		rc = flash_wait_ready(h, r->cntl_remain, &r->tune);
+		if (0 != rc)
+			return rc;
+		*ma = r->raddress;
+		r->raddress++;
+		r->window--;
+	}
+	// Read data from flash
+	rc = read_config_word(h->cfg, h->data_reg, dat);
+	if (0 != rc)
+		flash_err(h, "read_config_word: 0x%x", h->data_reg);
+	r->count++;
+	return rc;
+}
+
+/* Stop the decompressor, a close pipe makes it exit on SIGPIPE */
+static int image_stream_stop(struct capi_flash_image *img)
+{
+	int status = 0;
+
+	if (img->fd >= 0)
+		close(img->fd);
+	img->fd = -1;
+	if (img->pid > 0)
+		waitpid(img->pid, &status, 0);
+	img->pid = 0;
+	return status;
+}
+
+/* (Re)start decoding the compressed file from its beginning */
+static int image_stream_start(struct capi_flash_image *img)
+{
+	int fds[2];
+
+	image_stream_stop(img);
+	if (0 != pipe2(fds, O_CLOEXEC)) {
+		image_err(img, "pipe: %s", strerror(errno));
+		return EIO;
+	}
+	img->syscalls++;
+	img->pid = fork();
+	if (img->pid < 0) {
+		image_err(img, "fork: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return EIO;
+	}
+	if (0 == img->pid) {
+		/* dup2() clears close-on-exec of stdout. Nothing to report
+		   from here, the parent sees the exit code. */
+		dup2(fds[1], STDOUT_FILENO);
+		execlp(img->codec->tool, img->codec->tool, "-dc", img->path,
+			(char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	img->fd = fds[0];
+	img->stream_pos = 0;
+	return 0;
+}
+
+/* read() until len bytes or end of stream */
+static ssize_t image_stream_read(struct capi_flash_image *img, void *buf,
+			size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		img->syscalls++;
+		n = read(img->fd, (char *)buf + got, len - got);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n < 0)
+			return -1;
+		if (0 == n)
+			break;
+		got += n;
+	}
+	return got;
+}
+
+/*
+ * A stream of unknown size ended at byte end. The decompressor must have
+ * exited cleanly for the size to count.
+ */
+static int image_stream_end(struct capi_flash_image *img, uint64_t end)
+{
+	if (img->codec && 0 != image_stream_stop(img)) {
+		image_err(img, "Can not decompress %s with %s", img->path,
+			img->codec->tool);
+		return EIO;
+	}
+	img->size = end;
+	img->words = (end + 3) / 4;
+	img->size_known = true;
+	return 0;
+}
+
+static const struct image_codec *image_codec(struct capi_flash_image *img)
+{
+	unsigned char magic[6];
+	ssize_t n;
+	unsigned i;
+
+	img->syscalls++;
+	n = pread(img->fd, magic, sizeof(magic), 0);
+	for (i = 0; i < sizeof(image_codecs) / sizeof(image_codecs[0]); i++)
+		if (n >= image_codecs[i].magic_len &&
+		    0 == memcmp(magic, image_codecs[i].magic,
+				image_codecs[i].magic_len))
+			return &image_codecs[i];
+	return NULL;
+}
+
+static int image_alloc_buf(struct capi_flash_image *img)
+{
+	if (0 == posix_memalign((void **)&img->buf, 4096, IMAGE_BUF_SIZE))
+		return 0;
+	img->buf = NULL;
+	image_err(img, "Can not allocate image buffer");
+	return ENOMEM;
+}
+
+static int image_open(struct capi_flash_image *img, const char *path)
+{
+	struct stat st;
+	void *map;
+
+	img->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (img->fd < 0) {
+		image_err(img, "Can not open %s: %s", path, strerror(errno));
+		return ENOENT;
+	}
+	if (fstat(img->fd, &st) != 0) {
+		image_err(img, "Cannot determine size of %s: %s", path,
+			strerror(errno));
+		return EINVAL;
+	}
+	if (S_ISREG(st.st_mode))
+		img->codec = image_codec(img);
+	if (img->codec) {
+		close(img->fd);
+		img->fd = -1;
+		return image_alloc_buf(img);
+	}
+	img->size_known = true;
+	/* Block devices report their size through lseek only */
+	img->size = S_ISREG(st.st_mode) ? st.st_size :
+		lseek(img->fd, 0, SEEK_END);
+	if (img->size < 0) {
+		image_err(img, "%s is not seekable", path);
+		return EINVAL;
+	}
+
+	if (S_ISREG(st.st_mode) && img->size > 0) {
+		img->syscalls++;
+		map = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+		if (MAP_FAILED != map) {
+			img->map = map;
+			madvise(map, img->size, MADV_SEQUENTIAL);
+			return 0;
+		}
+	}
+	return image_alloc_buf(img);
+}
+
+/* Decoder input: the file, mapped, read or from the decompressor */
+static ssize_t image_raw_read(void *arg, void *buf, size_t len)
+{
+	struct capi_flash_image *img = arg;
+	ssize_t n;
+
+	if (img->codec)
+		n = image_stream_read(img, buf, len);
+	else if (img->map) {
+		n = (uint64_t)img->raw_size - img->raw_pos < len ?
+			(uint64_t)img->raw_size - img->raw_pos : len;
+		memcpy(buf, (char *)img->map + img->raw_pos, n);
+	} else {
+		do {
+			img->syscalls++;
+			n = pread(img->fd, buf, len, img->raw_pos);
+		} while (n < 0 && EINTR == errno);
+	}
+	if (n > 0)
+		img->raw_pos += n;
+	return n;
+}
+
+static int image_raw_rewind(struct capi_flash_image *img)
+{
+	img->raw_pos = 0;
+	return img->codec ? image_stream_start(img) : 0;
+}
+
+static int image_decode_start(struct capi_flash_image *img, int half)
+{
+	int rc;
+
+	rc = image_raw_rewind(img);
+	if (0 != rc)
+		return rc;
+	rc = decode_start(img->dec, img->format, half, image_raw_read, img);
+	if (0 != rc)
+		image_err(img, "%s: %s", img->path, img->dec->err);
+	return rc;
+}
+
+/*
+ * Tell the format by the first bytes and set up its decoder. The image
+ * size is what the decoder hands out, .mcs files are decoded once to
+ * learn it.
+ */
+static int image_decode_open(struct capi_flash_image *img, int half)
+{
+	unsigned char head[16];
+	uint64_t size = 0;
+	ssize_t n;
+	int rc;
+
+	rc = image_raw_rewind(img);
+	if (0 != rc)
+		return rc;
+	n = image_raw_read(img, head, sizeof(head));
+	if (img->codec)
+		image_stream_stop(img);	/* The raw path starts it again */
+	if (n < 0) {
+		image_err(img, "Can not read %s: %s", img->path,
+			strerror(errno));
+		return EIO;
+	}
+	img->format = decode_format(head, n);
+	if (DECODE_BIN == img->format && DECODE_WHOLE == half)
+		return 0;
+	if (DECODE_BIN != img->format)
+		img->size_known = true;
+	img->dec = malloc(sizeof(*img->dec));
+	if (NULL == img->dec || (NULL == img->buf && 0 != image_alloc_buf(img))) {
+		image_err(img, "Can not allocate image decoder");
+		return ENOMEM;
+	}
+	rc = image_decode_start(img, half);
+	if (0 != rc)
+		return rc;
+	if (DECODE_BIT == img->format)
+		size = img->dec->bit_len;
+	else if (DECODE_BIN == img->format)
+		size = img->raw_size;
+	if (size && DECODE_WHOLE != half)
+		size = (size + 1) / 2;
+	if (DECODE_MCS == img->format) {
+		do {
+			n = decode_read(img->dec, img->buf, IMAGE_BUF_SIZE);
+			if (n > 0)
+				size += n;
+		} while (n == IMAGE_BUF_SIZE);
+		if (n < 0) {
+			image_err(img, "%s: %s", img->path, img->dec->err);
+			return EINVAL;
+		}
+	}
+	img->size = size;
+	return 0;
+}
+
+int capi_flash_image_open(struct capi_flash_image **imgp, const char *path)
+{
+	return capi_flash_image_open_half(imgp, path, CAPI_FLASH_IMAGE_WHOLE);
+}
+
+int capi_flash_image_open_half(struct capi_flash_image **imgp,
+			const char *path, enum capi_flash_image_half half)
+{
+	struct capi_flash_image *img;
+	int rc;
+
+	*imgp = NULL;
+	img = calloc(1, sizeof(*img));
+	if (NULL == img)
+		return ENOMEM;
+	img->fd = -1;
+	img->path = strdup(path);
+	if (NULL == img->path) {
+		free(img);
+		return ENOMEM;
+	}
+	rc = image_open(img, path);
+	if (0 == rc) {
+		img->raw_size = img->size;
+		rc = image_decode_open(img, half);
+	}
+	if (0 == rc) {
+		img->words = img->size_known ? (uint64_t)(img->size + 3) / 4 :
+			UINT64_MAX;
+		if (img->map && !img->dec && img->size % 4) {
+			img->tail = 0xFFFFFFFF;
+			memcpy(&img->tail, (char *)img->map + img->size / 4 * 4,
+				img->size % 4);
+		}
+	}
+	*imgp = img;
+	return rc;
+}
+
+/*
+ * Image from memory, used in place. A partial last word is copied to
+ * tail like for a mapped file.
+ */
+int capi_flash_image_buffer(struct capi_flash_image **imgp, const void *buf,
+			size_t len)
+{
+	struct capi_flash_image *img;
+
+	*imgp = NULL;
+	img = calloc(1, sizeof(*img));
+	if (NULL == img)
+		return ENOMEM;
+	img->fd = -1;
+	img->user = buf;
+	img->size = img->raw_size = len;
+	img->size_known = true;
+	img->words = (len + 3) / 4;
+	if (len % 4) {
+		img->tail = 0xFFFFFFFF;
+		memcpy(&img->tail, (const char *)buf + len / 4 * 4, len % 4);
+	}
+	*imgp = img;
+	return 0;
+}
+
+const char *capi_flash_image_codec(struct capi_flash_image *img)
+{
+	return img->codec ? img->codec->tool : NULL;
+}
+
+const char *capi_flash_image_format(struct capi_flash_image *img)
+{
+	return decode_name(img->format);
+}
+
+const char *capi_flash_image_error(struct capi_flash_image *img)
+{
+	return img->err;
+}
+
+unsigned long capi_flash_image_syscalls(struct capi_flash_image *img)
+{
+	return img->syscalls;
+}
+
+void capi_flash_image_close(struct capi_flash_image *img)
+{
+	if (NULL == img)
+		return;
+	if (img->map)
+		munmap(img->map, img->raw_size);
+	free(img->buf);
+	free(img->dec);
+	if (img->codec)
+		image_stream_stop(img);
+	else if (img->fd >= 0)
+		close(img->fd);
+	free(img->path);
+	free(img);
+}
+
+/* Position the image at word offset pos */
+static void image_seek(struct capi_flash_image *img, uint64_t pos)
+{
+	img->pos = pos;
+}
+
+/* image_fill() through the decoder, which starts over to go back */
+static int image_fill_decoded(struct capi_flash_image *img)
+{
+	uint64_t off = img->pos * 4, want = IMAGE_BUF_SIZE, skip;
+	ssize_t n;
+	int rc;
+
+	if (off < img->dec->out) {
+		rc = image_decode_start(img, img->dec->half);
+		if (0 != rc)
+			return rc;
+	}
+	while (img->dec->out < off) {
+		skip = off - img->dec->out < IMAGE_BUF_SIZE ?
+			off - img->dec->out : IMAGE_BUF_SIZE;
+		n = decode_read(img->dec, img->buf, skip);
+		if (n != (ssize_t)skip)
+			goto __error;
+	}
+	if (img->size_known && img->size - off < want)
+		want = img->size - off;
+	n = decode_read(img->dec, img->buf, want);
+	if (!img->size_known && n >= 0 && n < (ssize_t)want &&
+	    !img->dec->err[0]) {
+		want = n;
+		rc = image_stream_end(img, off + n);
+		if (0 != rc)
+			return rc;
+	}
+	if (n != (ssize_t)want)
+		goto __error;
+	memset((char *)img->buf + want, 0xFF, (4 - want % 4) % 4);
+	img->buf_pos = img->pos;
+	img->buf_len = (want + 3) / 4;
+	return 0;
+ __error:
+	image_err(img, "%s: %s", img->path, img->dec->err[0] ?
+		img->dec->err : "image ends early");
+	return EIO;
+}
+
+/* Fill the read buffer at img->pos, padding a partial last word */
+static int image_fill(struct capi_flash_image *img)
+{
+	uint64_t want = IMAGE_BUF_SIZE;
+	off_t off = img->pos * 4;
+	ssize_t n;
+	size_t got = 0;
+
+	if (img->dec)
+		return image_fill_decoded(img);
+	if (img->size_known && (uint64_t)(img->size - off) < want)
+		want = img->size - off;
+	if (img->codec) {
+		int rc = 0;
+
+		/* Pipes only go forward, skip or decode again from the start */
+		if (img->pos < img->stream_pos || img->fd < 0)
+			rc = image_stream_start(img);
+		while (0 == rc && img->stream_pos < img->pos) {
+			uint64_t skip = (img->pos - img->stream_pos) * 4;
+
+			if (skip > IMAGE_BUF_SIZE)
+				skip = IMAGE_BUF_SIZE;
+			if (image_stream_read(img, img->buf, skip) != (ssize_t)skip)
+				rc = EIO;
+			img->stream_pos += skip / 4;
+		}
+		if (0 == rc) {
+			n = image_stream_read(img, img->buf, want);
+			if (!img->size_known && n >= 0 && n < (ssize_t)want) {
+				want = n;
+				rc = image_stream_end(img, off + n);
+				if (0 != rc)
+					return rc;
+			}
+			if (n != (ssize_t)want)
+				rc = EIO;
+		}
+		if (0 != rc) {
+			image_err(img, "Short read from %s @ 0x%llx", img->path,
+				(unsigned long long)off);
+			return rc;
+		}
+		got = want;
+		img->stream_pos += (want + 3) / 4;
+	}
+	while (got < want) {
+		img->syscalls++;
+		n = pread(img->fd, (char *)img->buf + got, want - got, off + got);
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0) {
+			image_err(img, "Short read from image @ 0x%llx",
+				(unsigned long long)(off + got));
+			return EIO;
+		}
+		got += n;
+	}
+	memset((char *)img->buf + got, 0xFF, (4 - got % 4) % 4);
+	img->buf_pos = img->pos;
+	img->buf_len = (got + 3) / 4;
+	return 0;
+}
+
+/*
+ * Hand out the next up to max words at *words. Returns the number of
+ * words, which is never 0 for max > 0, or a negative error.
+ */
+static long image_next(struct capi_flash_image *img, const uint32_t **words,
+			uint64_t max)
+{
+	const uint32_t *mem = img->dec ? NULL :
+		img->map ? img->map : img->user;
+	uint64_t n;
+
+	/* A stream of unknown size may end in the buffer it fills */
+	if (NULL == mem && img->pos < img->words &&
+	    (img->pos < img->buf_pos ||
+	     img->pos >= img->buf_pos + img->buf_len)) {
+		int rc = image_fill(img);
+
+		if (0 != rc)
+			return -rc;
+	}
+	if (img->pos >= img->words) {
+		n = IMAGE_PAD_WORDS;		/* Past the end: erased flash */
+		*words = image_pad;
+	} else if (mem) {
+		n = img->size / 4 - img->pos;
+		*words = mem + img->pos;
+		if (0 == n) {
+			n = 1;
+			*words = &img->tail;
+		}
+	} else {
+		n = img->buf_pos + img->buf_len - img->pos;
+		*words = img->buf + (img->pos - img->buf_pos);
+	}
+	if (n > max)
+		n = max;
+	img->pos += n;
+	return n;
+}
+
+/*
+ * Erased flash check, 16 bytes at a time with the compiler's generic
+ * vectors (VSX on POWER, SSE on x86). Any alignment.
+ */
+typedef uint32_t erased_vec __attribute__((vector_size(16)));
+
+static bool words_erased(const uint32_t *w, uint64_t n)
+{
+	erased_vec acc = { ~0U, ~0U, ~0U, ~0U }, v;
+	uint32_t tail = ~0U;
+	uint64_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		memcpy(&v, w + i, sizeof(v));
+		acc &= v;
+	}
+	for (; i < n; i++)
+		tail &= w[i];
+	return (acc[0] & acc[1] & acc[2] & acc[3] & tail) == ~0U;
+}
+
+/* Offset past the last word of w[0..n) which is not erased, 0 if none */
+static uint64_t words_used(const uint32_t *w, uint64_t n)
+{
+	while (n && 0xFFFFFFFF == w[n - 1])
+		n--;
+	return n;
+}
+
+/*
+ * Bytes of the image up to its trailing erased (0xFF) padding. Images
+ * in memory are scanned backwards from the end, so only the padding is
+ * looked at. Streams are read once from the start, as they can not
+ * seek back cheaply.
+ */
+#define PAYLOAD_SCAN_WORDS	4096
+
+static int image_payload(struct capi_flash_image *img, uint64_t *bytes)
+{
+	const uint32_t *w;
+	uint64_t end = img->words, start, pos, used = 0;
+	long n;
+
+	if (img->payload_known) {
+		*bytes = img->payload;
+		return 0;
+	}
+	if (img->dec || (NULL == img->map && NULL == img->user)) {
+		for (image_seek(img, 0); img->pos < img->words; ) {
+			pos = img->pos;
+			n = image_next(img, &w, img->words - pos);
+			if (n < 0)
+				return -n;
+			if (!words_erased(w, n))
+				used = pos + words_used(w, n);
+		}
+	} else {
+		/* Chunks from the end until one is not erased */
+		while (0 == used && end > 0) {
+			start = end > PAYLOAD_SCAN_WORDS ?
+				end - PAYLOAD_SCAN_WORDS : 0;
+			for (image_seek(img, start); img->pos < end; ) {
+				pos = img->pos;
+				n = image_next(img, &w, end - pos);
+				if (n < 0)
+					return -n;
+				if (!words_erased(w, n))
+					used = pos + words_used(w, n);
+			}
+			end = start;
+		}
+	}
+	image_seek(img, 0);
+	img->payload = used * 4 < (uint64_t)img->size ? used * 4 :
+		(uint64_t)img->size;
+	img->payload_known = true;
+	*bytes = img->payload;
+	return 0;
+}
+
+/*
+ * Learn the size of a stream which was not read to its end yet. The
+ * payload scan is that pass, so a trimmed op does not read it again.
+ */
+static int image_size(struct capi_flash_image *img)
+{
+	uint64_t bytes;
+
+	return img->size_known ? 0 : image_payload(img, &bytes);
+}
+
+uint64_t capi_flash_image_size(struct capi_flash_image *img)
+{
+	return 0 == image_size(img) ? img->size : 0;
+}
+
+/* capi_flash_blocks() of the image, passes an image error on to the card */
+static int flash_image_blocks(struct capi_flash *h,
+			struct capi_flash_image *img, int *nblocks)
+{
+	int rc = image_size(img);
+
+	if (0 != rc) {
+		flash_err(h, "%s", img->err);
+		return rc;
+	}
+	*nblocks = capi_flash_blocks(h, img->size);
+	return 0;
+}
+
+/* image_next() for the flash ops, passes an image error on to the card */
+static long flash_image_next(struct capi_flash *h, struct capi_flash_image *img,
+			const uint32_t **words, uint64_t max)
+{
+	long n = image_next(img, words, max);
+
+	if (n < 0)
+		flash_err(h, "%s", img->err);
+	return n;
+}
+
+/*
+ * Streaming write: poll port ready once per burst of h->credits words
+ * and push the burst without handshake. A stalled burst switches back to
+ * the per word handshake for the rest of the run.
+ */
+static int flash_write_stream(struct capi_flash *h, int data, int *credit)
+{
+	unsigned long polls;
+	int rc;
+
+	if (0 == *credit) {
+		polls = h->poll[POLL_PORT].polls;
+		rc = flash_wait_op(h, FLASH_PORT_READY, 0x0, 30, POLL_PORT);
+		if (0 != rc)
+			return rc;
+		if (h->poll[POLL_PORT].polls - polls >
+		    PORT_STALL_POLLS(h->credits)) {
+			flash_note(h, "Write port stalled, using per word handshake");
+			h->credits = 0;
+		}
+		*credit = h->credits;
+	}
+	(*credit)--;
+	rc = write_config_word(h->cfg, h->data_reg, data);
+	if (0 != rc)
+		flash_err(h, "write_config_word: 0x%x", h->data_reg);
+	return rc;
+}
+
+/* Stream nwords from the image to the flash write port */
+static int flash_program_words(struct capi_flash *h,
+			struct capi_flash_image *img, int nwords, int *bc)
+{
+	const uint32_t *w;
+	long n, j;
+	int i = 0, rc, credit = 0;
+
+	while (i < nwords) {
+		n = flash_image_next(h, img, &w, nwords - i);
+		if (n < 0)
+			return -n;
+		for (j = 0; j < n; j++, i++) {
+			if (h->credits > 1)
+				rc = flash_write_stream(h, w[j], &credit);
+			else
+				rc = flash_write(h, w[j]);
+			if (0 != rc)
+				return rc;
+			if (((i+1) % h->block_words) == 0) {
+				rc = flash_block_done(h, CAPI_FLASH_OP_PROGRAM,
+						*bc);
+				if (0 != rc)
+					return rc;
+				(*bc)++;
+			}
+		}
+	}
+	return 0;
+}
+
+static inline void map_set(uint8_t *map, int b)
+{
+	map[b / 8] |= 1 << (b % 8);
+}
+
+static inline void map_clear(uint8_t *map, int b)
+{
+	map[b / 8] &= ~(1 << (b % 8));
+}
+
+/* Length of the run of blocks from b on which are set in the map */
+static int map_run(const uint8_t *map, int b, int nblocks)
+{
+	int n;
+
+	for (n = 0; b + n < nblocks && CAPI_FLASH_MAP_TEST(map, b + n); n++)
+		;
+	return n;
+}
+
+/*
+ * Compare nwords of flash at address against the image. Blocks with a
+ * miscompare are set in map, if there is one.
+ */
+static int flash_verify_words(struct capi_flash *h,
+			struct capi_flash_image *img, int address, int nwords,
+			int *bc, unsigned long *ndiff, uint8_t *map)
+{
+	struct capi_flash_event ev = { .type = CAPI_FLASH_EV_MISCOMPARE,
+				       .op = CAPI_FLASH_OP_VERIFY };
+	struct flash_reader r;
+	const uint32_t *w;
+	long n, j;
+	int i = 0, rc, dat, ma;
+
+	rc = flash_read_start(&r, h, address);
+	if (0 != rc)
+		return rc;
+	while (i < nwords) {
+		n = flash_image_next(h, img, &w, nwords - i);
+		if (n < 0)
+			return -n;
+		for (j = 0; j < n; j++, i++) {
+			rc = flash_read_next(&r, &dat, &ma);
+			if (0 != rc)
+				return rc;
+			if ((int)w[j] != dat) {
+				ev.block = *bc;
+				ev.address = ma;
+				ev.data = dat;
+				ev.expected = w[j];
+				flash_event(h, &ev);
+				(*ndiff)++;
+				if (map)
+					map_set(map, *bc);
+			}
+			if (((i+1) % h->block_words) == 0) {
+				rc = flash_block_done(h, CAPI_FLASH_OP_VERIFY,
+						*bc);
+				if (0 != rc)
+					return rc;
+				(*bc)++;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Blocks of the image to program and verify: all of them, or with trim
+ * only up to the last one which is not erased flash. The blocks after
+ * it are only erased, which reads back the same as the 0xFF padding.
+ */
+static int flash_payload_blocks(struct capi_flash *h,
+			struct capi_flash_image *img, int *pblocks, bool note)
+{
+	uint64_t bytes = 0;
+	int nblocks, rc;
+
+	rc = flash_image_blocks(h, img, &nblocks);
+	if (0 != rc)
+		return rc;
+	*pblocks = nblocks;
+	if (!h->trim)
+		return 0;
+	rc = image_payload(img, &bytes);
+	if (0 != rc) {
+		flash_err(h, "%s", img->err);
+		return rc;
+	}
+	if (bytes)
+		*pblocks = (bytes - 1) / (h->block_words * 4) + 1;
+	else
+		*pblocks = 1;
+	if (*pblocks > nblocks)
+		*pblocks = nblocks;
+	if (note && *pblocks < nblocks)
+		flash_note(h, "Image is erased flash after %lu bytes, programming %d of %d blocks",
+			(unsigned long)bytes, *pblocks, nblocks);
+	return 0;
+}
+
+/*
+ * Erase only: start a program request and reset the controller once
+ * the erase is done, before any data.
+ */
+static int flash_erase_only(struct capi_flash *h, int address, int nblocks)
+{
+	int rc;
+
+	rc = flash_erase(h, address, nblocks - 1);
+	if (0 != rc)
+		return rc;
+	return flash_reset_wait(h);
+}
+
+/*
+ * Wait for FLASH_OP_DONE after the last of nwords program words. credits
+ * is what the program started with: a streamed program which times out
+ * is an overrun, the controller is reset and streaming is off for the
+ * rest of the run. FLASH_STREAM_OVERRUN then asks the caller to erase
+ * and program the blocks again.
+ */
+static int flash_program_done(struct capi_flash *h, int credits,
+			uint64_t nwords)
+{
+	uint64_t secs = STREAM_DONE_SECS +
+		nwords * STREAM_DONE_NS_WORD / 1000000000ULL;
+	int rc;
+
+	if (credits <= 1)
+		return flash_wait_op(h, FLASH_OP_DONE, FLASH_OP_DONE,
+				PROG_DONE_SECS, POLL_PROG);
+	if (secs > PROG_DONE_SECS)
+		secs = PROG_DONE_SECS;
+	rc = flash_wait_op(h, FLASH_OP_DONE, FLASH_OP_DONE, secs, POLL_PROG);
+	if (FLASH_READY_TIMEOUT != rc)
+		return rc;
+	flash_note(h, "Write port overran at %d words per poll, no FLASH_OP_DONE after %lu s, programming again with per word handshake",
+		credits, (unsigned long)secs);
+	h->credits = 0;
+	rc = flash_reset_wait(h);
+	return 0 == rc ? FLASH_STREAM_OVERRUN : rc;
+}
+
+/*
+ * Erase and program nblocks starting at block. The size register takes
+ * the number of blocks - 1, SPI needs 64 extra words to flush the port.
+ * Blocks from payload on are erased only.
+ */
+static int flash_program_blocks(struct capi_flash *h,
+			struct capi_flash_image *img, int address, int block,
+			int nblocks, int payload, int *bc)
+{
+	int rc, n = payload - block, bc0 = *bc, credits;
+
+	if (n < 0)
+		n = 0;
+	if (n < nblocks) {
+		rc = flash_erase_only(h, flash_block_addr(h, address,
+					block + n), nblocks - n);
+		if (0 != rc || 0 == n)
+			return rc;
+		nblocks = n;
+	}
+	do {
+		credits = h->credits;
+		*bc = bc0;
+		rc = flash_erase(h, flash_block_addr(h, address, block),
+				nblocks - 1);
+		if (0 != rc)
+			return rc;
+		image_seek(img, (uint64_t)block * h->block_words);
+		rc = flash_program_words(h, img, nblocks * h->block_words +
+				(h->is_SPI ? 64 : 0), bc);
+		if (0 == rc)
+			rc = flash_program_done(h, credits,
+					(uint64_t)nblocks * h->block_words);
+	} while (FLASH_STREAM_OVERRUN == rc);
+	if (0 != rc)
+		return rc;
+	return flash_reset_wait(h);
+}
+
+int capi_flash_blocks(struct capi_flash *h, uint64_t size)
+{
+	return size / (h->block_words * 4) + 1;
+}
+
+/*
+ * The partition's fingerprint goes before its first erase, whoever
+ * writes it. The front end records a new one after a clean verify.
+ */
+static int flash_fingerprint_drop(struct capi_flash *h, uint32_t address)
+{
+	int rc;
+
+	if (NULL == h->fp_path)
+		return 0;
+	rc = fingerprint_drop(h->fp_path, address);
+	if (0 != rc)
+		flash_err(h, "Can not update %s: %s", h->fp_path,
+			strerror(rc));
+	return rc;
+}
+
+int capi_flash_write(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img)
+{
+	struct flash_op o;
+	int flash_words, nblocks, pblocks, credits;
+	int bc = 0, rc;
+
+	rc = flash_image_blocks(h, img, &nblocks);
+	if (0 != rc)
+		return rc;
+	rc = flash_fingerprint_drop(h, address);
+	if (0 != rc)
+		return rc;
+	address = flash_addr(h, address);
+	rc = flash_payload_blocks(h, img, &pblocks, true);
+	if (0 != rc)
+		return rc;
+	flash_words = pblocks * h->block_words;
+	rc = flash_reset_wait(h);
+	if (0 != rc)
+		return rc;
+
+	//# -------------------------------------------------------------------------------
+	//# Erase Flash, the erased tail first and only that
+	//# -------------------------------------------------------------------------------
+	op_start(h, &o, CAPI_FLASH_OP_ERASE, img);
+	if (pblocks < nblocks)
+		rc = flash_erase_only(h, flash_block_addr(h, address, pblocks),
+				nblocks - pblocks);
+	if (0 == rc)
+		rc = flash_erase(h, address, pblocks - 1);
+	op_done(h, &o, rc, (unsigned long)nblocks * h->block_words);
+	if (0 != rc)
+		return rc;
+
+	//# -------------------------------------------------------------------------------
+	//# Program Flash
+	//# -------------------------------------------------------------------------------
+	//Need to add 64 for SPI device
+	//Otherwise stuck at waiting for FLASH_OP_DONE
+	op_start(h, &o, CAPI_FLASH_OP_PROGRAM, img);
+	image_seek(img, 0);
+	credits = h->credits;
+	rc = flash_program_words(h, img, flash_words + (h->is_SPI ? 64 : 0),
+			&bc);
+	//# -------------------------------------------------------------------------------
+	//# Wait for Flash Program to complete.
+	//# -------------------------------------------------------------------------------
+	if (0 == rc)
+		rc = flash_program_done(h, credits, flash_words);
+	//# -------------------------------------------------------------------------------
+	//# Reset and wait, or erase and program again after a port overrun
+	//# -------------------------------------------------------------------------------
+	if (0 == rc) {
+		rc = flash_reset_wait(h);
+	} else if (FLASH_STREAM_OVERRUN == rc) {
+		bc = 0;
+		rc = flash_program_blocks(h, img, address, 0, pblocks, pblocks,
+				&bc);
+	}
+	return op_done(h, &o, rc, flash_words + (h->is_SPI ? 64 : 0));
+}
+
+/*
+ * Resumable write: erase, program and verify segment blocks at a time
+ * from block *next on. A segment only counts once it verified; *next
+ * then moves past it and a COMMIT event tells the caller, who can
+ * record it and pass it back in after an interruption.
+ */
+int capi_flash_write_segments(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, int segment, int *next)
+{
+	struct capi_flash_event ev = { .type = CAPI_FLASH_EV_COMMIT,
+				       .op = CAPI_FLASH_OP_PROGRAM };
+	struct flash_op o;
+	unsigned long words = 0, ndiff;
+	int n, vn, nblocks, pblocks, bc, rc;
+
+	rc = flash_image_blocks(h, img, &nblocks);
+	if (0 != rc)
+		return rc;
+	if (segment < 1 || *next < 0 || *next > nblocks) {
+		flash_err(h, "Bad segment %d or start block %d of %d", segment,
+			*next, nblocks);
+		return EINVAL;
+	}
+	rc = flash_fingerprint_drop(h, address);
+	if (0 != rc)
+		return rc;
+	address = flash_addr(h, address);
+	rc = flash_payload_blocks(h, img, &pblocks, true);
+	if (0 != rc)
+		return rc;
+	op_start(h, &o, CAPI_FLASH_OP_PROGRAM, img);
+	rc = flash_reset_wait(h);
+	while (0 == rc && *next < nblocks) {
+		n = nblocks - *next < segment ? nblocks - *next : segment;
+		/* Blocks of the segment which are programmed and verified */
+		vn = pblocks - *next < n ? pblocks - *next : n;
+		if (vn < 0)
+			vn = 0;
+		bc = *next;
+		rc = flash_program_blocks(h, img, address, *next, n, pblocks,
+				&bc);
+		if (vn)
+			words += vn * h->block_words + (h->is_SPI ? 64 : 0);
+		if (0 != rc)
+			break;
+		ndiff = 0;
+		bc = *next;
+		image_seek(img, (uint64_t)*next * h->block_words);
+		if (vn)
+			rc = flash_verify_words(h, img,
+					flash_block_addr(h, address, *next),
+					vn * h->block_words, &bc, &ndiff, NULL);
+		if (0 == rc)
+			rc = flash_reset_wait(h);
+		if (0 == rc && ndiff) {
+			flash_err(h, "%lu words differ in blocks %d to %d",
+				ndiff, *next, *next + n - 1);
+			rc = FLASH_VERIFY_MISMATCH;
+		}
+		if (0 != rc)
+			break;
+		*next += n;
+		ev.block = *next;
+		flash_event(h, &ev);
+	}
+	return op_done(h, &o, rc, words);
+}
+
+int capi_flash_verify(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, unsigned long *ndiff)
+{
+	return capi_flash_verify_map(h, address, img, NULL, ndiff);
+}
+
+int capi_flash_verify_map(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, uint8_t *map,
+			unsigned long *ndiff)
+{
+	struct flash_op o;
+	int flash_words, pblocks;
+	int bc = 0, rc;
+
+	*ndiff = 0;
+	rc = flash_payload_blocks(h, img, &pblocks, false);
+	if (0 != rc)
+		return rc;
+	if (map)
+		memset(map, 0, CAPI_FLASH_MAP_BYTES(capi_flash_blocks(h,
+						img->size)));
+	flash_words = pblocks * h->block_words;
+	op_start(h, &o, CAPI_FLASH_OP_VERIFY, img);
+	image_seek(img, 0);   // Reset to beginning of file
+	rc = flash_verify_words(h, img, flash_addr(h, address), flash_words,
+			&bc, ndiff, map);
+	return op_done(h, &o, rc, flash_words);
+}
+
+/*
+ * Spot check: compare only the given blocks, in the order given, with
+ * the image. Ascending order keeps a compressed image from being
+ * decoded again for every block.
+ */
+int capi_flash_verify_blocks(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, const int *blocks, int n,
+			unsigned long *ndiff)
+{
+	struct flash_op o;
+	int i, nblocks, bc, rc;
+
+	*ndiff = 0;
+	rc = flash_image_blocks(h, img, &nblocks);
+	if (0 != rc)
+		return rc;
+	address = flash_addr(h, address);
+	op_start(h, &o, CAPI_FLASH_OP_VERIFY, img);
+	for (i = 0; 0 == rc && i < n; i++) {
+		if (blocks[i] < 0 || blocks[i] >= nblocks) {
+			flash_err(h, "Block %d is not in the image's %d blocks",
+				blocks[i], nblocks);
+			rc = EINVAL;
+			break;
+		}
+		bc = blocks[i];
+		image_seek(img, (uint64_t)bc * h->block_words);
+		rc = flash_reset_wait(h);
+		if (0 == rc)
+			rc = flash_verify_words(h, img,
+					flash_block_addr(h, address, bc),
+					h->block_words, &bc, ndiff, NULL);
+	}
+	if (0 == rc)
+		rc = flash_reset_wait(h);
+	return op_done(h, &o, rc, (unsigned long)i * h->block_words);
+}
+
+/*
+ * Erase and program the runs of blocks set in map, then verify them
+ * again. A block stays set in map only if it still differs; nmis counts
+ * its words. Used by delta and repair.
+ */
+static int flash_reprogram(struct capi_flash *h, struct capi_flash_image *img,
+			int address, uint8_t *map, int nblocks, int pblocks,
+			unsigned long *nmis)
+{
+	struct flash_op o;
+	unsigned long words = 0;
+	int b, n, vn, bc, rc = 0;
+
+	op_start(h, &o, CAPI_FLASH_OP_PROGRAM, img);
+	for (b = 0; 0 == rc && b < nblocks; b += n ? n : 1) {
+		n = map_run(map, b, nblocks);
+		if (0 == n)
+			continue;
+		bc = b;
+		rc = flash_program_blocks(h, img, address, b, n, pblocks, &bc);
+		if (b < pblocks)
+			words += (b + n < pblocks ? n : pblocks - b) *
+				h->block_words + (h->is_SPI ? 64 : 0);
+	}
+	op_done(h, &o, rc, words);
+	if (0 != rc)
+		return rc;
+
+	op_start(h, &o, CAPI_FLASH_OP_VERIFY, img);
+	words = 0;
+	for (b = 0; 0 == rc && b < nblocks; b += n ? n : 1) {
+		n = map_run(map, b, nblocks);
+		for (bc = b; bc < b + n; bc++)
+			map_clear(map, bc);
+		/* Blocks of the run which were programmed, the rest is
+		   erased and reads back as the image */
+		vn = b + n < pblocks ? n : pblocks - b;
+		if (vn <= 0)
+			continue;
+		bc = b;
+		image_seek(img, (uint64_t)b * h->block_words);
+		rc = flash_reset_wait(h);
+		if (0 == rc)
+			rc = flash_verify_words(h, img,
+					flash_block_addr(h, address, b),
+					vn * h->block_words, &bc, nmis, map);
+		words += vn * h->block_words;
+	}
+	if (0 == rc)
+		rc = flash_reset_wait(h);
+	return op_done(h, &o, rc, words);
+}
+
+/*
+ * Delta flashing: read back nblocks of the partition, compare them with
+ * the image and erase/program only the runs of blocks which differ.
+ * The reprogrammed blocks are verified again afterwards.
+ */
+int capi_flash_delta(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, int *ndiff)
+{
+	unsigned long nmis;
+
+	return capi_flash_delta_map(h, address, img, NULL, ndiff, &nmis);
+}
+
+int capi_flash_delta_map(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, uint8_t *map, int *ndiff,
+			unsigned long *nmis)
+{
+	struct flash_reader r;
+	struct flash_op o;
+	const uint32_t *w = NULL;
+	uint8_t *diff = NULL;
+	long n = 0;
+	int b, i, rc, dat, ma, nblocks, pblocks;
+	uint32_t part = address;
+	bool differs;
+
+	*ndiff = 0;
+	*nmis = 0;
+	rc = flash_image_blocks(h, img, &nblocks);
+	if (0 != rc)
+		return rc;
+	if (map)
+		memset(map, 0, CAPI_FLASH_MAP_BYTES(nblocks));
+	address = flash_addr(h, address);
+	rc = flash_payload_blocks(h, img, &pblocks, false);
+	if (0 != rc)
+		return rc;
+	diff = map ? map : calloc(CAPI_FLASH_MAP_BYTES(nblocks), 1);
+	if (NULL == diff) {
+		flash_err(h, "Out of memory");
+		return ENOMEM;
+	}
+
+	op_start(h, &o, CAPI_FLASH_OP_COMPARE, img);
+	image_seek(img, 0);
+	rc = flash_reset_wait(h);
+	if (0 == rc)
+		rc = flash_read_start(&r, h, address);
+	for (b = 0; 0 == rc && b < nblocks; b++) {
+		differs = false;
+		for (i = 0; i < h->block_words; i++, w++, n--) {
+			if (0 == n) {
+				n = flash_image_next(h, img, &w,
+						h->block_words - i);
+				if (n < 0) {
+					rc = -n;
+					break;
+				}
+			}
+			rc = flash_read_next(&r, &dat, &ma);
+			if (0 != rc)
+				break;
+			if ((int)*w != dat)
+				differs = true;
+		}
+		if (0 != rc)
+			break;
+		if (differs) {
+			map_set(diff, b);
+			flash_note(h, "Block %d differs @ 0x%08x", b,
+				flash_block_addr(h, address, b));
+			(*ndiff)++;
+		}
+		rc = flash_block_done(h, CAPI_FLASH_OP_COMPARE, b);
+	}
+	if (0 == rc)
+		rc = flash_reset_wait(h);
+	o.block = *ndiff;
+	op_done(h, &o, rc, (unsigned long)nblocks * h->block_words);
+	if (0 == rc && *ndiff)
+		rc = flash_fingerprint_drop(h, part);
+	if (0 == rc && *ndiff)
+		rc = flash_reprogram(h, img, address, diff, nblocks, pblocks,
+				nmis);
+	if (0 == rc && *nmis) {
+		flash_err(h, "%lu words still differ after the delta", *nmis);
+		rc = FLASH_VERIFY_MISMATCH;
+	}
+	if (diff != map)
+		free(diff);
+	return rc;
+}
+
+/*
+ * Repair after a verify: erase and program again only the blocks the
+ * verify left set in map, and verify those once more.
+ */
+int capi_flash_repair(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, uint8_t *map,
+			unsigned long *ndiff)
+{
+	int nblocks, pblocks, rc;
+
+	*ndiff = 0;
+	rc = flash_image_blocks(h, img, &nblocks);
+	if (0 != rc)
+		return rc;
+	rc = flash_fingerprint_drop(h, address);
+	if (0 != rc)
+		return rc;
+	address = flash_addr(h, address);
+	rc = flash_payload_blocks(h, img, &pblocks, false);
+	if (0 != rc)
+		return rc;
+	rc = flash_reset_wait(h);
+	if (0 != rc)
+		return rc;
+	return flash_reprogram(h, img, address, map, nblocks, pblocks, ndiff);
+}
+
+
+/*
+ * Read back nbytes of flash at address in chunks. get() hands out a
+ * buffer for up to chunk words, put() takes it back with the number of
+ * bytes read into it. Used by read, audit and dump.
+ */
+struct read_sink {
+	long chunk;
+	uint32_t *(*get)(void *arg);
+	int (*put)(void *arg, uint32_t *buf, size_t len, int address);
+	void *arg;
+};
+
+static int flash_read_chunks(struct capi_flash *h, uint32_t address,
+			uint64_t nbytes, struct capi_flash_image *img,
+			struct read_sink *s)
+{
+	struct flash_reader r;
+	struct flash_op o;
+	uint64_t nwords = (nbytes + 3) / 4, i = 0;
+	uint32_t *buf;
+	size_t len;
+	long k, j;
+	int rc, dat, ma, ma0 = 0, bc = 0;
+
+	op_start(h, &o, CAPI_FLASH_OP_READ, img);
+	rc = flash_reset_wait(h);
+	if (0 == rc)
+		rc = flash_read_start(&r, h, flash_addr(h, address));
+	while (0 == rc && i < nwords) {
+		buf = s->get(s->arg);
+		k = s->chunk;
+		if (nwords - i < (uint64_t)k)
+			k = nwords - i;
+		len = k * 4;
+		if (nbytes - i * 4 < len)
+			len = nbytes - i * 4;
+		for (j = 0; 0 == rc && j < k; j++, i++) {
+			rc = flash_read_next(&r, &dat, &ma);
+			if (0 == j)
+				ma0 = ma;
+			buf[j] = dat;
+			if (0 == rc && ((i+1) % h->block_words) == 0)
+				rc = flash_block_done(h, CAPI_FLASH_OP_READ,
+						bc++);
+		}
+		if (0 == rc)
+			rc = s->put(s->arg, buf, len, ma0);
+	}
+	if (0 == rc)
+		rc = flash_reset_wait(h);
+	return op_done(h, &o, rc, nwords);
+}
+
+#define READ_CHUNK_WORDS  1024
+
+struct read_buf {
+	struct capi_flash *h;
+	uint32_t chunk[READ_CHUNK_WORDS];
+	char *out;
+};
+
+static uint32_t *read_get(void *arg)
+{
+	struct read_buf *rb = arg;
+
+	return rb->chunk;
+}
+
+static int read_put(void *arg, uint32_t *buf, size_t len, int address)
+{
+	struct read_buf *rb = arg;
+
+	(void)address;
+	memcpy(rb->out, buf, len);
+	rb->out += len;
+	return 0;
+}
+
+int capi_flash_read(struct capi_flash *h, uint32_t address, void *buf,
+			size_t len)
+{
+	struct read_buf rb = { .h = h, .out = buf };
+	struct read_sink s = { READ_CHUNK_WORDS, read_get, read_put, &rb };
+
+	return flash_read_chunks(h, address, len, NULL, &s);
+}
+
+/*
+ * Audit: digest the flash and, with an image, compare it word by word
+ * and digest the image alongside.
+ */
+struct audit {
+	struct capi_flash *h;
+	struct capi_flash_image *img;
+	uint32_t fbuf[READ_CHUNK_WORDS], ibuf[READ_CHUNK_WORDS];
+	struct flash_digest fd, id;
+	const uint32_t *w;
+	long n;
+	unsigned long ndiff;
+	int block;
+};
+
+static uint32_t *audit_get(void *arg)
+{
+	struct audit *a = arg;
+
+	return a->fbuf;
+}
+
+static int audit_put(void *arg, uint32_t *buf, size_t len, int address)
+{
+	struct capi_flash_event ev = { .type = CAPI_FLASH_EV_MISCOMPARE,
+				       .op = CAPI_FLASH_OP_READ };
+	struct audit *a = arg;
+	struct capi_flash *h = a->h;
+	size_t j, k = (len + 3) / 4;
+
+	digest_update(&a->fd, buf, len);
+	if (NULL == a->img)
+		return 0;
+	for (j = 0; j < k; j++) {
+		if (0 == a->n) {
+			a->n = flash_image_next(h, a->img, &a->w, k - j);
+			if (a->n < 0)
+				return -a->n;
+		}
+		a->ibuf[j] = *a->w++;
+		a->n--;
+		if (a->ibuf[j] != buf[j]) {
+			ev.address = address + (h->is_SPI ? 4 * j : j);
+			ev.block = (a->block * READ_CHUNK_WORDS + j) /
+				h->block_words;
+			ev.data = buf[j];
+			ev.expected = a->ibuf[j];
+			flash_event(h, &ev);
+			a->ndiff++;
+		}
+	}
+	a->block++;
+	digest_update(&a->id, a->ibuf, len);
+	return 0;
+}
+
+static void audit_digest(struct flash_digest *d, struct capi_flash_digest *out)
+{
+	out->crc32c = d->crc;
+	out->len = d->len;
+	digest_final(d, out->sha256);
+}
+
+int capi_flash_audit(struct capi_flash *h, uint32_t address,
+			struct capi_flash_image *img, uint64_t len,
+			struct capi_flash_digest *flash,
+			struct capi_flash_digest *image, unsigned long *ndiff)
+{
+	struct audit *a;
+	struct read_sink s = { READ_CHUNK_WORDS, audit_get, audit_put, NULL };
+	int rc;
+
+	*ndiff = 0;
+	a = calloc(1, sizeof(*a));
+	if (NULL == a) {
+		flash_err(h, "Out of memory");
+		return ENOMEM;
+	}
+	a->h = h;
+	a->img = img;
+	digest_init(&a->fd);
+	digest_init(&a->id);
+	s.arg = a;
+	if (img)
+		image_seek(img, 0);
+	rc = flash_read_chunks(h, address, len, img, &s);
+	if (0 == rc) {
+		audit_digest(&a->fd, flash);
+		if (img)
+			audit_digest(&a->id, image);
+		*ndiff = a->ndiff;
+		if (img && (a->ndiff || flash->crc32c != image->crc32c ||
+			    strcmp(flash->sha256, image->sha256)))
+			rc = FLASH_VERIFY_MISMATCH;
+	}
+	free(a);
+	return rc;
+}
+
+/* The same as sha256sum and crc32c of the image file */
+int capi_flash_image_digest(struct capi_flash_image *img,
+			struct capi_flash_digest *d)
+{
+	struct flash_digest fd;
+	const uint32_t *w;
+	uint64_t pos, len, used = 0;
+	long n;
+
+	digest_init(&fd);
+	for (image_seek(img, 0); img->pos < img->words; ) {
+		pos = img->pos;
+		n = image_next(img, &w, img->words - pos);
+		if (n < 0)
+			return -n;
+		if (pos >= img->words)
+			break;			/* A stream ended at pos */
+		len = (uint64_t)n * 4;
+		if (img->size_known && len > img->size - pos * 4)
+			len = img->size - pos * 4;
+		digest_update(&fd, w, len);
+		if (!words_erased(w, n))
+			used = pos + words_used(w, n);
+	}
+	image_seek(img, 0);
+	/* Whole image read, the payload scan comes for free */
+	img->payload = used * 4 < (uint64_t)img->size ? used * 4 :
+		(uint64_t)img->size;
+	img->payload_known = true;
+	audit_digest(&fd, d);
+	return 0;
+}
+
+/*
+ * Dump output. The read loop fills DUMP_BUF_SIZE buffers and hands them
+ * to a writer thread, so a slow disk or pipe does not hold up the config
+ * space polling until all DUMP_BUFS buffers are queued.
+ */
+#define DUMP_BUFS      4
+#define DUMP_BUF_SIZE  (1024 * 1024)
+
+struct dump_writer {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t *buf[DUMP_BUFS];
+	size_t len[DUMP_BUFS];
+	unsigned long head;	/* Next buffer to fill */
+	unsigned long tail;	/* Next buffer to write */
+	bool done;
+	int err;
+	uint64_t stall_ns;	/* Read loop waiting for a free buffer */
+};
+
+static void *dump_write_thread(void *arg)
+{
+	struct dump_writer *dw = arg;
+	unsigned i;
+	size_t off;
+	ssize_t n;
+
+	pthread_mutex_lock(&dw->lock);
+	while (1) {
+		while (dw->tail == dw->head && !dw->done)
+			pthread_cond_wait(&dw->cond, &dw->lock);
+		if (dw->tail == dw->head)
+			break;
+		i = dw->tail % DUMP_BUFS;
+		pthread_mutex_unlock(&dw->lock);
+		for (off = 0; 0 == dw->err && off < dw->len[i]; off += n) {
+			n = write(dw->fd, (char *)dw->buf[i] + off,
+				dw->len[i] - off);
+			if (n < 0 && EINTR == errno)
+				n = 0;
+			else if (n <= 0)
+				dw->err = n < 0 ? errno : EIO;
+		}
+		pthread_mutex_lock(&dw->lock);
+		dw->tail++;
+		pthread_cond_broadcast(&dw->cond);
+	}
+	pthread_mutex_unlock(&dw->lock);
+	return NULL;
+}
+
+static int dump_start(struct dump_writer *dw, int fd)
+{
+	unsigned i;
+
+	memset(dw, 0, sizeof(*dw));
+	dw->fd = fd;
+	for (i = 0; i < DUMP_BUFS; i++) {
+		dw->buf[i] = malloc(DUMP_BUF_SIZE);
+		if (NULL == dw->buf[i])
+			goto err;
+	}
+	pthread_mutex_init(&dw->lock, NULL);
+	pthread_cond_init(&dw->cond, NULL);
+	if (0 == pthread_create(&dw->thread, NULL, dump_write_thread, dw))
+		return 0;
+	pthread_cond_destroy(&dw->cond);
+	pthread_mutex_destroy(&dw->lock);
+ err:
+	for (i = 0; i < DUMP_BUFS; i++)
+		free(dw->buf[i]);
+	return ENOMEM;
+}
+
+/* Next free buffer, waits while all of them are queued for writing */
+static uint32_t *dump_get(void *arg)
+{
+	struct dump_writer *dw = arg;
+	uint64_t st = 0;
+
+	pthread_mutex_lock(&dw->lock);
+	if (dw->head - dw->tail == DUMP_BUFS) {
+		st = now_ns();
+		while (dw->head - dw->tail == DUMP_BUFS)
+			pthread_cond_wait(&dw->cond, &dw->lock);
+		dw->stall_ns += now_ns() - st;
+	}
+	pthread_mutex_unlock(&dw->lock);
+	return dw->buf[dw->head % DUMP_BUFS];
+}
+
+static int dump_put(void *arg, uint32_t *buf, size_t len, int address)
+{
+	struct dump_writer *dw = arg;
+
+	(void)buf;
+	(void)address;
+	pthread_mutex_lock(&dw->lock);
+	dw->len[dw->head % DUMP_BUFS] = len;
+	dw->head++;
+	pthread_cond_broadcast(&dw->cond);
+	pthread_mutex_unlock(&dw->lock);
+	return dw->err;
+}
+
+/* Wait for the queued buffers to be written, returns a write error */
+static int dump_finish(struct dump_writer *dw)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&dw->lock);
+	dw->done = true;
+	pthread_cond_broadcast(&dw->cond);
+	pthread_mutex_unlock(&dw->lock);
+	pthread_join(dw->thread, NULL);
+	pthread_cond_destroy(&dw->cond);
+	pthread_mutex_destroy(&dw->lock);
+	for (i = 0; i < DUMP_BUFS; i++)
+		free(dw->buf[i]);
+	return dw->err;
+}
+
+int capi_flash_dump(struct capi_flash *h, uint32_t address, uint64_t len,
+			int fd, uint64_t *stall_ns)
+{
+	struct dump_writer dw;
+	struct read_sink s = { DUMP_BUF_SIZE / 4, dump_get, dump_put, &dw };
+	int rc, wrc;
+
+	rc = dump_start(&dw, fd);
+	if (0 != rc) {
+		flash_err(h, "Can not start dump writer");
+		return rc;
+	}
+	rc = flash_read_chunks(h, address, len, NULL, &s);
+	wrc = dump_finish(&dw);
+	if (stall_ns)
+		*stall_ns = dw.stall_ns;
+	if (0 != wrc && (0 == rc || FLASH_CANCELED == rc)) {
+		flash_err(h, "Can not write: %s", strerror(wrc));
+		rc = EIO;
+	}
+	return rc;
+}
+
+static int flash_find_regs(struct capi_flash *h)
+{
+	struct capi_flash_info *info = &h->info;
+	int config_word = 0;
+	int sub_dev = 0;
+	int rc;
+
+	/* Look for VSEC Offset and locate Flash Registers */
+	rc = read_config_word(h->cfg, PCI_ID, &config_word);
+	if (0 == rc)
+		rc = read_config_word(h->cfg, SUB_DEV_ID, &sub_dev);
+	if (0 != rc) {
+		flash_err(h, "Can not read PCI ID from %s", h->cfg_path);
+		return rc;
+	}
+	info->vendor = PCI_VENDORID(config_word);
+	info->device = PCI_DEVICEID(config_word);
+	info->subsys = PCI_DEVICEID(sub_dev);
+	info->psl_id = info->subsys;
+	// Check for known CAPI device
+	if ((info->vendor != IBM_PCIID) || ((info->device != CAPI_PCIID) &&
+	    (info->device != CAPI_LEGACY0) && (info->device != CAPI_LEGACY1))) {
+		flash_err(h, "Unknown Vendor (0x%x) or Device ID (0x%x)",
+			info->vendor, info->device);
+		return ENODEV;
+	}
+
+	rc = search_capi_vsec(h, &info->vsec_offset, &config_word);
+	if (0 != rc)
+		return rc;
+	// Get VSEC size and revision
+	info->vsec_rev = VSEC_REV(config_word);
+	info->vsec_size = VSEC_LENGTH(config_word);
+	// Set address for flash registers
+	if (info->vsec_size == 0x80) {
+		h->addr_reg = info->vsec_offset + FLASH_ADDR_OFFSET;
+		h->size_reg = info->vsec_offset + FLASH_SIZE_OFFSET;
+		h->cntl_reg = info->vsec_offset + FLASH_CNTL_OFFSET;
+		h->data_reg = info->vsec_offset + FLASH_DATA_OFFSET;
+	} else {
+		// Hard code register values for legacy devices
+		info->legacy = true;
+		h->addr_reg = 0x920;
+		h->size_reg = 0x924;
+		h->cntl_reg = 0x928;
+		h->data_reg = 0x92c;
+	}
+	info->addr_reg = h->addr_reg;
+	info->size_reg = h->size_reg;
+	info->cntl_reg = h->cntl_reg;
+	info->data_reg = h->data_reg;
+	return 0;
+}
+
+/*
+ * Per card advisory lock. flock() on a file that outlives the card's
+ * sysfs directory, which a reset removes and creates again. The lock
+ * goes away with the process, the file only tells who holds it.
+ */
+int capi_flash_lock(int card, const char *sim_file, int *fd, char *owner,
+			size_t len)
+{
+	char path[PATH_MAX], buf[128];
+	ssize_t n;
+	int rc;
+
+	if (sim_file)
+		snprintf(path, sizeof(path), "%s.lock", sim_file);
+	else {
+		mkdir(CXL_LOCK_DIR, 0755);
+		snprintf(path, sizeof(path), CXL_LOCK_DIR"/card%d.lock", card);
+	}
+	*fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (*fd < 0) {
+		rc = errno;
+		snprintf(owner, len, "%s: %s", path, strerror(rc));
+		return rc;
+	}
+	if (0 != flock(*fd, LOCK_EX | LOCK_NB)) {
+		rc = EWOULDBLOCK == errno ? EBUSY : errno;
+		n = pread(*fd, buf, sizeof(buf) - 1, 0);
+		buf[n > 0 ? n : 0] = '\0';
+		buf[strcspn(buf, "\n")] = '\0';
+		snprintf(owner, len, "%s", *buf ? buf : "another process");
+		close(*fd);
+		*fd = -1;
+		return rc;
+	}
+	n = snprintf(buf, sizeof(buf), "pid=%d start=%ld cmd=%s\n", getpid(),
+		(long)time(NULL), program_invocation_short_name);
+	if (0 == ftruncate(*fd, 0))
+		n = pwrite(*fd, buf, n, 0);	/* Owner info only */
+	return 0;
+}
+
+/*
+ * Legacy cards share one subsystem ID, psl-devices lists them by PSL
+ * revision instead.
+ */
+static void flash_psl_id(struct capi_flash *h, int card)
+{
+	char path[PATH_MAX], buf[32];
+	ssize_t n;
+	int fd;
+
+	if (PSL_LEGACY_SUBSYS != h->info.subsys)
+		return;
+	snprintf(path, sizeof(path), CXL_SYSFS_PATH"%d/psl_revision", card);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+	h->info.psl_id = strtol(buf, NULL, 0);
+}
+
+int capi_flash_open(struct capi_flash **hp, int card,
+			const struct capi_flash_params *p)
+{
+	struct capi_flash *h;
+	const char *type = p->type ? p->type : "BPIx16";
+	int block_size = p->block_size_kb ? p->block_size_kb :
+		DEFAULT_BLOCK_SIZE;
+	unsigned i;
+	int rc;
+
+	*hp = h = calloc(1, sizeof(*h));
+	if (NULL == h)
+		return ENOMEM;
+	h->cfg = -1;
+	h->lock_fd = -1;
+	for (i = 0; i < POLL_OPS; i++)
+		h->poll[i].name = poll_policies[i].name;
+	h->is_SPI = strcmp(type, "BPIx16") != 0;
+	h->block_words = block_size * 1024 / 4;
+
+	for (i = 0; i < sizeof(port_credits) / sizeof(port_credits[0]); i++)
+		if (strcmp(type, port_credits[i].type) == 0)
+			h->type_credits = port_credits[i].credits;
+	h->credits = p->credits < 0 ? h->type_credits : p->credits;
+	h->read_window = p->read_window ? p->read_window : FLASH_READ_SIZE;
+	if (h->read_window < 1 || h->read_window > FLASH_READ_MAX) {
+		flash_err(h, "Read window %d not in 1..%d", h->read_window,
+			FLASH_READ_MAX);
+		return EINVAL;
+	}
+
+	h->probe = p->probe;
+	h->trim = !p->no_trim;
+	if (!p->locked && !p->probe) {
+		char owner[128];
+
+		rc = capi_flash_lock(card, p->sim_file, &h->lock_fd, owner,
+			sizeof(owner));
+		if (EBUSY == rc)
+			flash_err(h, "card%d is locked by %s", card, owner);
+		else if (0 != rc)
+			flash_err(h, "Can not lock card%d: %s", card, owner);
+		if (0 != rc)
+			return rc;
+	}
+
+	if (!p->probe) {
+		if (p->sim_file)
+			rc = asprintf(&h->fp_path, "%s.fingerprint",
+				p->sim_file);
+		else
+			rc = asprintf(&h->fp_path,
+				CXL_LOCK_DIR"/card%d.fingerprint", card);
+		if (rc < 0) {
+			h->fp_path = NULL;
+			flash_err(h, "Out of memory");
+			return ENOMEM;
+		}
+	}
+
+	/* Check card_no and cfg_file */
+	if (p->sim_file) {
+		h->cfg_path = strdup(p->sim_file);
+		if (NULL == h->cfg_path)
+			return ENOMEM;
+		h->cfg = cfg_sim_open(h->cfg_path, p->sim_opts, h->is_SPI,
+				block_size);
+	} else {
+		if (asprintf(&h->cfg_path, CXL_SYSFS_PATH"%d"CXL_CONFIG,
+				card) == -1) {
+			h->cfg_path = NULL;
+			flash_err(h, "Can not Create: "CXL_SYSFS_PATH);
+			return ENOMEM;
+		}
+		h->cfg = open(h->cfg_path, (p->probe ? O_RDONLY : O_RDWR) |
+				O_CLOEXEC);
+	}
+	if (h->cfg < 0) {
+		flash_err(h, "Can not open %s: %s", h->cfg_path,
+			p->sim_file ? cfg_sim_error() : strerror(errno));
+		return EACCES;
+	}
+
+	trace_note("open card=%d type=%s blocksize=%d cfg=%s", card, type,
+		block_size, h->cfg_path);
+	h->info.cfg_path = h->cfg_path;
+	h->info.is_spi = h->is_SPI;
+	h->info.block_words = h->block_words;
+	h->info.credits = h->credits;
+	h->info.read_window = h->read_window;
+	rc = flash_find_regs(h);
+	if (0 == rc && !p->sim_file)
+		flash_psl_id(h, card);
+	if (0 == rc)
+		trace_note("regs card=%d addr=0x%x size=0x%x cntl=0x%x data=0x%x",
+			card, h->addr_reg, h->size_reg, h->cntl_reg,
+			h->data_reg);
+	return rc;
+}
+
+int capi_flash_trace_open(const char *path)
+{
+	return trace_open(path);
+}
+
+int capi_flash_trace_close(void)
+{
+	return trace_close();
+}
+
+void capi_flash_close(struct capi_flash *h)
+{
+	if (NULL == h)
+		return;
+	if (-1 != h->cfg) {
+		if (0 != h->cntl_reg && !h->probe)
+			flash_reset(h);
+		if (cfg_sim_active(h->cfg))
+			cfg_sim_close(h->cfg);
+		else
+			close(h->cfg);
+	}
+	if (-1 != h->lock_fd)
+		close(h->lock_fd);
+	free(h->cfg_path);
+	free(h->fp_path);
+	free(h);
+}
+
+const struct capi_flash_info *capi_flash_info(struct capi_flash *h)
+{
+	return &h->info;
+}
+
+const char *capi_flash_error(struct capi_flash *h)
+{
+	return h->err;
+}
+
+void capi_flash_set_event_cb(struct capi_flash *h, capi_flash_event_fn fn,
+			void *arg)
+{
+	h->event = fn;
+	h->event_arg = arg;
+}
+
+int capi_flash_set_pace(struct capi_flash *h, unsigned long rate,
+			int cpu_pct)
+{
+	if (cpu_pct < 0 || cpu_pct > 100) {
+		flash_err(h, "CPU budget %d%% is not 0 to 100", cpu_pct);
+		return EINVAL;
+	}
+	memset(&h->pace, 0, sizeof(h->pace));
+	h->pace.rate = rate;
+	h->pace.cpu_pct = 100 == cpu_pct ? 0 : cpu_pct;
+	h->pace.quantum = rate ? rate / 100 : PACE_CHECK_CALLS;
+	if (0 == h->pace.quantum)
+		h->pace.quantum = 1;
+	return 0;
+}
+
+void capi_flash_set_credits(struct capi_flash *h, int credits)
+{
+	h->credits = credits < 0 ? h->type_credits : credits;
+	h->info.credits = h->credits;
+}
+
+void capi_flash_cancel(struct capi_flash *h)
+{
+	h->cancel = 1;
+}
+
+const struct capi_flash_poll_stat *capi_flash_poll_stats(struct capi_flash *h,
+			int *n)
+{
+	*n = POLL_OPS;
+	return h->poll;
+}